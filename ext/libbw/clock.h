@@ -0,0 +1,69 @@
+/* {{{
+ * Copyright (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <copyright holder> ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <copyright holder> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. }}}
+ */
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/**
+ * @file clock.h
+ * @brief Monotonic clock
+ *
+ * This file contains functions that read the monotonic clock. Unlike the
+ * wall clock, it is not stepped by NTP or by the administrator, so it is
+ * the right clock for timeouts and for measuring durations.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+namespace bw {
+
+/**
+ * @brief Returns the monotonic time in milliseconds
+ *
+ * @return the time since an unspecified point in the past
+ */
+long long monotonicMs();
+
+/**
+ * @brief Returns the monotonic time in microseconds
+ *
+ * @return the time since an unspecified point in the past
+ */
+long long monotonicUs();
+
+/**
+ * @brief Returns the monotonic time in seconds
+ *
+ * @return the time since an unspecified point in the past, with a
+ *         resolution of nanoseconds
+ */
+double monotonicSeconds();
+
+} // end namespace bw
+
+#endif /* CLOCK_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
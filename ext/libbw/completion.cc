@@ -31,6 +31,12 @@
 #include <cstdlib>
 #include <algorithm>
 #include <vector>
+#include <sstream>
+#include <cstdio>
+
+#include <sys/time.h>
+#include <sys/select.h>
+#include <unistd.h>
 
 #include "bwconfig.h"
 
@@ -40,6 +46,7 @@
 #endif
 
 #include "completion.h"
+#include "clock.h"
 #include "stringutil.h"
 
 namespace bw {
@@ -64,6 +71,9 @@ class ReadlineLineReader : public AbstractLineReader {
         bool haveCompletion() const;
         void setCompletor(Completor *comp);
 
+        bool haveIncrementalFilter() const;
+        void setIncrementalFilter(bool enabled);
+
     private:
         Completor *m_completor;
 };
@@ -115,6 +125,8 @@ LineReader *LineReader::defaultLineReader(const std::string &prompt)
 AbstractLineReader::AbstractLineReader(const std::string &prompt)
     : m_prompt(prompt)
     , m_eof(false)
+    , m_timeout(0)
+    , m_timedOut(false)
 {}
 
 /* ---------------------------------------------------------------------------------------------- */
@@ -135,6 +147,30 @@ bool AbstractLineReader::eof() const
     return m_eof;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+void AbstractLineReader::setTimeout(long timeout)
+{
+    m_timeout = timeout;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+long AbstractLineReader::getTimeout() const
+{
+    return m_timeout;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void AbstractLineReader::setTimedOut(bool timedOut)
+{
+    m_timedOut = timedOut;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool AbstractLineReader::timedOut() const
+{
+    return m_timedOut;
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 void AbstractLineReader::readHistory(const std::string &file)
     throw (IOError)
@@ -179,6 +215,18 @@ void AbstractLineReader::setCompletor(Completor *comp)
     (void)comp;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+bool AbstractLineReader::haveIncrementalFilter() const
+{
+    return false;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void AbstractLineReader::setIncrementalFilter(bool enabled)
+{
+    (void)enabled;
+}
+
 /* }}} */
 /* SimpleLineReader {{{ */
 
@@ -195,6 +243,32 @@ std::string SimpleLineReader::readLine(const char *prompt)
         std::cout << getPrompt();
     else
         std::cout << prompt;
+    std::cout.flush();
+
+    // a terminal in canonical mode is only readable when the line is complete
+    setTimedOut(false);
+    if (getTimeout() > 0 && std::cin.rdbuf()->in_avail() <= 0) {
+        long long deadline = monotonicMs() + getTimeout();
+        int ready;
+        do {
+            long long remaining = std::max(deadline - monotonicMs(), 0LL);
+            fd_set fds;
+            struct timeval tv;
+
+            FD_ZERO(&fds);
+            FD_SET(STDIN_FILENO, &fds);
+            tv.tv_sec = remaining / 1000;
+            tv.tv_usec = (remaining % 1000) * 1000;
+            ready = select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv);
+        } while (ready < 0 && errno == EINTR);
+
+        if (ready == 0) {
+            std::cout << std::endl;
+            setTimedOut(true);
+            return ret;
+        }
+    }
+
     std::getline(std::cin, ret, '\n');
     if (std::cout.eof())
         setEof(true);
@@ -234,11 +308,110 @@ char **readline_line_reader_complete(const char *text, int start, int end)
         }
     }
 
+    // the completor may be case-insensitive, never remove what the user typed
+    if (replacement.size() < std::strlen(text))
+        replacement = text;
+
     completions.insert(completions.begin(), replacement);
 
     return stringvector_to_array(completions);
 }
 
+/* incremental filter {{{ */
+
+#define FILTER_LINES 5
+
+/* ---------------------------------------------------------------------------------------------- */
+static bool g_filter_shown;
+static std::string g_filter_text;
+
+/* ---------------------------------------------------------------------------------------------- */
+static void readline_filter_redisplay()
+{
+    rl_redisplay();
+
+    std::string text(rl_line_buffer, rl_end);
+    if (!g_current_completor || (text == g_filter_text && g_filter_shown))
+        return;
+    g_filter_text = text;
+
+    std::vector<std::string> matches;
+    size_t total = g_current_completor->filter(text, matches, FILTER_LINES);
+    if (matches.empty() && !g_filter_shown)
+        return;
+
+    int rows, cols;
+    rl_get_screen_size(&rows, &cols);
+    if (cols <= 4)
+        return;
+
+    // draw below the line with relative cursor movements only, so that it
+    // also works if the terminal scrolls
+    std::string out;
+    size_t lines = 0;
+    for (std::vector<std::string>::const_iterator it = matches.begin();
+            it != matches.end(); ++it, ++lines) {
+        std::string line = "  " + *it;
+        if (it + 1 == matches.end() && total > matches.size()) {
+            std::stringstream ss;
+            ss << "  ... " << total - matches.size() << " more";
+            line = ss.str();
+        }
+        out += "\r\n\e[K" + line.substr(0, cols - 1);
+    }
+    if (lines == 0) {
+        out += "\r\n";
+        lines++;
+    }
+    out += "\e[J";
+
+    size_t column = (std::strlen(rl_display_prompt) + rl_point) % cols;
+    std::stringstream ss;
+    ss << "\e[" << lines << "A\r";
+    if (column > 0)
+        ss << "\e[" << column << "C";
+    out += ss.str();
+
+    std::fputs(out.c_str(), rl_outstream);
+    std::fflush(rl_outstream);
+    g_filter_shown = !matches.empty();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void readline_filter_clear()
+{
+    // readline has moved to the line below the input, i.e. the first filter line
+    if (g_filter_shown) {
+        std::fputs("\r\e[J", rl_outstream);
+        std::fflush(rl_outstream);
+    }
+
+    g_filter_shown = false;
+    g_filter_text.clear();
+}
+
+/* }}} */
+
+/* timeout {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+static long long g_deadline;
+static bool g_timed_out;
+
+/* ---------------------------------------------------------------------------------------------- */
+// called by readline about ten times per second while it waits for a key
+static int readline_timeout_hook()
+{
+    if (monotonicMs() >= g_deadline) {
+        g_timed_out = true;
+        rl_done = 1;
+    }
+
+    return 0;
+}
+
+/* }}} */
+
 /* ---------------------------------------------------------------------------------------------- */
 ReadlineLineReader::ReadlineLineReader(const std::string &prompt)
     : AbstractLineReader(prompt)
@@ -250,8 +423,20 @@ std::string ReadlineLineReader::readLine(const char *prompt)
     char *line_read;
     std::string ret;
 
+    g_timed_out = false;
+    if (getTimeout() > 0) {
+        g_deadline = monotonicMs() + getTimeout();
+        rl_event_hook = readline_timeout_hook;
+    }
     line_read = readline(prompt ? prompt : getPrompt().c_str());
-    if (!line_read)
+    rl_event_hook = NULL;
+    readline_filter_clear();
+
+    // what has been typed so far doesn't count
+    setTimedOut(g_timed_out);
+    if (g_timed_out)
+        std::free(line_read);
+    else if (!line_read)
         setEof(true);
     else if (*line_read) {
         if (!prompt)
@@ -343,6 +528,18 @@ void ReadlineLineReader::setCompletor(Completor *comp)
         rl_attempted_completion_function = NULL;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+bool ReadlineLineReader::haveIncrementalFilter() const
+{
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ReadlineLineReader::setIncrementalFilter(bool enabled)
+{
+    rl_redisplay_function = enabled ? readline_filter_redisplay : rl_redisplay;
+}
+
 /* }}} */
 
 #endif
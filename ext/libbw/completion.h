@@ -79,6 +79,31 @@ class Completor {
                                                   const std::string &full_text,
                                                   size_t            start_idx,
                                                   ssize_t           end_idx) = 0;
+
+        /**
+         * @brief Filter function
+         *
+         * This function is used for the incremental filter of the LineReader
+         * (see LineReader::setIncrementalFilter()). It must supply the
+         * values that match the currently entered text. It's called after
+         * each key press, so it should be fast.
+         *
+         * The default implementation doesn't find anything.
+         *
+         * @param[in] text the currently entered line
+         * @param[out] matches the matching values, at most @p max
+         * @param[in] max the maximum number of values in @p matches
+         * @return the total number of matching values
+         */
+        virtual size_t filter(const std::string         &text,
+                              std::vector<std::string>  &matches,
+                              size_t                    max)
+        {
+            (void)text;
+            (void)max;
+            matches.clear();
+            return 0;
+        }
 };
 
 /* }}} */
@@ -207,6 +232,48 @@ class LineReader {
          */
         virtual void setCompletor(Completor *comp) = 0;
 
+        /**
+         * @brief Checks if the implementation has an incremental filter
+         *
+         * Checks if the implementation can display the values that match the
+         * current line while the user types.
+         *
+         * @return @c true if the implementation has an incremental filter,
+         *         @c false otherwise
+         */
+        virtual bool haveIncrementalFilter() const = 0;
+
+        /**
+         * @brief Enables the incremental filter
+         *
+         * If enabled, the values that Completor::filter() returns for the
+         * current line are displayed below the line after each key press.
+         * Has no effect if no completor has been set.
+         *
+         * @param[in] enabled @c true if the filter should be displayed
+         */
+        virtual void setIncrementalFilter(bool enabled) = 0;
+
+        /**
+         * @brief Sets the timeout of readLine()
+         *
+         * If no line has been entered when the time is up, readLine() returns
+         * an empty line and timedOut() returns @c true. Typing doesn't stop
+         * the time. The prompt is displayed before the time starts.
+         *
+         * @param[in] timeout the timeout of each following readLine() call in
+         *            milliseconds, 0 to wait forever
+         */
+        virtual void setTimeout(long timeout) = 0;
+
+        /**
+         * @brief Checks if the last line has timed out
+         *
+         * @return @c true if the last call of readLine() returned because the
+         *         timeout set with setTimeout() has expired, @c false otherwise
+         */
+        virtual bool timedOut() const = 0;
+
         /**
          * @brief Checks if the line is editable
          *
@@ -320,6 +387,34 @@ class AbstractLineReader : public LineReader {
          */
         void setCompletor(Completor *comp);
 
+        /**
+         * @brief Checks if the implementation has an incremental filter
+         *
+         * Returns always @c false.
+         *
+         * @return @c false
+         */
+        bool haveIncrementalFilter() const;
+
+        /**
+         * @brief Enables the incremental filter
+         *
+         * Does nothing.
+         *
+         * @param[in] enabled ignored
+         */
+        void setIncrementalFilter(bool enabled);
+
+        /**
+         * @copydoc LineReader::setTimeout()
+         */
+        void setTimeout(long timeout);
+
+        /**
+         * @copydoc LineReader::timedOut()
+         */
+        bool timedOut() const;
+
     protected:
         /**
          * @brief Sets the EOF status
@@ -330,9 +425,27 @@ class AbstractLineReader : public LineReader {
          */
         void setEof(bool eof);
 
+        /**
+         * @brief Returns the timeout
+         *
+         * @return the timeout set with setTimeout() in milliseconds
+         */
+        long getTimeout() const;
+
+        /**
+         * @brief Sets the timeout status
+         *
+         * Sets the status that is returned by timedOut().
+         *
+         * @param[in] timedOut the timeout status
+         */
+        void setTimedOut(bool timedOut);
+
     private:
         std::string m_prompt;
         bool m_eof;
+        long m_timeout;
+        bool m_timedOut;
 };
 
 /* }}} */
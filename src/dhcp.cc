@@ -0,0 +1,355 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <algorithm>
+#include <cstddef>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <libbw/clock.h>
+#include <libbw/debug.h>
+
+#include "dhcp.h"
+#include "trace.h"
+
+#define DHCP_SERVER_PORT        67
+#define DHCP_CLIENT_PORT        68
+#define DHCP_MAGIC_COOKIE       0x63825363
+
+#define BOOTREQUEST             1
+#define BOOTREPLY               2
+
+#define DHCPACK                 5
+#define DHCPINFORM              8
+
+#define OPT_PAD                 0
+#define OPT_OVERLOAD            52
+#define OPT_MESSAGE_TYPE        53
+#define OPT_SERVER_IDENTIFIER   54
+#define OPT_PARAMETER_LIST      55
+#define OPT_MAX_MESSAGE_SIZE    57
+#define OPT_VENDOR_CLASS        60
+#define OPT_TFTP_SERVER         66
+#define OPT_BOOT_FILE           67
+#define OPT_PXELINUX_CONFIG     209
+#define OPT_PXELINUX_PREFIX     210
+#define OPT_END                 255
+
+// the first retransmission, doubled each time like RFC 2131 recommends
+#define FIRST_RETRY_MS          1000
+
+/**
+ * @brief BOOTP/DHCP message (RFC 2131)
+ */
+struct dhcp_message {
+    uint8_t     op;
+    uint8_t     htype;
+    uint8_t     hlen;
+    uint8_t     hops;
+    uint32_t    xid;
+    uint16_t    secs;
+    uint16_t    flags;
+    uint32_t    ciaddr;
+    uint32_t    yiaddr;
+    uint32_t    siaddr;
+    uint32_t    giaddr;
+    uint8_t     chaddr[16];
+    char        sname[64];
+    char        file[128];
+    uint32_t    cookie;
+    uint8_t     options[308];
+};
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string option_string(const uint8_t *data, size_t len)
+{
+    std::string str(reinterpret_cast<const char *>(data), len);
+
+    // some servers include the terminating null byte
+    return str.substr(0, str.find('\0'));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string ip_string(uint32_t addr)
+{
+    struct in_addr in;
+
+    in.s_addr = addr;
+    return inet_ntoa(in);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void parse_options(const uint8_t *data, size_t len, DhcpInform::Reply &reply,
+                          int &messageType, int &overload)
+{
+    size_t pos = 0;
+
+    while (pos < len && data[pos] != OPT_END) {
+        if (data[pos] == OPT_PAD) {
+            pos++;
+            continue;
+        }
+        if (pos + 2 > len || pos + 2 + data[pos+1] > len)
+            break;
+
+        uint8_t code = data[pos];
+        uint8_t optlen = data[pos+1];
+        const uint8_t *value = data + pos + 2;
+
+        switch (code) {
+            case OPT_MESSAGE_TYPE:
+                if (optlen == 1)
+                    messageType = value[0];
+                break;
+            case OPT_OVERLOAD:
+                if (optlen == 1)
+                    overload = value[0];
+                break;
+            case OPT_SERVER_IDENTIFIER:
+                if (optlen == 4) {
+                    uint32_t addr;
+                    std::memcpy(&addr, value, sizeof(addr));
+                    reply.serverIdentifier = ip_string(addr);
+                }
+                break;
+            case OPT_TFTP_SERVER:
+                reply.tftpServer = option_string(value, optlen);
+                break;
+            case OPT_BOOT_FILE:
+                reply.bootFile = option_string(value, optlen);
+                break;
+            case OPT_PXELINUX_CONFIG:
+                reply.configFile = option_string(value, optlen);
+                break;
+            case OPT_PXELINUX_PREFIX:
+                reply.pathPrefix = option_string(value, optlen);
+                break;
+        }
+
+        pos += 2 + optlen;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static size_t build_inform(struct dhcp_message &msg, uint32_t xid, uint32_t ciaddr,
+                           const unsigned char *mac)
+{
+    static const uint8_t parameters[] = {
+        OPT_SERVER_IDENTIFIER, OPT_TFTP_SERVER, OPT_BOOT_FILE,
+        OPT_PXELINUX_CONFIG, OPT_PXELINUX_PREFIX
+    };
+    static const char vendorClass[] = "PXEClient";
+
+    std::memset(&msg, 0, sizeof(msg));
+    msg.op = BOOTREQUEST;
+    msg.htype = 1;      // Ethernet
+    msg.hlen = 6;
+    msg.xid = xid;
+    msg.ciaddr = ciaddr;
+    std::memcpy(msg.chaddr, mac, 6);
+    msg.cookie = htonl(DHCP_MAGIC_COOKIE);
+
+    uint8_t *opt = msg.options;
+    *opt++ = OPT_MESSAGE_TYPE;
+    *opt++ = 1;
+    *opt++ = DHCPINFORM;
+
+    *opt++ = OPT_MAX_MESSAGE_SIZE;
+    *opt++ = 2;
+    *opt++ = sizeof(struct dhcp_message) >> 8;
+    *opt++ = sizeof(struct dhcp_message) & 0xff;
+
+    *opt++ = OPT_VENDOR_CLASS;
+    *opt++ = sizeof(vendorClass) - 1;
+    std::memcpy(opt, vendorClass, sizeof(vendorClass) - 1);
+    opt += sizeof(vendorClass) - 1;
+
+    *opt++ = OPT_PARAMETER_LIST;
+    *opt++ = sizeof(parameters);
+    std::memcpy(opt, parameters, sizeof(parameters));
+    opt += sizeof(parameters);
+
+    *opt++ = OPT_END;
+
+    // the BOOTP minimum of 300 bytes, which some relays insist on
+    return std::max<size_t>(opt - reinterpret_cast<uint8_t *>(&msg), 300);
+}
+
+/* DhcpInform {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+DhcpInform::DhcpInform(const NetworkInterface &netif)
+    : m_interface(netif)
+{}
+
+/* ---------------------------------------------------------------------------------------------- */
+DhcpInform::~DhcpInform()
+{}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool DhcpInform::parseReply(const void *packet, size_t len, uint32_t xid, Reply &reply)
+{
+    // copied, because the packet may not be aligned
+    struct dhcp_message answer;
+    std::memset(&answer, 0, sizeof(answer));
+    std::memcpy(&answer, packet, std::min(len, sizeof(answer)));
+    len = std::min(len, sizeof(answer));
+
+    if (len < offsetof(struct dhcp_message, options) ||
+            answer.op != BOOTREPLY || answer.xid != xid ||
+            answer.cookie != htonl(DHCP_MAGIC_COOKIE))
+        return false;
+
+    Reply candidate;
+    int messageType = 0, overload = 0;
+    parse_options(answer.options, len - offsetof(struct dhcp_message, options),
+                  candidate, messageType, overload);
+    if (overload & 1)
+        parse_options(reinterpret_cast<uint8_t *>(answer.file), sizeof(answer.file),
+                      candidate, messageType, overload);
+    if (overload & 2)
+        parse_options(reinterpret_cast<uint8_t *>(answer.sname), sizeof(answer.sname),
+                      candidate, messageType, overload);
+    if (messageType != DHCPACK)
+        return false;
+
+    if (answer.siaddr != 0)
+        candidate.nextServer = ip_string(answer.siaddr);
+    if (!(overload & 1) && candidate.bootFile.empty())
+        candidate.bootFile = std::string(answer.file, strnlen(answer.file, sizeof(answer.file)));
+    if (!(overload & 2) && candidate.tftpServer.empty())
+        candidate.tftpServer = std::string(answer.sname, strnlen(answer.sname,
+                                                                 sizeof(answer.sname)));
+
+    reply = candidate;
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool DhcpInform::query(Reply &reply, int timeout)
+    throw (ApplicationError)
+{
+    TraceSpan span("DHCPINFORM", m_interface.getName());
+
+    if (!m_interface.hasIp())
+        throw ApplicationError("DHCPINFORM needs an IPv4 address on " + m_interface.getName());
+
+    struct in_addr ciaddr;
+    inet_aton(m_interface.getIp(NetworkInterface::IF_DOT).c_str(), &ciaddr);
+
+    unsigned char mac[6];
+    std::sscanf(m_interface.getMac(NetworkInterface::MF_LOWERCASE | NetworkInterface::MF_COLON)
+                .c_str(), "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (fd < 0)
+        throw ApplicationError(std::string("socket(PF_INET) failed: ") + std::strerror(errno));
+
+    // the DHCP client of the system may use the port, too
+    int one = 1;
+    std::string ifname = m_interface.getName();
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(DHCP_CLIENT_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one)) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname.c_str(), ifname.size() + 1) != 0 ||
+            bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+        int error = errno;
+        close(fd);
+        throw ApplicationError("Cannot open the DHCP client port on " + ifname + ": " +
+                               std::strerror(error));
+    }
+
+    uint32_t xid = getpid() ^ (uint32_t)bw::monotonicMs() ^ (uint32_t)std::time(NULL) << 12;
+    struct dhcp_message msg;
+    size_t msglen = build_inform(msg, xid, ciaddr.s_addr, mac);
+
+    struct sockaddr_in server;
+    std::memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(DHCP_SERVER_PORT);
+    server.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+
+    long long deadline = bw::monotonicMs() + timeout * 1000LL;
+    long long nextSend = 0;
+    long retry = FIRST_RETRY_MS;
+    bool answered = false;
+
+    while (!answered) {
+        long long now = bw::monotonicMs();
+        if (now >= deadline)
+            break;
+
+        if (now >= nextSend) {
+            BW_DEBUG_DBG("Sending DHCPINFORM on %s (xid 0x%08x)", ifname.c_str(), xid);
+            if (sendto(fd, &msg, msglen, 0, reinterpret_cast<struct sockaddr *>(&server),
+                       sizeof(server)) < 0) {
+                int error = errno;
+                close(fd);
+                throw ApplicationError(std::string("Sending DHCPINFORM failed: ") +
+                                       std::strerror(error));
+            }
+            nextSend = now + retry;
+            retry *= 2;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, int(std::min(nextSend, deadline) - now));
+        if (ret <= 0)
+            continue;
+
+        struct dhcp_message answer;
+        ssize_t len = recv(fd, &answer, sizeof(answer), 0);
+        Reply candidate;
+        if (len < 0 || !parseReply(&answer, len, xid, candidate))
+            continue;
+
+        BW_DEBUG_DBG("DHCPACK from %s: next server '%s', TFTP server '%s', boot file '%s', "
+                     "config file '%s', path prefix '%s'", candidate.serverIdentifier.c_str(),
+                     candidate.nextServer.c_str(), candidate.tftpServer.c_str(),
+                     candidate.bootFile.c_str(), candidate.configFile.c_str(),
+                     candidate.pathPrefix.c_str());
+
+        reply = candidate;
+        answered = true;
+    }
+
+    close(fd);
+
+    return answered;
+}
+
+/* }}} */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
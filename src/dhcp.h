@@ -0,0 +1,129 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DHCP_H
+#define DHCP_H
+
+/**
+ * @file dhcp.h
+ * @brief Query of the boot options from the DHCP server
+ *
+ * This file contains a minimal DHCP client that asks the DHCP server for the
+ * boot options of an interface that has already been configured.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <string>
+
+#include <stdint.h>
+
+#include "global.h"
+#include "networkhelper.h"
+
+/* DhcpInform {{{ */
+
+/**
+ * @brief DHCPINFORM request (RFC 2131)
+ *
+ * A DHCPINFORM asks the DHCP server for the configuration parameters of a
+ * client that already has an IP address, without leasing an address. That
+ * doesn't interfere with the DHCP client of the system, and the answer is
+ * current, unlike a lease file that may be stale or missing (e.g. with
+ * NetworkManager or systemd-networkd).
+ *
+ * The request says that it comes from a PXE client (vendor class
+ * identifier @c PXEClient), because many servers only send the boot options
+ * to PXE clients.
+ *
+ * Sending needs root privileges, because the client port 68 is privileged.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class DhcpInform {
+    public:
+        /**
+         * @brief Boot options of the reply
+         *
+         * All members are empty if the server didn't send the option.
+         */
+        struct Reply {
+            std::string     serverIdentifier;   /**< the DHCP server (option 54) */
+            std::string     nextServer;         /**< @c siaddr, the next server */
+            std::string     tftpServer;         /**< TFTP server name (option 66) */
+            std::string     bootFile;           /**< boot file name (option 67) */
+            std::string     configFile;         /**< PXELINUX configuration file (option 209) */
+            std::string     pathPrefix;         /**< PXELINUX path prefix (option 210) */
+        };
+
+    public:
+        /**
+         * @brief Parses a reply of the server
+         *
+         * Checks that @p packet is a DHCPACK for the request @p xid and
+         * reads the boot options. Options in the @c file and @c sname fields
+         * (option overload) are read, too.
+         *
+         * @param[in] packet the UDP payload
+         * @param[in] len the number of bytes in @p packet
+         * @param[in] xid the transaction ID of the request, in the byte
+         *            order of the message
+         * @param[out] reply the boot options, only set if the packet is
+         *             a matching DHCPACK
+         * @return @c true if @p packet is a matching DHCPACK, @c false if it
+         *         should be ignored
+         */
+        static bool parseReply(const void *packet, size_t len, uint32_t xid, Reply &reply);
+
+    public:
+        /**
+         * @brief Constructor
+         *
+         * @param[in] netif the interface, which must have an IPv4 address
+         */
+        DhcpInform(const NetworkInterface &netif);
+
+        /**
+         * @brief Destructor
+         *
+         * Deletes a DhcpInform.
+         */
+        virtual ~DhcpInform();
+
+    public:
+        /**
+         * @brief Sends the request and waits for the reply
+         *
+         * The request is broadcast on the interface and repeated with
+         * increasing intervals until a DHCPACK arrives or the time is up.
+         *
+         * @param[out] reply the boot options of the reply
+         * @param[in] timeout the maximum time to wait in seconds
+         * @return @c true if the server answered, @c false on timeout
+         * @exception ApplicationError if the request cannot be sent
+         */
+        bool query(Reply &reply, int timeout)
+            throw (ApplicationError);
+
+    private:
+        NetworkInterface    m_interface;
+};
+
+/* }}} */
+
+#endif /* DHCP_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
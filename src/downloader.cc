@@ -16,11 +16,23 @@
  */
 #include <stdexcept>
 #include <ostream>
+#include <algorithm>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+#include <strings.h>
+#include <fcntl.h>
 
 #include <curl/curl.h>
+#include <libbw/clock.h>
 #include <libbw/debug.h>
+#include <libbw/stringutil.h>
 
 #include "downloader.h"
+#include "tftp.h"
 
 bool Downloader::m_firstCalled = true;
 
@@ -30,22 +42,334 @@ bool Downloader::m_firstCalled = true;
 #  define CURL_GLOBAL_FLAGS   0
 #endif
 
+// fits into one Ethernet frame, see RFC 2348
+#define DEFAULT_TFTP_BLOCKSIZE  1468
+#define DEFAULT_TFTP_WINDOWSIZE 16
+
+// smaller files are not worth additional connections
+#define DEFAULT_HTTP_SEGMENTS   4
+#define MIN_SEGMENT_SIZE        (8LL * 1024 * 1024)
+#define SEGMENT_RETRIES         3
+#define SEGMENT_CONNECT_TIMEOUT 10L
+
+// interval for the peak rate and gap between two writes that counts as stall
+#define RATE_INTERVAL           1.0
+#define STALL_INTERVAL          1.0
+
+/* ---------------------------------------------------------------------------------------------- */
+// the prefetch thread and the menu use the same share, userptr is the array of mutexes
+static void share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    (void)curl;
+    (void)access;
+
+    pthread_mutex_lock(&static_cast<pthread_mutex_t *>(userptr)[data]);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+    (void)curl;
+
+    pthread_mutex_unlock(&static_cast<pthread_mutex_t *>(userptr)[data]);
+}
+
+/* TransferContext {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+TransferContext::TransferContext()
+    throw (DownloadError)
+    : m_nativeTftp(true)
+    , m_tftpBlockSize(DEFAULT_TFTP_BLOCKSIZE)
+    , m_tftpWindowSize(DEFAULT_TFTP_WINDOWSIZE)
+    , m_httpSegments(DEFAULT_HTTP_SEGMENTS)
+    , m_aborted(false)
+{
+    Downloader::globalInit();
+    pthread_mutex_init(&m_mutex, NULL);
+    for (size_t i = 0; i < ARRAY_SIZE(m_shareMutexes); i++)
+        pthread_mutex_init(&m_shareMutexes[i], NULL);
+
+    m_share = curl_share_init();
+    if (!m_share)
+        throw DownloadError("curl_share_init returned NULL");
+
+    curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(m_share, CURLSHOPT_USERDATA, m_shareMutexes);
+
+    curl_lock_data shared[] = {
+        CURL_LOCK_DATA_DNS,
+        CURL_LOCK_DATA_SSL_SESSION,
+#if LIBCURL_VERSION_NUM >= 0x073900
+        CURL_LOCK_DATA_CONNECT,
+#endif
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(shared); i++) {
+        CURLSHcode err = curl_share_setopt(m_share, CURLSHOPT_SHARE, shared[i]);
+        if (err != CURLSHE_OK) {
+            curl_share_cleanup(m_share);
+            throw DownloadError(std::string("CURL error: ") + curl_share_strerror(err));
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+TransferContext::~TransferContext()
+{
+    curl_share_cleanup(m_share);
+    for (size_t i = 0; i < ARRAY_SIZE(m_shareMutexes); i++)
+        pthread_mutex_destroy(&m_shareMutexes[i]);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::setNativeTftp(bool native)
+{
+    m_nativeTftp = native;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool TransferContext::getNativeTftp() const
+{
+    return m_nativeTftp;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::setTftpBlockSize(unsigned int blocksize)
+{
+    m_tftpBlockSize = blocksize;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned int TransferContext::getTftpBlockSize() const
+{
+    return m_tftpBlockSize;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::setTftpWindowSize(unsigned int windowsize)
+{
+    m_tftpWindowSize = windowsize;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned int TransferContext::getTftpWindowSize() const
+{
+    return m_tftpWindowSize;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::setHttpSegments(unsigned int segments)
+{
+    m_httpSegments = segments;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned int TransferContext::getHttpSegments() const
+{
+    return m_httpSegments;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::setInterfaces(const StringVector &interfaces)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_interfaces = interfaces;
+    m_interfaceBytes.assign(interfaces.size(), 0);
+    m_interfaceFirst.assign(interfaces.size(), 0.0);
+    m_interfaceLast.assign(interfaces.size(), 0.0);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+const StringVector &TransferContext::getInterfaces() const
+{
+    return m_interfaces;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::addInterfaceBytes(size_t index, size_t bytes)
+{
+    double now = bw::monotonicSeconds();
+
+    // the prefetch thread and the main thread may download at the same time
+    pthread_mutex_lock(&m_mutex);
+    if (m_interfaceBytes[index] == 0)
+        m_interfaceFirst[index] = now;
+    m_interfaceLast[index] = now;
+    m_interfaceBytes[index] += bytes;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+std::vector<TransferContext::InterfaceStatistics> TransferContext::getInterfaceStatistics() const
+{
+    std::vector<InterfaceStatistics> result;
+
+    pthread_mutex_lock(&m_mutex);
+    for (size_t i = 0; i < m_interfaces.size(); i++) {
+        InterfaceStatistics stats;
+        stats.interface = m_interfaces[i];
+        stats.bytes = m_interfaceBytes[i];
+        stats.seconds = m_interfaceLast[i] - m_interfaceFirst[i];
+        result.push_back(stats);
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return result;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::abort()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_aborted = true;
+
+    // don't wait for the timeout of curl_multi_wait()
+#if LIBCURL_VERSION_NUM >= 0x074400
+    for (size_t i = 0; i < m_multis.size(); i++)
+        curl_multi_wakeup(m_multis[i]);
+#endif
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::resetAbort()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_aborted = false;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool TransferContext::isAborted() const
+{
+    pthread_mutex_lock(&m_mutex);
+    bool aborted = m_aborted;
+    pthread_mutex_unlock(&m_mutex);
+
+    return aborted;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::addMulti(CURLM *multi)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_multis.push_back(multi);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TransferContext::removeMulti(CURLM *multi)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_multis.erase(std::remove(m_multis.begin(), m_multis.end(), multi), m_multis.end());
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/* }}} */
+/* Downloader {{{ */
+
 /* ---------------------------------------------------------------------------------------------- */
 size_t Downloader::curl_write_callback(void *buffer, size_t size,
         size_t nmemb, void *userp)
 {
     Downloader *downloader = reinterpret_cast<Downloader *>(userp);
 
-    downloader->m_output.write((char *)buffer, size * nmemb);
-    BW_DEBUG_DBG("Writing %d*%d=%d bytes (%d)", size, nmemb, size*nmemb,
-                 int(downloader->m_output.good()));
+    // the first data decides if the download is split
+    if (!downloader->m_splitChecked)
+        downloader->split();
+    if (!downloader->m_segments.empty())
+        return downloader->writeSegment(downloader->m_segments[0], (char *)buffer, size * nmemb);
+
+    bool ok = downloader->write((char *)buffer, size * nmemb);
+    BW_DEBUG_DBG("Writing %d*%d=%d bytes (%d)", size, nmemb, size*nmemb, int(ok));
 
-    if (downloader->m_output.good())
+    if (ok)
         return size * nmemb;
     else
         return 0;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+bool Downloader::write(const char *buffer, size_t size)
+{
+    countBytes(size);
+
+    if (m_sink)
+        return m_sink->write(buffer, size);
+
+    if (m_output) {
+        m_output->write(buffer, size);
+        return m_output->good();
+    }
+
+    while (size > 0) {
+        ssize_t ret = ::write(m_outputFd, buffer, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        buffer += ret;
+        size -= ret;
+    }
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+size_t Downloader::curl_header_callback(char *buffer, size_t size,
+        size_t nitems, void *userdata)
+{
+    Downloader *downloader = reinterpret_cast<Downloader *>(userdata);
+    std::string line(buffer, size * nitems);
+    std::string::size_type colon = line.find(':');
+
+    // a new response after a redirection
+    if (bw::startsWith(line, "HTTP/", false)) {
+        downloader->m_etag.clear();
+        downloader->m_lastModified.clear();
+        downloader->m_acceptRanges = false;
+        return size * nitems;
+    }
+
+    if (colon == std::string::npos)
+        return size * nitems;
+
+    std::string name = line.substr(0, colon);
+    std::string value = bw::strip(line.substr(colon + 1), "\t \r\n");
+    if (strcasecmp(name.c_str(), "ETag") == 0)
+        downloader->m_etag = value;
+    else if (strcasecmp(name.c_str(), "Last-Modified") == 0)
+        downloader->m_lastModified = value;
+    else if (strcasecmp(name.c_str(), "Accept-Ranges") == 0)
+        downloader->m_acceptRanges = strcasecmp(value.c_str(), "bytes") == 0;
+
+    return size * nitems;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+size_t Downloader::curl_segment_write_callback(void *buffer, size_t size,
+        size_t nmemb, void *userp)
+{
+    Segment *segment = reinterpret_cast<Segment *>(userp);
+
+    return segment->parent->writeSegment(segment, (char *)buffer, size * nmemb);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+size_t Downloader::curl_segment_header_callback(char *buffer, size_t size,
+        size_t nitems, void *userdata)
+{
+    (void)buffer;
+    (void)userdata;
+
+    // the headers of the first request are enough
+    return size * nitems;
+}
 
 /* ---------------------------------------------------------------------------------------------- */
 int Downloader::curl_progress_callback(void *clientp, double dltotal, double
@@ -56,6 +380,10 @@ int Downloader::curl_progress_callback(void *clientp, double dltotal, double
     (void)ultotal;
     (void)ulnow;
 
+    // see reportSegmentProgress()
+    if (!downloader->m_segments.empty())
+        return 0;
+
     if (downloader->m_notifier)
         downloader->m_notifier->progressed(dltotal, dlnow);
 
@@ -65,16 +393,60 @@ int Downloader::curl_progress_callback(void *clientp, double dltotal, double
 
 /* ---------------------------------------------------------------------------------------------- */
 Downloader::Downloader(std::ostream &output, long timeout) throw (DownloadError)
-    : m_notifier(NULL)
-    , m_output(output)
+    : m_output(&output)
+    , m_outputFd(-1)
+    , m_sink(NULL)
+{
+    init(timeout);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+Downloader::Downloader(int fd, long timeout) throw (DownloadError)
+    : m_output(NULL)
+    , m_outputFd(fd)
+    , m_sink(NULL)
+{
+    init(timeout);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+Downloader::Downloader(DownloadSink &sink, long timeout) throw (DownloadError)
+    : m_output(NULL)
+    , m_outputFd(-1)
+    , m_sink(&sink)
+{
+    init(timeout);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::init(long timeout)
+    throw (DownloadError)
 {
     CURLcode err;
 
-    // perform CURL initialisation only once
-    if (m_firstCalled) {
-        curl_global_init(CURL_GLOBAL_FLAGS);
-        m_firstCalled = false;
-    }
+    // everything except the output, which each constructor sets
+    m_notifier = NULL;
+    m_context = NULL;
+    m_tftp = NULL;
+    m_curl_errorstring[0] = '\0';
+    m_nobody = false;
+    m_stallTimeout = 0;
+    m_acceptRanges = false;
+    m_maxSegments = 1;
+    m_splitChecked = true;
+    m_contentLength = -1;
+    m_baseOffset = 0;
+    m_startTime = 0.0;
+    m_firstByteTime = 0.0;
+    m_endTime = 0.0;
+    m_lastByteTime = 0.0;
+    m_rateStartTime = 0.0;
+    m_rateBytes = 0;
+    m_peakRate = 0.0;
+    m_stalls = 0;
+    m_bytes = 0;
+
+    globalInit();
 
     m_curl = curl_easy_init();
     if (!m_curl)
@@ -85,11 +457,12 @@ Downloader::Downloader(std::ostream &output, long timeout) throw (DownloadError)
     if (err != CURLE_OK)
         throw DownloadError("CURLOPT_ERRORBUFFER failed");
 
-    // timeout
+    // timeout for the connection, not for the whole transfer, so that a
+    // large file from a slow server doesn't count as a failed connection
     if (timeout != 0) {
-        err = curl_easy_setopt(m_curl, CURLOPT_TIMEOUT, 5);
+        err = curl_easy_setopt(m_curl, CURLOPT_CONNECTTIMEOUT, timeout);
         if (err != CURLE_OK)
-            throw DownloadError("CURLOPT_TIMEOUT failed");
+            throw DownloadError("CURLOPT_CONNECTTIMEOUT failed");
 
         // disable signals
         err = curl_easy_setopt(m_curl, CURLOPT_NOSIGNAL, 1);
@@ -107,15 +480,50 @@ Downloader::Downloader(std::ostream &output, long timeout) throw (DownloadError)
     err = curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
     if (err != CURLE_OK)
         throw DownloadError(std::string("CURL error: ") + m_curl_errorstring);
+
+    // don't treat HTTP error pages as successful downloads
+    err = curl_easy_setopt(m_curl, CURLOPT_FAILONERROR, 1);
+    if (err != CURLE_OK)
+        throw DownloadError(std::string("CURL error: ") + m_curl_errorstring);
+
+    // headers for getValidator()
+    err = curl_easy_setopt(m_curl, CURLOPT_HEADERFUNCTION, Downloader::curl_header_callback);
+    if (err != CURLE_OK)
+        throw DownloadError(std::string("CURL error: ") + m_curl_errorstring);
+
+    err = curl_easy_setopt(m_curl, CURLOPT_HEADERDATA, this);
+    if (err != CURLE_OK)
+        throw DownloadError(std::string("CURL error: ") + m_curl_errorstring);
+
+    // modification time of FTP files for getValidator()
+    err = curl_easy_setopt(m_curl, CURLOPT_FILETIME, 1);
+    if (err != CURLE_OK)
+        throw DownloadError(std::string("CURL error: ") + m_curl_errorstring);
+
+    // a server that stops sending is treated like one that cannot be reached
+    if (timeout != 0)
+        setStallTimeout(timeout);
 }
 
 /* ---------------------------------------------------------------------------------------------- */
 Downloader::~Downloader()
 {
+    clearSegments();
+    delete m_tftp;
     if (m_curl)
         curl_easy_cleanup(m_curl);
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::globalInit()
+{
+    // perform CURL initialisation only once
+    if (m_firstCalled) {
+        curl_global_init(CURL_GLOBAL_FLAGS);
+        m_firstCalled = false;
+    }
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 void Downloader::setUrl(const std::string &url) throw (DownloadError)
 {
@@ -135,6 +543,18 @@ std::string Downloader::getUrl() const
     return m_url;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::setTransferContext(TransferContext *context)
+    throw (DownloadError)
+{
+    CURLcode err;
+
+    m_context = context;
+    err = curl_easy_setopt(m_curl, CURLOPT_SHARE, context ? context->m_share : NULL);
+    if (err != CURLE_OK)
+        throw DownloadError(std::string("CURL error: ") + m_curl_errorstring);
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 void Downloader::setProgress(ProgressNotifier *notifier)
 {
@@ -166,21 +586,1004 @@ void Downloader::download() throw (DownloadError)
 {
     CURLcode err;
 
+    startStatistics();
+    if (isNativeTftp()) {
+        BW_DEBUG_DBG("Performing TFTP download");
+        try {
+            createTftpClient()->perform();
+        } catch (const DownloadError &) {
+            stopStatistics();
+            if (m_notifier)
+                m_notifier->finished();
+            throw;
+        }
+        stopStatistics();
+        if (m_notifier)
+            m_notifier->finished();
+        return;
+    }
+
     BW_DEBUG_DBG("Performing download");
     err = curl_easy_perform(m_curl);
+    stopStatistics();
     if (m_notifier)
         m_notifier->finished();
 
-    if (err != CURLE_OK) {
-        DownloadError error(std::string("CURL error: ") + m_curl_errorstring);
+    if (err != CURLE_OK)
+        throw makeError(err);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::setNoBody(bool nobody)
+    throw (DownloadError)
+{
+    CURLcode err;
+
+    m_nobody = nobody;
+    err = curl_easy_setopt(m_curl, CURLOPT_NOBODY, long(nobody));
+    if (err != CURLE_OK)
+        throw DownloadError(std::string("CURL error: ") + m_curl_errorstring);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::setStallTimeout(long seconds)
+    throw (DownloadError)
+{
+    CURLcode err;
 
-        // timeout
-        if (err == CURLE_COULDNT_CONNECT)
-            error.setErrorcode(DownloadError::DEC_CONNECTION_FAILED);
+    m_stallTimeout = seconds;
+    err = curl_easy_setopt(m_curl, CURLOPT_LOW_SPEED_LIMIT, seconds > 0 ? 1L : 0L);
+    if (err != CURLE_OK)
+        throw DownloadError(std::string("CURL error: ") + m_curl_errorstring);
 
-        throw error;
+    err = curl_easy_setopt(m_curl, CURLOPT_LOW_SPEED_TIME, seconds);
+    if (err != CURLE_OK)
+        throw DownloadError(std::string("CURL error: ") + m_curl_errorstring);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+std::string Downloader::getValidator() const
+{
+    std::stringstream ss;
+
+    if (isNativeTftp()) {
+        if (!m_tftp || m_tftp->getTransferSize() < 0)
+            return std::string();
+
+        ss << "tsize:" << m_tftp->getTransferSize();
+        return ss.str();
+    }
+
+    if (bw::startsWith(m_url, "http://", false) || bw::startsWith(m_url, "https://", false)) {
+        if (!m_etag.empty())
+            return "etag:" + m_etag;
+        if (!m_lastModified.empty())
+            return "modified:" + m_lastModified;
+        return std::string();
+    }
+
+    if (bw::startsWith(m_url, "ftp://", false)) {
+        long filetime = -1;
+#if LIBCURL_VERSION_NUM >= 0x073700
+        curl_off_t size = -1;
+        curl_easy_getinfo(m_curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+#else
+        double size = -1.0;
+        curl_easy_getinfo(m_curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &size);
+#endif
+
+        curl_easy_getinfo(m_curl, CURLINFO_FILETIME, &filetime);
+        if (filetime < 0 || size < 0)
+            return std::string();
+
+        ss << "size:" << (long long)size << ",mtime:" << filetime;
+        return ss.str();
+    }
+
+    return std::string();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+Downloader::Statistics Downloader::getStatistics() const
+{
+    Statistics statistics;
+    double end = m_endTime > 0 ? m_endTime : bw::monotonicSeconds();
+
+    statistics.nameLookupTime = -1.0;
+    statistics.connectTime = -1.0;
+    statistics.firstByteTime = m_firstByteTime > 0 ? m_firstByteTime - m_startTime : -1.0;
+    statistics.totalTime = m_startTime > 0 ? end - m_startTime : -1.0;
+    statistics.bytes = m_bytes;
+    statistics.averageRate = -1.0;
+    statistics.peakRate = -1.0;
+    statistics.stalls = m_stalls;
+    statistics.retransmits = 0;
+
+    if (m_firstByteTime > 0 && m_lastByteTime > m_firstByteTime) {
+        statistics.averageRate = m_bytes / (m_lastByteTime - m_firstByteTime);
+
+        // transfers shorter than one interval only have the average
+        statistics.peakRate = std::max(m_peakRate, statistics.averageRate);
+    }
+
+    if (isNativeTftp()) {
+        if (m_tftp) {
+            statistics.nameLookupTime = m_tftp->getResolveTime();
+            statistics.connectTime = m_tftp->getAnswerTime();
+            statistics.retransmits = m_tftp->getRetransmits();
+        }
+        return statistics;
+    }
+
+    // CURL knows better, e.g. the first byte of the headers
+    double value;
+    if (curl_easy_getinfo(m_curl, CURLINFO_NAMELOOKUP_TIME, &value) == CURLE_OK && value > 0)
+        statistics.nameLookupTime = value;
+    if (curl_easy_getinfo(m_curl, CURLINFO_CONNECT_TIME, &value) == CURLE_OK && value > 0)
+        statistics.connectTime = value;
+    if (curl_easy_getinfo(m_curl, CURLINFO_STARTTRANSFER_TIME, &value) == CURLE_OK && value > 0)
+        statistics.firstByteTime = value;
+
+    return statistics;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::startStatistics()
+{
+    m_startTime = bw::monotonicSeconds();
+    m_firstByteTime = 0.0;
+    m_endTime = 0.0;
+    m_lastByteTime = 0.0;
+    m_rateStartTime = 0.0;
+    m_rateBytes = 0;
+    m_peakRate = 0.0;
+    m_stalls = 0;
+    m_bytes = 0;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::countBytes(size_t size)
+{
+    double now = bw::monotonicSeconds();
+
+    if (m_firstByteTime == 0.0) {
+        m_firstByteTime = now;
+        m_rateStartTime = now;
+    } else if (now - m_lastByteTime >= STALL_INTERVAL) {
+        BW_DEBUG_DBG("No data for %.1f s from %s", now - m_lastByteTime, m_url.c_str());
+        m_stalls++;
     }
+
+    m_lastByteTime = now;
+    m_bytes += size;
+    m_rateBytes += size;
+
+    if (now - m_rateStartTime >= RATE_INTERVAL) {
+        m_peakRate = std::max(m_peakRate, m_rateBytes / (now - m_rateStartTime));
+        m_rateStartTime = now;
+        m_rateBytes = 0;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::stopStatistics()
+{
+    m_endTime = bw::monotonicSeconds();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool Downloader::isNativeTftp() const
+{
+    return (!m_context || m_context->getNativeTftp()) && TftpClient::isTftpUrl(m_url);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+TftpClient *Downloader::createTftpClient()
+    throw (DownloadError)
+{
+    delete m_tftp;
+    m_tftp = new TftpClient(m_url);
+
+    m_tftp->setBlockSize(m_context ? m_context->getTftpBlockSize() : DEFAULT_TFTP_BLOCKSIZE);
+    m_tftp->setWindowSize(m_context ? m_context->getTftpWindowSize() : DEFAULT_TFTP_WINDOWSIZE);
+    m_tftp->setSizeOnly(m_nobody);
+    m_tftp->setWriteFunction(Downloader::curl_write_callback, this);
+    if (m_notifier)
+        m_tftp->setProgressFunction(Downloader::curl_progress_callback, this);
+
+    return m_tftp;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+DownloadError Downloader::makeError(CURLcode err, const char *errorstring) const
+{
+    if (!errorstring || !*errorstring)
+        errorstring = *m_curl_errorstring ? m_curl_errorstring : curl_easy_strerror(err);
+
+    DownloadError error(std::string("CURL error: ") + errorstring);
+
+    // the server cannot be reached or doesn't send anything
+    if (err == CURLE_COULDNT_CONNECT || err == CURLE_COULDNT_RESOLVE_HOST ||
+            err == CURLE_OPERATION_TIMEDOUT)
+        error.setErrorcode(DownloadError::DEC_CONNECTION_FAILED);
+
+    return error;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::prepareSegments()
+{
+    clearSegments();
+
+    m_maxSegments = 1;
+    if (m_context && m_outputFd >= 0 && !m_nobody && !isNativeTftp() &&
+            (bw::startsWith(m_url, "http://", false) || bw::startsWith(m_url, "https://", false))) {
+        const StringVector &interfaces = m_context->getInterfaces();
+
+        m_maxSegments = std::max(size_t(m_context->getHttpSegments()), interfaces.size());
+
+        // the first request becomes the first segment
+        if (!interfaces.empty()) {
+            CURLcode err = curl_easy_setopt(m_curl, CURLOPT_INTERFACE,
+                                            ("if!" + interfaces[0]).c_str());
+            if (err != CURLE_OK)
+                BW_DEBUG_INFO("Cannot bind to %s: %s", interfaces[0].c_str(),
+                              curl_easy_strerror(err));
+        }
+    }
+
+    m_splitChecked = m_maxSegments < 2;
+    m_contentLength = -1;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::split()
+{
+    m_splitChecked = true;
+
+    if (!m_acceptRanges)
+        return;
+
+    long code = 0;
+    curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code != 200)
+        return;
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t length = -1;
+    curl_easy_getinfo(m_curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+#else
+    double length = -1.0;
+    curl_easy_getinfo(m_curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length);
+#endif
+    if (length < 2 * MIN_SEGMENT_SIZE)
+        return;
+
+    m_baseOffset = lseek(m_outputFd, 0, SEEK_CUR);
+    if (m_baseOffset < 0)
+        return;
+
+    m_contentLength = (long long)length;
+    unsigned int count = std::min((long long)m_maxSegments, m_contentLength / MIN_SEGMENT_SIZE);
+
+    // the segments are written in parallel, allocate the file once
+    int err = posix_fallocate(m_outputFd, m_baseOffset, m_contentLength);
+    if (err != 0)
+        BW_DEBUG_DBG("posix_fallocate() failed: %s", std::strerror(err));
+
+    // after a redirection, the segments can use the final URL directly
+    char *url = NULL;
+    curl_easy_getinfo(m_curl, CURLINFO_EFFECTIVE_URL, &url);
+
+    for (unsigned int i = 0; i < count; i++) {
+        Segment *segment = new Segment;
+        segment->curl = i == 0 ? m_curl : curl_easy_init();
+        segment->parent = this;
+        segment->start = m_contentLength * i / count;
+        segment->end = m_contentLength * (i + 1) / count;
+        segment->offset = segment->start;
+        segment->retries = 0;
+        segment->interface = -1;
+        segment->added = i == 0;
+        segment->checked = i == 0;
+        segment->noRange = false;
+        segment->errorstring[0] = '\0';
+        m_segments.push_back(segment);
+
+        // round-robin, so each interface gets its share of the file
+        const StringVector &interfaces = m_context->getInterfaces();
+        if (!interfaces.empty())
+            segment->interface = i % interfaces.size();
+
+        if (i == 0)
+            continue;
+
+        CURL *curl = segment->curl;
+        if (!curl || curl_easy_setopt(curl, CURLOPT_URL, url ? url : m_url.c_str()) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, segment->errorstring) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, SEGMENT_CONNECT_TIMEOUT) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT,
+                                 m_stallTimeout > 0 ? 1L : 0L) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, m_stallTimeout) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_SHARE, m_context->m_share) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
+                                 Downloader::curl_segment_write_callback) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_WRITEDATA, segment) != CURLE_OK ||
+                curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION,
+                                 Downloader::curl_segment_header_callback) != CURLE_OK ||
+                (segment->interface >= 0 &&
+                 curl_easy_setopt(curl, CURLOPT_INTERFACE,
+                                  ("if!" + interfaces[segment->interface]).c_str()) != CURLE_OK)) {
+            BW_DEBUG_INFO("Cannot set up the segments of %s, using one request", m_url.c_str());
+            clearSegments();
+            return;
+        }
+
+        try {
+            setSegmentRange(segment);
+        } catch (const DownloadError &err) {
+            BW_DEBUG_INFO("%s, using one request", err.what());
+            clearSegments();
+            return;
+        }
+    }
+
+    BW_DEBUG_DBG("Downloading %lld bytes of %s in %u segments", m_contentLength,
+                 m_url.c_str(), count);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+size_t Downloader::writeSegment(Segment *segment, const char *buffer, size_t size)
+{
+    // a server that ignores the range would send the file from the beginning
+    if (!segment->checked) {
+        long code = 0;
+
+        segment->checked = true;
+        curl_easy_getinfo(segment->curl, CURLINFO_RESPONSE_CODE, &code);
+        if (code != 206) {
+            BW_DEBUG_INFO("Range request for %s returned %ld", m_url.c_str(), code);
+            segment->noRange = true;
+            return 0;
+        }
+    }
+
+    // returning less than size stops the transfer at the end of the segment
+    size = size_t(std::min((long long)size, segment->end - segment->offset));
+
+    size_t written = 0;
+    while (written < size) {
+        ssize_t ret = pwrite(m_outputFd, buffer + written, size - written,
+                             m_baseOffset + segment->offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return 0;
+
+        written += ret;
+        segment->offset += ret;
+    }
+
+    countBytes(written);
+    if (segment->interface >= 0)
+        m_context->addInterfaceBytes(segment->interface, written);
+    reportSegmentProgress();
+
+    return written;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::setSegmentRange(Segment *segment)
+    throw (DownloadError)
+{
+    std::stringstream range;
+    range << segment->offset << "-" << segment->end - 1;
+
+    segment->checked = false;
+    CURLcode err = curl_easy_setopt(segment->curl, CURLOPT_RANGE, range.str().c_str());
+    if (err != CURLE_OK)
+        throw makeError(err, segment->errorstring);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+Downloader::Segment *Downloader::findSegment(CURL *curl) const
+{
+    for (size_t i = 0; i < m_segments.size(); i++)
+        if (m_segments[i]->curl == curl)
+            return m_segments[i];
+
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool Downloader::segmentsDone() const
+{
+    for (size_t i = 0; i < m_segments.size(); i++)
+        if (m_segments[i]->offset < m_segments[i]->end)
+            return false;
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::finishSegments()
+{
+    // like after a sequential download, the file offset is at the end
+    if (lseek(m_outputFd, m_baseOffset + m_contentLength, SEEK_SET) < 0)
+        BW_DEBUG_INFO("lseek() failed: %s", std::strerror(errno));
+
+    clearSegments();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::clearSegments()
+{
+    for (size_t i = 0; i < m_segments.size(); i++) {
+        if (m_segments[i]->curl && m_segments[i]->curl != m_curl)
+            curl_easy_cleanup(m_segments[i]->curl);
+        delete m_segments[i];
+    }
+    m_segments.clear();
+
+    if (m_curl)
+        curl_easy_setopt(m_curl, CURLOPT_RANGE, NULL);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downloader::reportSegmentProgress()
+{
+    if (!m_notifier)
+        return;
+
+    long long now = 0;
+    for (size_t i = 0; i < m_segments.size(); i++)
+        now += m_segments[i]->offset - m_segments[i]->start;
+
+    m_notifier->progressed(double(m_contentLength), double(now));
+}
+
+/* }}} */
+/* MultiDownloader {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+MultiDownloader::TransferProgress::TransferProgress(MultiDownloader *parent)
+    : total(0.0)
+    , now(0.0)
+    , m_parent(parent)
+{}
+
+/* ---------------------------------------------------------------------------------------------- */
+int MultiDownloader::TransferProgress::progressed(double total, double now)
+{
+    this->total = total;
+    this->now = now;
+    m_parent->transferProgressed();
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::TransferProgress::finished()
+{}
+
+/* ---------------------------------------------------------------------------------------------- */
+MultiDownloader::MultiDownloader()
+    throw (DownloadError)
+    : m_context(NULL)
+    , m_notifier(NULL)
+    , m_failedIndex(-1)
+    , m_maxWait(1000)
+{
+    m_multi = curl_multi_init();
+    if (!m_multi)
+        throw DownloadError("curl_multi_init returned NULL");
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+MultiDownloader::~MultiDownloader()
+{
+    cancelAll();
+
+    for (size_t i = 0; i < m_downloaders.size(); i++) {
+        delete m_downloaders[i];
+        delete m_progress[i];
+        delete m_errors[i];
+    }
+
+    if (m_context)
+        m_context->removeMulti(m_multi);
+    curl_multi_cleanup(m_multi);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::addDownloader(Downloader *downloader)
+{
+    m_downloaders.push_back(downloader);
+    m_progress.push_back(new TransferProgress(this));
+    m_states.push_back(TS_CANCELLED);
+    m_errors.push_back(NULL);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+size_t MultiDownloader::getSize() const
+{
+    return m_downloaders.size();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+Downloader *MultiDownloader::getDownloader(size_t index) const
+{
+    return m_downloaders.at(index);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::setProgress(ProgressNotifier *notifier)
+{
+    m_notifier = notifier;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::transferProgressed()
+{
+    double total = 0.0, now = 0.0;
+
+    if (!m_notifier)
+        return;
+
+    for (size_t i = 0; i < m_progress.size(); i++) {
+        total += m_progress[i]->total;
+        now += m_progress[i]->now;
+    }
+
+    m_notifier->progressed(total, now);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::start()
+    throw (DownloadError)
+{
+    for (size_t i = 0; i < m_downloaders.size(); i++)
+        startTransfer(i);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::startTransfer(size_t index)
+    throw (DownloadError)
+{
+    Downloader *dl = m_downloaders[index];
+
+    // all downloads share one context, so one context is enough for abort()
+    if (!m_context && dl->m_context) {
+        m_context = dl->m_context;
+        m_context->addMulti(m_multi);
+    }
+
+    dl->setProgress(m_notifier ? m_progress[index] : NULL);
+    dl->prepareSegments();
+    dl->startStatistics();
+
+    BW_DEBUG_DBG("Starting download of %s", dl->getUrl().c_str());
+    m_states[index] = TS_RUNNING;
+
+    if (dl->isNativeTftp()) {
+        try {
+            dl->createTftpClient()->start();
+        } catch (const DownloadError &err) {
+            finish(index, &err);
+        }
+        return;
+    }
+
+    CURLMcode err = curl_multi_add_handle(m_multi, dl->m_curl);
+    if (err != CURLM_OK)
+        throw DownloadError(std::string("CURL error: ") + curl_multi_strerror(err));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::finish(size_t index, const DownloadError *error)
+{
+    m_states[index] = error ? TS_FAILED : TS_DONE;
+    m_downloaders[index]->stopStatistics();
+    delete m_errors[index];
+    m_errors[index] = error ? new DownloadError(*error) : NULL;
+
+    BW_DEBUG_DBG("Download of %s finished: %s", m_downloaders[index]->getUrl().c_str(),
+                 error ? error->what() : "OK");
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool MultiDownloader::perform()
+    throw (DownloadError)
+{
+    int running;
+    CURLMcode err;
+
+    if (m_context && m_context->isAborted()) {
+        DownloadError error("Download aborted");
+        error.setErrorcode(DownloadError::DEC_ABORTED);
+        throw error;
+    }
+
+    err = curl_multi_perform(m_multi, &running);
+    if (err != CURLM_OK)
+        throw DownloadError(std::string("CURL error: ") + curl_multi_strerror(err));
+
+    CURLMsg *msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(m_multi, &msgs_left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        // msg is invalid after curl_multi_remove_handle()
+        CURL *curl = msg->easy_handle;
+        CURLcode result = msg->data.result;
+
+        for (size_t i = 0; i < m_downloaders.size(); i++) {
+            Downloader::Segment *segment = m_downloaders[i]->findSegment(curl);
+            if (!segment && m_downloaders[i]->m_curl != curl)
+                continue;
+
+            curl_multi_remove_handle(m_multi, curl);
+            if (segment)
+                finishSegment(i, segment, result);
+            else if (result == CURLE_OK)
+                finish(i, NULL);
+            else {
+                DownloadError error = m_downloaders[i]->makeError(result);
+                finish(i, &error);
+            }
+            break;
+        }
+    }
+
+    // segments are created in the write callback, where they cannot be added
+    for (size_t i = 0; i < m_downloaders.size(); i++)
+        if (m_states[i] == TS_RUNNING)
+            addSegments(i);
+
+    // handles that have been added again are not included in running
+    for (size_t i = 0; i < m_downloaders.size() && running == 0; i++)
+        if (m_states[i] == TS_RUNNING && !m_downloaders[i]->isNativeTftp())
+            running = 1;
+
+    // the built-in TFTP transfers are driven by the same loop
+    std::vector<struct curl_waitfd> waitfds;
+    std::vector<size_t> tftp;
+    int timeout = m_maxWait;
+    for (size_t i = 0; i < m_downloaders.size(); i++) {
+        if (m_states[i] != TS_RUNNING || !m_downloaders[i]->isNativeTftp())
+            continue;
+
+        struct curl_waitfd waitfd;
+        waitfd.fd = m_downloaders[i]->m_tftp->getSocket();
+        waitfd.events = CURL_WAIT_POLLIN;
+        waitfd.revents = 0;
+        waitfds.push_back(waitfd);
+        tftp.push_back(i);
+
+        timeout = std::min(timeout, int(m_downloaders[i]->m_tftp->getTimeout()));
+    }
+
+    if (running == 0 && tftp.empty())
+        return false;
+
+    err = curl_multi_wait(m_multi, waitfds.empty() ? NULL : &waitfds[0], waitfds.size(),
+                          timeout, NULL);
+    if (err != CURLM_OK)
+        throw DownloadError(std::string("CURL error: ") + curl_multi_strerror(err));
+
+    for (size_t k = 0; k < tftp.size(); k++) {
+        try {
+            if (m_downloaders[tftp[k]]->m_tftp->process(waitfds[k].revents & CURL_WAIT_POLLIN))
+                finish(tftp[k], NULL);
+        } catch (const DownloadError &error) {
+            finish(tftp[k], &error);
+        }
+    }
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::addSegments(size_t index)
+    throw (DownloadError)
+{
+    std::vector<Downloader::Segment *> &segments = m_downloaders[index]->m_segments;
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (segments[i]->added || segments[i]->offset >= segments[i]->end)
+            continue;
+
+        CURLMcode err = curl_multi_add_handle(m_multi, segments[i]->curl);
+        if (err != CURLM_OK)
+            throw DownloadError(std::string("CURL error: ") + curl_multi_strerror(err));
+        segments[i]->added = true;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::finishSegment(size_t index, Downloader::Segment *segment, CURLcode result)
+    throw (DownloadError)
+{
+    Downloader *dl = m_downloaders[index];
+
+    segment->added = false;
+    if (m_states[index] != TS_RUNNING)
+        return;
+
+    // the transfer is stopped with a write error at the end of the segment
+    if (segment->offset >= segment->end && (result == CURLE_OK || result == CURLE_WRITE_ERROR)) {
+        if (dl->segmentsDone()) {
+            dl->finishSegments();
+            finish(index, NULL);
+        }
+        return;
+    }
+
+    if (segment->noRange) {
+        restartUnsegmented(index);
+        return;
+    }
+
+    if (segment->retries < SEGMENT_RETRIES && !(m_context && m_context->isAborted())) {
+        segment->retries++;
+        BW_DEBUG_INFO("Retrying bytes %lld-%lld of %s (%u)", segment->offset, segment->end - 1,
+                      dl->getUrl().c_str(), segment->retries);
+
+        // the interface may be the problem, so try the next one
+        const StringVector &interfaces = dl->m_context->getInterfaces();
+        if (segment->interface >= 0 && interfaces.size() > 1) {
+            segment->interface = (segment->interface + 1) % interfaces.size();
+            curl_easy_setopt(segment->curl, CURLOPT_INTERFACE,
+                             ("if!" + interfaces[segment->interface]).c_str());
+        }
+
+        dl->setSegmentRange(segment);
+        addSegments(index);
+        return;
+    }
+
+    DownloadError error = result == CURLE_OK
+        ? DownloadError("Connection closed before the end of the file")
+        : dl->makeError(result, segment->errorstring);
+    cancel(index);
+    finish(index, &error);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::restartUnsegmented(size_t index)
+    throw (DownloadError)
+{
+    Downloader *dl = m_downloaders[index];
+
+    BW_DEBUG_INFO("Server ignores ranges, downloading %s with one request",
+                  dl->getUrl().c_str());
+
+    for (size_t i = 0; i < dl->m_segments.size(); i++)
+        if (dl->m_segments[i]->added)
+            curl_multi_remove_handle(m_multi, dl->m_segments[i]->curl);
+    dl->clearSegments();
+
+    if (lseek(dl->m_outputFd, dl->m_baseOffset, SEEK_SET) < 0 ||
+            ftruncate(dl->m_outputFd, dl->m_baseOffset) != 0)
+        throw DownloadError(std::string("Cannot reset the output: ") + std::strerror(errno));
+
+    dl->m_maxSegments = 1;
+    dl->m_splitChecked = true;
+    dl->m_bytes = 0;
+
+    CURLMcode err = curl_multi_add_handle(m_multi, dl->m_curl);
+    if (err != CURLM_OK)
+        throw DownloadError(std::string("CURL error: ") + curl_multi_strerror(err));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::cancel(size_t index)
+{
+    if (m_states[index] != TS_RUNNING)
+        return;
+
+    BW_DEBUG_DBG("Cancelling download of %s", m_downloaders[index]->getUrl().c_str());
+    if (m_downloaders[index]->isNativeTftp())
+        m_downloaders[index]->m_tftp->cancel();
+    else {
+        std::vector<Downloader::Segment *> &segments = m_downloaders[index]->m_segments;
+        for (size_t i = 0; i < segments.size(); i++) {
+            if (segments[i]->added && segments[i]->curl != m_downloaders[index]->m_curl)
+                curl_multi_remove_handle(m_multi, segments[i]->curl);
+            segments[i]->added = false;
+        }
+        curl_multi_remove_handle(m_multi, m_downloaders[index]->m_curl);
+    }
+    m_states[index] = TS_CANCELLED;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::cancelAll()
+{
+    for (size_t i = 0; i < m_downloaders.size(); i++)
+        cancel(i);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+int MultiDownloader::downloadFirst()
+    throw (DownloadError)
+{
+    int found = -1;
+    bool running = true;
+
+    try {
+        start();
+
+        while (found < 0) {
+            // the first download that has not failed decides
+            size_t i;
+            for (i = 0; i < m_downloaders.size(); i++) {
+                if (m_states[i] == TS_FAILED) {
+                    if (m_errors[i]->getErrorcode() == DownloadError::DEC_CONNECTION_FAILED)
+                        throw *m_errors[i];
+                    continue;
+                }
+                if (m_states[i] == TS_DONE)
+                    found = i;
+                break;
+            }
+
+            if (found >= 0 || i == m_downloaders.size() || !running)
+                break;
+
+            // cancel everything that cannot win any more
+            for (size_t j = i + 1; j < m_downloaders.size(); j++) {
+                if (m_states[j] == TS_DONE) {
+                    for (size_t k = j + 1; k < m_downloaders.size(); k++)
+                        cancel(k);
+                    break;
+                }
+            }
+
+            running = perform();
+        }
+    } catch (const DownloadError &) {
+        cancelAll();
+        if (m_notifier)
+            m_notifier->finished();
+        throw;
+    }
+
+    cancelAll();
+    if (m_notifier)
+        m_notifier->finished();
+
+    return found;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+int MultiDownloader::downloadFastest(long delay)
+    throw (DownloadError)
+{
+    int found = -1;
+    size_t started = 0;
+    double next = 0.0;
+
+    try {
+        while (found < 0) {
+            bool running = false;
+
+            for (size_t i = 0; i < started && found < 0; i++) {
+                // an error message of the server is an answer, too
+                if (m_states[i] == TS_DONE || (m_states[i] == TS_FAILED &&
+                        m_errors[i]->getErrorcode() == DownloadError::DEC_UNKNOWN))
+                    found = i;
+                else if (m_states[i] == TS_RUNNING)
+                    running = true;
+            }
+            if (found >= 0)
+                break;
+
+            double now = bw::monotonicSeconds();
+            if (started < m_downloaders.size() && (!running || now >= next)) {
+                startTransfer(started++);
+                next = now + delay / 1000.0;
+                continue;
+            }
+            if (!running)
+                break;
+
+            m_maxWait = 1000;
+            if (started < m_downloaders.size())
+                m_maxWait = std::max(1, int((next - now) * 1000));
+            perform();
+        }
+    } catch (const DownloadError &) {
+        m_maxWait = 1000;
+        cancelAll();
+        if (m_notifier)
+            m_notifier->finished();
+        throw;
+    }
+
+    m_maxWait = 1000;
+    cancelAll();
+    if (m_notifier)
+        m_notifier->finished();
+
+    return found;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::downloadAll()
+    throw (DownloadError)
+{
+    bool running = true;
+
+    m_failedIndex = -1;
+    try {
+        start();
+
+        while (running) {
+            running = perform();
+
+            for (size_t i = 0; i < m_downloaders.size(); i++) {
+                if (m_states[i] == TS_FAILED) {
+                    m_failedIndex = i;
+                    throw *m_errors[i];
+                }
+            }
+        }
+    } catch (const DownloadError &) {
+        cancelAll();
+        if (m_notifier)
+            m_notifier->finished();
+        throw;
+    }
+
+    if (m_notifier)
+        m_notifier->finished();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void MultiDownloader::downloadEach()
+    throw (DownloadError)
+{
+    bool running = true;
+
+    try {
+        start();
+
+        while (running)
+            running = perform();
+    } catch (const DownloadError &) {
+        cancelAll();
+        if (m_notifier)
+            m_notifier->finished();
+        throw;
+    }
+
+    if (m_notifier)
+        m_notifier->finished();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool MultiDownloader::isSuccessful(size_t index) const
+{
+    return m_states.at(index) == TS_DONE;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool MultiDownloader::hasConnectionFailed(size_t index) const
+{
+    return m_states.at(index) == TS_FAILED &&
+        m_errors[index]->getErrorcode() == DownloadError::DEC_CONNECTION_FAILED;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+int MultiDownloader::getFailedIndex() const
+{
+    return m_failedIndex;
 }
 
+/* }}} */
 
 // :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
@@ -32,10 +32,14 @@
 #include <ostream>
 #include <vector>
 
+#include <sys/types.h>
+#include <pthread.h>
 #include <curl/curl.h>
 
 #include "global.h"
 
+class TftpClient;
+
 /* DownloadError {{{ */
 
 /**
@@ -54,7 +58,8 @@ class DownloadError : public std::runtime_error {
          */
         enum DownloadErrorCode {
             DEC_UNKNOWN,                    /**< don't know an exact reason, default */
-            DEC_CONNECTION_FAILED           /**< connection failed in CURL, maybe timeout */
+            DEC_CONNECTION_FAILED,          /**< connection failed in CURL, maybe timeout */
+            DEC_ABORTED                     /**< aborted with TransferContext::abort() */
         };
 
     public:
@@ -160,6 +165,236 @@ class ProgressNotifier {
         virtual void finished() = 0;
 };
 
+/* }}} */
+/* TransferContext {{{ */
+
+/**
+ * @brief State that is shared between downloads
+ *
+ * All Downloader objects that use the same TransferContext share the DNS
+ * cache, the TLS session cache and the connection cache. That way, a
+ * sequence of downloads from the same server needs only one name lookup and
+ * can re-use the connection (and the TLS session) of the previous download.
+ *
+ * The context also holds the settings of the built-in TFTP client (see
+ * TftpClient) that is used for <tt>tftp://</tt> URLs instead of CURL.
+ *
+ * The TransferContext must live longer than all Downloader objects that use
+ * it. Several threads may download with the same TransferContext at the
+ * same time, e.g. the prefetching of the images while the menu loads its
+ * includes: the shared caches and the interface statistics are locked.
+ * abort() affects the downloads of all threads.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class TransferContext {
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Creates a new TransferContext.
+         *
+         * @exception DownloadError on CURL errors
+         */
+        TransferContext() throw (DownloadError);
+
+        /**
+         * @brief Destructor
+         *
+         * Deletes a TransferContext.
+         */
+        virtual ~TransferContext();
+
+    public:
+        /**
+         * @brief Enables or disables the built-in TFTP client
+         *
+         * @param[in] native @c true if TftpClient should be used for
+         *            <tt>tftp://</tt> URLs (the default), @c false if CURL
+         *            should be used
+         */
+        void setNativeTftp(bool native);
+
+        /**
+         * @brief Checks if the built-in TFTP client is used
+         *
+         * @return @c true if TftpClient is used for <tt>tftp://</tt> URLs
+         */
+        bool getNativeTftp() const;
+
+        /**
+         * @brief Sets the TFTP block size
+         *
+         * @param[in] blocksize the block size that is requested from the
+         *            server, see TftpClient::setBlockSize()
+         */
+        void setTftpBlockSize(unsigned int blocksize);
+
+        /**
+         * @brief Returns the TFTP block size
+         *
+         * @return the block size set with setTftpBlockSize()
+         */
+        unsigned int getTftpBlockSize() const;
+
+        /**
+         * @brief Sets the TFTP window size
+         *
+         * @param[in] windowsize the window size that is requested from the
+         *            server, see TftpClient::setWindowSize()
+         */
+        void setTftpWindowSize(unsigned int windowsize);
+
+        /**
+         * @brief Returns the TFTP window size
+         *
+         * @return the window size set with setTftpWindowSize()
+         */
+        unsigned int getTftpWindowSize() const;
+
+        /**
+         * @brief Sets the number of HTTP segments
+         *
+         * Large files that are downloaded over HTTP by a MultiDownloader
+         * are split into up to @p segments byte ranges that are downloaded
+         * concurrently, see Downloader.
+         *
+         * @param[in] segments the maximum number of segments per file, 1
+         *            disables segmented downloads
+         */
+        void setHttpSegments(unsigned int segments);
+
+        /**
+         * @brief Returns the number of HTTP segments
+         *
+         * @return the number of segments set with setHttpSegments()
+         */
+        unsigned int getHttpSegments() const;
+
+        /**
+         * @brief Sets the interfaces for multipath downloads
+         *
+         * If interfaces are set, the segments of a segmented HTTP download
+         * (see setHttpSegments()) are distributed round-robin over
+         * @p interfaces, and each file is split into at least as many
+         * segments as there are interfaces. That way, one file is
+         * downloaded over all uplinks of the host at the same time.
+         *
+         * @param[in] interfaces the names of the local network interfaces,
+         *            an empty list lets the routing table decide (the
+         *            default)
+         */
+        void setInterfaces(const StringVector &interfaces);
+
+        /**
+         * @brief Returns the interfaces for multipath downloads
+         *
+         * @return the interfaces set with setInterfaces()
+         */
+        const StringVector &getInterfaces() const;
+
+        /**
+         * @brief Transfer statistics of one interface
+         */
+        struct InterfaceStatistics {
+            std::string         interface;  /**< the name of the interface */
+            unsigned long long  bytes;      /**< number of bytes received */
+            double              seconds;    /**< time between the first and the last byte */
+        };
+
+        /**
+         * @brief Returns the statistics of the multipath downloads
+         *
+         * @return one entry per interface set with setInterfaces(), in the
+         *         same order
+         */
+        std::vector<InterfaceStatistics> getInterfaceStatistics() const;
+
+        /**
+         * @brief Aborts all downloads
+         *
+         * Lets all running and future MultiDownloader transfers that use
+         * this context fail with DownloadError::DEC_ABORTED until
+         * resetAbort() is called. This function may be called from another
+         * thread than the one that performs the downloads.
+         */
+        void abort();
+
+        /**
+         * @brief Allows downloads again after abort()
+         */
+        void resetAbort();
+
+        /**
+         * @brief Checks if abort() has been called
+         *
+         * @return @c true if the downloads have been aborted, @c false
+         *         otherwise
+         */
+        bool isAborted() const;
+
+    private:
+        void addMulti(CURLM *multi);
+        void removeMulti(CURLM *multi);
+        void addInterfaceBytes(size_t index, size_t bytes);
+
+    private:
+        TransferContext(const TransferContext &);
+        TransferContext &operator=(const TransferContext &);
+
+    private:
+        CURLSH          *m_share;
+        bool            m_nativeTftp;
+        unsigned int    m_tftpBlockSize;
+        unsigned int    m_tftpWindowSize;
+        unsigned int    m_httpSegments;
+        StringVector    m_interfaces;
+        std::vector<unsigned long long> m_interfaceBytes;
+        std::vector<double> m_interfaceFirst;
+        std::vector<double> m_interfaceLast;
+        bool            m_aborted;
+        std::vector<CURLM *> m_multis;
+        mutable pthread_mutex_t m_mutex;
+        pthread_mutex_t m_shareMutexes[CURL_LOCK_DATA_LAST];
+
+        friend class Downloader;
+        friend class MultiDownloader;
+};
+
+/* }}} */
+/* DownloadSink {{{ */
+
+/**
+ * @brief Receiver of downloaded data
+ *
+ * Implement that interface to process the data while it arrives instead of
+ * collecting it in a stream first, see Downloader(DownloadSink &, long).
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class DownloadSink {
+    public:
+        /**
+         * @brief Destructor
+         */
+        virtual ~DownloadSink() {}
+
+    public:
+        /**
+         * @brief Receives data
+         *
+         * Called for each chunk of data in the order of the file. The
+         * chunks don't have any relation to lines or other structures of the
+         * content. The function must not throw exceptions, because it's
+         * called by CURL.
+         *
+         * @param[in] buffer the data, only valid during the call
+         * @param[in] size the number of bytes in @p buffer
+         * @return @c true on success, @c false to abort the download
+         */
+        virtual bool write(const char *buffer, size_t size) = 0;
+};
+
 /* }}} */
 /* Downloader {{{ */
 
@@ -180,6 +415,23 @@ class ProgressNotifier {
  * os.close();
  * @endcode
  *
+ * Instead of a stream, the output can also be a file descriptor, see
+ * Downloader(int, long).
+ *
+ * <tt>tftp://</tt> URLs are downloaded with the built-in TftpClient unless
+ * that has been disabled in the TransferContext.
+ *
+ * When a MultiDownloader downloads a large file over HTTP into a file
+ * descriptor and the server accepts byte ranges, the file is split into
+ * segments (see TransferContext::setHttpSegments()). The first request
+ * continues as the first segment, the other segments are requested with
+ * @c Range headers on separate connections and written to their offsets
+ * with pwrite(2). A failed segment is retried from where it stopped. If
+ * the server doesn't send @c Accept-Ranges or ignores the @c Range header,
+ * the file is downloaded with one request.
+ *
+ * With TransferContext::setInterfaces(), the segments are bound to different
+ * local network interfaces.
  *
  * @author Bernhard Walle <bernhard@bwalle.de>
  */
@@ -190,14 +442,46 @@ class Downloader {
          *
          * Creates a new instance of a Downloader.
          *
-         * @todo is that timeout parameter really milliseconds
          * @param[out] output the stream where the output is written to
-         * @param[in]  timeout the number of milliseconds after which the
-         *             network connection should timeout
+         * @param[in]  timeout the number of seconds after which connecting
+         *             times out, also the stall timeout (see
+         *             setStallTimeout()); 0 for no timeout
          * @exception DownloadError on CURL errors
          */
         Downloader(std::ostream &output, long timeout = 0) throw (DownloadError);
 
+        /**
+         * @brief Constructor
+         *
+         * Creates a new instance of a Downloader that writes to a file
+         * descriptor instead of a stream. This is useful for anonymous memory
+         * files (see memfd_create(2)) that are passed to the kernel later.
+         * The data is written at the current file offset of @p fd. The file
+         * descriptor is not closed by the Downloader.
+         *
+         * @param[in]  fd the file descriptor where the output is written to
+         * @param[in]  timeout the number of seconds after which connecting
+         *             times out, also the stall timeout (see
+         *             setStallTimeout()); 0 for no timeout
+         * @exception DownloadError on CURL errors
+         */
+        Downloader(int fd, long timeout = 0) throw (DownloadError);
+
+        /**
+         * @brief Constructor
+         *
+         * Creates a new instance of a Downloader that passes the data to
+         * @p sink while it arrives. The sink is not deleted by the
+         * Downloader.
+         *
+         * @param[in]  sink the receiver of the data
+         * @param[in]  timeout the number of seconds after which connecting
+         *             times out, also the stall timeout (see
+         *             setStallTimeout()); 0 for no timeout
+         * @exception DownloadError on CURL errors
+         */
+        Downloader(DownloadSink &sink, long timeout = 0) throw (DownloadError);
+
         /**
          * @brief Destructor
          *
@@ -231,6 +515,27 @@ class Downloader {
          */
         std::string getUrl() const;
 
+        /**
+         * @brief Sets the transfer context
+         *
+         * Lets the download use the caches of @p context. See the
+         * documentation of TransferContext.
+         *
+         * @param[in] context the transfer context or @c NULL to use private
+         *            caches
+         * @throw DownloadError on CURL errors
+         */
+        void setTransferContext(TransferContext *context) throw (DownloadError);
+
+        /**
+         * @brief Initialises CURL
+         *
+         * Performs the global CURL initialisation. It's safe to call that
+         * function multiple times, the initialisation is only done once. You
+         * don't need to call that function yourself.
+         */
+        static void globalInit();
+
         /**
          * @brief Sets the progress notifier
          *
@@ -258,19 +563,399 @@ class Downloader {
          */
         void download() throw (DownloadError);
 
+        /**
+         * @brief Only retrieves the meta data
+         *
+         * If enabled, download() doesn't transfer the file itself but only
+         * the information that is needed for getValidator(). That's a
+         * @c HEAD request for HTTP, a @c SIZE and @c MDTM command for FTP and
+         * a read request that is terminated after the option negotiation
+         * for TFTP.
+         *
+         * @param[in] nobody @c true if only the meta data should be
+         *            retrieved, @c false to download the file (the default)
+         * @throw DownloadError on CURL errors
+         */
+        void setNoBody(bool nobody) throw (DownloadError);
+
+        /**
+         * @brief Returns a validator of the downloaded file
+         *
+         * A validator is a string that changes when the file on the server
+         * changes. That is the @c ETag (or the @c Last-Modified date if the
+         * server doesn't send an @c ETag) for HTTP, the size and the
+         * modification time for FTP and the size (@c tsize option) for TFTP.
+         *
+         * The function can be called after download() has returned.
+         *
+         * @return the validator or the empty string if the server didn't
+         *         send enough information
+         */
+        std::string getValidator() const;
+
+        /**
+         * @brief Sets the stall timeout
+         *
+         * If no data at all arrives for @p seconds during the download,
+         * the download fails with DownloadError::DEC_CONNECTION_FAILED. This
+         * applies to CURL transfers only, the built-in TFTP client has its
+         * own timeout.
+         *
+         * @param[in] seconds the timeout in seconds, 0 disables it (the
+         *            default)
+         * @throw DownloadError on CURL errors
+         */
+        void setStallTimeout(long seconds) throw (DownloadError);
+
+        /**
+         * @brief Timing of a transfer
+         *
+         * All times are in seconds since the start of the transfer, all rates
+         * in bytes per second. Times and rates are negative if unknown.
+         */
+        struct Statistics {
+            double      nameLookupTime; /**< the server name was resolved */
+            double      connectTime;    /**< the connection was established */
+            double      firstByteTime;  /**< the first byte of the answer arrived */
+            double      totalTime;      /**< the transfer finished (or now) */
+            long long   bytes;          /**< number of bytes of the file received */
+            double      averageRate;    /**< rate between the first and the last byte */
+            double      peakRate;       /**< highest rate during one second */
+            unsigned int stalls;        /**< times no data arrived for a second */
+            unsigned int retransmits;   /**< packets sent again (built-in TFTP only) */
+        };
+
+        /**
+         * @brief Returns the timing of the last transfer
+         *
+         * The times come from CURL or from the built-in TFTP client. For TFTP,
+         * which has no connection, the connect time is the time of the first
+         * answer of the server. The rates and stalls are measured while the
+         * data is written, for segmented downloads over all segments.
+         *
+         * @return the statistics
+         */
+        Statistics getStatistics() const;
+
+    private:
+        /**
+         * @brief Byte range of a segmented download
+         */
+        struct Segment {
+            CURL            *curl;          /**< the transfer, m_curl for the first segment */
+            Downloader      *parent;        /**< the Downloader of the segment */
+            long long       start;          /**< first byte */
+            long long       end;            /**< last byte + 1 */
+            long long       offset;         /**< next byte that is written */
+            unsigned int    retries;        /**< number of retries */
+            int             interface;      /**< index of the interface or -1 */
+            bool            added;          /**< added to the multi handle */
+            bool            checked;        /**< response code checked */
+            bool            noRange;        /**< the server has ignored the range */
+            char            errorstring[CURL_ERROR_SIZE];
+        };
+
+        static size_t curl_segment_write_callback(void *buffer, size_t size,
+                size_t nmemb, void *userp);
+        static size_t curl_segment_header_callback(char *buffer, size_t size,
+                size_t nitems, void *userdata);
+        void prepareSegments();
+        void split();
+        size_t writeSegment(Segment *segment, const char *buffer, size_t size);
+        void setSegmentRange(Segment *segment) throw (DownloadError);
+        Segment *findSegment(CURL *curl) const;
+        bool segmentsDone() const;
+        void finishSegments();
+        void clearSegments();
+        void reportSegmentProgress();
+
     private:
         static int curl_progress_callback(void *clientp, double dltotal,
                 double dlnow, double ultotal, double ulnow);
         static size_t curl_write_callback(void *buffer, size_t size,
                 size_t nmemb, void *userp);
+        static size_t curl_header_callback(char *buffer, size_t size,
+                size_t nitems, void *userdata);
+        DownloadError makeError(CURLcode err, const char *errorstring = NULL) const;
+        void init(long timeout) throw (DownloadError);
+        bool write(const char *buffer, size_t size);
+        bool isNativeTftp() const;
+        TftpClient *createTftpClient() throw (DownloadError);
+        void startStatistics();
+        void countBytes(size_t size);
+        void stopStatistics();
 
     private:
         ProgressNotifier  *m_notifier;
+        TransferContext   *m_context;
+        TftpClient        *m_tftp;
         std::string       m_url;
         CURL              *m_curl;
         char              m_curl_errorstring[CURL_ERROR_SIZE];
-        std::ostream      &m_output;
+        std::ostream      *m_output;
+        int               m_outputFd;
+        DownloadSink      *m_sink;
+        bool              m_nobody;
+        std::string       m_etag;
+        std::string       m_lastModified;
+        long              m_stallTimeout;
+        bool              m_acceptRanges;
+        unsigned int      m_maxSegments;
+        bool              m_splitChecked;
+        long long         m_contentLength;
+        off_t             m_baseOffset;
+        std::vector<Segment *> m_segments;
+        double            m_startTime;
+        double            m_firstByteTime;
+        double            m_endTime;
+        double            m_lastByteTime;
+        double            m_rateStartTime;
+        long long         m_rateBytes;
+        double            m_peakRate;
+        unsigned int      m_stalls;
+        long long         m_bytes;
         static bool       m_firstCalled;
+
+        friend class MultiDownloader;
+};
+
+/* }}} */
+/* MultiDownloader {{{ */
+
+/**
+ * @brief Performs several downloads concurrently
+ *
+ * This class drives a number of Downloader objects in parallel with a CURL
+ * multi handle. The Downloader objects have to be fully set up (URL, output)
+ * before they are added with addDownloader(). Progress notifiers that have
+ * been set on the individual Downloader objects are ignored, use
+ * MultiDownloader::setProgress() instead which reports the combined progress
+ * of all transfers.
+ *
+ * If the Downloader objects use a TransferContext, the transfers can be
+ * aborted from another thread with TransferContext::abort().
+ *
+ * Example to fetch the first existing file of a list of candidates:
+ *
+ * @code
+ * std::stringstream streams[2];
+ * MultiDownloader mdl;
+ * for (int i = 0; i < 2; i++) {
+ *     Downloader *dl = new Downloader(streams[i]);
+ *     dl->setUrl(urls[i]);
+ *     mdl.addDownloader(dl);
+ * }
+ * int found = mdl.downloadFirst();
+ * @endcode
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class MultiDownloader {
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Creates a new MultiDownloader.
+         *
+         * @exception DownloadError on CURL errors
+         */
+        MultiDownloader() throw (DownloadError);
+
+        /**
+         * @brief Destructor
+         *
+         * Cancels all transfers that are still running and deletes all
+         * Downloader objects that have been added with addDownloader().
+         */
+        virtual ~MultiDownloader();
+
+    public:
+        /**
+         * @brief Adds a download
+         *
+         * Adds @p downloader to the list of transfers. The position in that
+         * list is the priority of the download as used by downloadFirst(),
+         * the first download added has the highest priority.
+         *
+         * The MultiDownloader takes the ownership of @p downloader, i.e. it
+         * deletes the object in its destructor.
+         *
+         * @param[in] downloader the download that should be added
+         */
+        void addDownloader(Downloader *downloader);
+
+        /**
+         * @brief Returns the number of downloads
+         *
+         * @return the number of downloads added with addDownloader()
+         */
+        size_t getSize() const;
+
+        /**
+         * @brief Returns a download
+         *
+         * @param[in] index the index of the download, starting from 0
+         * @return the Downloader object, the object is still owned by the
+         *         MultiDownloader
+         */
+        Downloader *getDownloader(size_t index) const;
+
+        /**
+         * @brief Sets the progress notifier
+         *
+         * Sets a progress notification object that gets the summed up
+         * progress of all transfers. See Downloader::setProgress() for the
+         * memory management of @p notifier.
+         *
+         * @param[in] notifier a pointer to the progress notification object
+         */
+        void setProgress(ProgressNotifier *notifier);
+
+        /**
+         * @brief Downloads the first available file
+         *
+         * Starts all transfers at the same time and waits until the download
+         * with the highest priority that succeeds is known. That is the same
+         * download that would succeed first when trying all downloads one
+         * after another. As soon as a download has succeeded, all
+         * downloads with a lower priority are cancelled because their result
+         * doesn't matter any more.
+         *
+         * If a download fails because the connection could not be
+         * established, the error is thrown like Downloader::download() would
+         * do when no download with a higher priority has succeeded.
+         *
+         * @return the index of the successful download or -1 if all
+         *         downloads failed
+         * @throw DownloadError on connection errors and CURL errors
+         */
+        int downloadFirst() throw (DownloadError);
+
+        /**
+         * @brief Finds the server that answers first
+         *
+         * Starts the transfers one after another, like the connection
+         * attempts of "Happy Eyeballs" (RFC 8305): the next transfer is
+         * started after @p delay milliseconds or as soon as all running
+         * transfers have failed to connect. The first transfer that gets an
+         * answer from its server wins, even if the answer is an error like
+         * "file not found". All other transfers are cancelled then.
+         *
+         * That way, the transfers added first are preferred, but a server
+         * that doesn't answer doesn't delay the result much.
+         *
+         * @param[in] delay the delay between the start of two transfers in
+         *            milliseconds
+         * @return the index of the download that has been answered first or
+         *         -1 if no server answered
+         * @throw DownloadError on CURL errors or if the transfers have been
+         *        aborted
+         */
+        int downloadFastest(long delay) throw (DownloadError);
+
+        /**
+         * @brief Downloads all files
+         *
+         * Starts all transfers at the same time and waits until all of them
+         * have finished. If one download fails, all other downloads are
+         * cancelled and the error of the failed download is thrown. Use
+         * getFailedIndex() to find out which download has failed.
+         *
+         * @throw DownloadError if any download fails
+         */
+        void downloadAll() throw (DownloadError);
+
+        /**
+         * @brief Downloads all files independently
+         *
+         * Starts all transfers at the same time and waits until all of them
+         * have finished. Unlike downloadAll(), a failed download doesn't
+         * affect the other downloads. Use isSuccessful() to check the result
+         * of each download.
+         *
+         * @throw DownloadError on CURL errors
+         */
+        void downloadEach() throw (DownloadError);
+
+        /**
+         * @brief Checks if a download was successful
+         *
+         * @param[in] index the index of the download, starting from 0
+         * @return @c true if the download has finished successfully,
+         *         @c false if it failed, was cancelled or has not been
+         *         started yet
+         */
+        bool isSuccessful(size_t index) const;
+
+        /**
+         * @brief Checks if the server of a download could not be reached
+         *
+         * @param[in] index the index of the download, starting from 0
+         * @return @c true if the download failed because the connection could
+         *         not be established or timed out, @c false if it succeeded,
+         *         failed otherwise, was cancelled or has not been started yet
+         */
+        bool hasConnectionFailed(size_t index) const;
+
+        /**
+         * @brief Returns the failed download
+         *
+         * After downloadAll() has thrown an error, this function returns the
+         * index of the download that has caused the error.
+         *
+         * @return the index of the failed download or -1 if no download failed
+         */
+        int getFailedIndex() const;
+
+    private:
+        /**
+         * @brief State of a single transfer
+         */
+        enum TransferState {
+            TS_RUNNING,         /**< the transfer is still running */
+            TS_DONE,            /**< the transfer has finished successfully */
+            TS_FAILED,          /**< the transfer has failed */
+            TS_CANCELLED        /**< the transfer has been cancelled */
+        };
+
+        /**
+         * @brief Progress of a single transfer
+         */
+        class TransferProgress : public ProgressNotifier {
+            public:
+                TransferProgress(MultiDownloader *parent);
+                int progressed(double total, double now);
+                void finished();
+
+                double total;
+                double now;
+
+            private:
+                MultiDownloader *m_parent;
+        };
+
+        void start() throw (DownloadError);
+        void startTransfer(size_t index) throw (DownloadError);
+        bool perform() throw (DownloadError);
+        void finish(size_t index, const DownloadError *error);
+        void finishSegment(size_t index, Downloader::Segment *segment, CURLcode result)
+            throw (DownloadError);
+        void addSegments(size_t index) throw (DownloadError);
+        void restartUnsegmented(size_t index) throw (DownloadError);
+        void cancel(size_t index);
+        void cancelAll();
+        void transferProgressed();
+
+    private:
+        CURLM                           *m_multi;
+        TransferContext                 *m_context;
+        ProgressNotifier                *m_notifier;
+        std::vector<Downloader *>       m_downloaders;
+        std::vector<TransferProgress *> m_progress;
+        std::vector<TransferState>      m_states;
+        std::vector<DownloadError *>    m_errors;
+        int                             m_failedIndex;
+        int                             m_maxWait;
 };
 
 /* }}} */
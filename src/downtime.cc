@@ -0,0 +1,186 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libbw/debug.h>
+
+#include "downtime.h"
+
+#define DOWNTIME_FILE       "downtime"
+
+#ifndef CLOCK_BOOTTIME
+#  define CLOCK_BOOTTIME 7
+#endif
+
+/* ---------------------------------------------------------------------------------------------- */
+static long long wallclock_ms()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static long long boottime_ms()
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_BOOTTIME, &ts) != 0)
+        return -1;
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static long long init_start_ms()
+{
+    std::ifstream fin("/proc/1/stat");
+    std::string stat;
+
+    if (!std::getline(fin, stat))
+        return -1;
+
+    // the process name may contain spaces, the fields after it don't
+    std::string::size_type pos = stat.rfind(')');
+    if (pos == std::string::npos)
+        return -1;
+
+    // the start time is the 22nd field, the 20th after the name
+    std::stringstream ss(stat.substr(pos + 1));
+    std::string field;
+    for (int i = 0; i < 20; i++)
+        if (!(ss >> field))
+            return -1;
+
+    unsigned long long ticks;
+    if (!(ss >> ticks))
+        return -1;
+
+    return ticks * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+/* Downtime {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+Downtime::Downtime(const std::string &directory)
+    : m_directory(directory)
+    , m_confirmed(-1)
+    , m_loadStart(-1)
+{}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downtime::markConfirmed()
+{
+    m_confirmed = wallclock_ms();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+std::string Downtime::markLoadStart()
+{
+    m_loadStart = wallclock_ms();
+    if (m_confirmed < 0)
+        m_confirmed = m_loadStart;
+
+    std::stringstream ss;
+    ss << DOWNTIME_PARAMETER "=" << m_loadStart << "," << (m_loadStart - m_confirmed);
+
+    return ss.str();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Downtime::markLoaded()
+{
+    long long load = wallclock_ms() - m_loadStart;
+
+    if (mkdir(m_directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        BW_DEBUG_INFO("Cannot create %s: %s", m_directory.c_str(), std::strerror(errno));
+        return;
+    }
+
+    std::string path = m_directory + "/" DOWNTIME_FILE;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        BW_DEBUG_INFO("Cannot open %s: %s", path.c_str(), std::strerror(errno));
+        return;
+    }
+
+    // "kexec -e" doesn't sync the file systems
+    std::stringstream ss;
+    ss << m_loadStart << " " << load << "\n";
+    std::string line = ss.str();
+    if (write(fd, line.c_str(), line.size()) != ssize_t(line.size()) || fsync(fd) != 0)
+        BW_DEBUG_INFO("Cannot write %s: %s", path.c_str(), std::strerror(errno));
+
+    close(fd);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool Downtime::compute(const std::string &cmdline, Report &report) const
+{
+    std::stringstream ss(cmdline);
+    std::string word, value;
+
+    while (ss >> word)
+        if (word.compare(0, std::strlen(DOWNTIME_PARAMETER "="), DOWNTIME_PARAMETER "=") == 0)
+            value = word.substr(std::strlen(DOWNTIME_PARAMETER "="));
+
+    long long loadStart, download;
+    char comma;
+    std::stringstream vs(value);
+    if (value.empty() || !(vs >> loadStart >> comma >> download) || comma != ',')
+        return false;
+
+    long long boottime = boottime_ms();
+    long long initStart = init_start_ms();
+    if (boottime < 0 || initStart < 0)
+        return false;
+
+    long long kernelStart = wallclock_ms() - boottime;
+    long long shutdownStart = loadStart;
+    report.load = -1.0;
+
+    // only valid if written by the run that booted this kernel
+    std::ifstream fin((m_directory + "/" DOWNTIME_FILE).c_str());
+    long long savedStart, load;
+    if (fin >> savedStart >> load && savedStart == loadStart) {
+        report.load = load / 1000.0;
+        shutdownStart += load;
+    }
+
+    report.download = download / 1000.0;
+    report.shutdown = (kernelStart - shutdownStart) / 1000.0;
+    report.kernelBoot = initStart / 1000.0;
+    report.total = (kernelStart + initStart - (loadStart - download)) / 1000.0;
+
+    return true;
+}
+
+/* }}} */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
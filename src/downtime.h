@@ -0,0 +1,118 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DOWNTIME_H
+#define DOWNTIME_H
+
+/**
+ * @file downtime.h
+ * @brief Measurement of the downtime across the kexec boundary
+ *
+ * This file contains the code that passes the timing of a run to the new
+ * kernel and that computes the downtime in the new system.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <string>
+
+/**
+ * @brief Name of the kernel parameter that carries the timestamps
+ */
+#define DOWNTIME_PARAMETER "pxe_kexec.downtime"
+
+/* Downtime {{{ */
+
+/**
+ * @brief Downtime of a reboot with pxe-kexec
+ *
+ * Before the kernel is loaded, the wall clock time and the time since the
+ * user confirmed the boot entry are appended to the kernel command line as
+ * <tt>pxe_kexec.downtime=<i>load start in ms</i>,<i>download in ms</i></tt>.
+ * The time that loading took can't be on the command line, so it's written
+ * to the state directory after loading. If the new system uses the same
+ * state directory, the time of loading and of shutting down the old system
+ * can be told apart, otherwise both count as shutdown.
+ *
+ * In the new system, the time when the kernel started is the wall clock
+ * time minus the time since boot, and the kernel boot ends when init was
+ * started. All that depends on the wall clock of the new system, which may
+ * be set from the hardware clock with a resolution of one second only.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class Downtime {
+    public:
+        /**
+         * @brief Phases of the downtime in seconds
+         */
+        struct Report {
+            double  download;       /**< confirmation until the kernel was loaded */
+            double  load;           /**< loading the kernel, negative if unknown */
+            double  shutdown;       /**< shutting down the old system */
+            double  kernelBoot;     /**< start of the kernel until init runs */
+            double  total;          /**< confirmation until init runs */
+        };
+
+    public:
+        /**
+         * @brief Constructor
+         *
+         * @param[in] directory the state directory
+         */
+        Downtime(const std::string &directory);
+
+    public:
+        /**
+         * @brief Marks the time when the user confirmed the boot entry
+         */
+        void markConfirmed();
+
+        /**
+         * @brief Marks the start of loading the kernel
+         *
+         * @return the parameter that must be appended to the command line
+         */
+        std::string markLoadStart();
+
+        /**
+         * @brief Marks the end of loading the kernel
+         *
+         * Writes the time that loading took to the state directory. Errors
+         * are ignored, the time is optional.
+         */
+        void markLoaded();
+
+        /**
+         * @brief Computes the downtime in the new system
+         *
+         * @param[in] cmdline the kernel command line of the running system
+         * @param[out] report the phases of the downtime
+         * @return @c false if @p cmdline contains no valid parameter
+         */
+        bool compute(const std::string &cmdline, Report &report) const;
+
+    private:
+        std::string     m_directory;
+        long long       m_confirmed;
+        long long       m_loadStart;
+};
+
+/* }}} */
+
+#endif /* DOWNTIME_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
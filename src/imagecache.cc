@@ -0,0 +1,390 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libbw/debug.h>
+
+#include "imagecache.h"
+#include "sha256.h"
+
+#define INDEX_FILE      "index"
+#define LOCK_FILE       "lock"
+#define COPY_BUFSIZE    65536
+
+/* ---------------------------------------------------------------------------------------------- */
+static bool write_all(int fd, const char *buffer, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, buffer, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        buffer += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+/* ImageCache {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+ImageCache::ImageCache(const std::string &directory, unsigned long long maxSize)
+    : m_directory(directory)
+    , m_maxSize(maxSize)
+    , m_lockFd(-1)
+{
+    if (mkdir(m_directory.c_str(), 0700) != 0 && errno != EEXIST) {
+        BW_DEBUG_INFO("Cannot create cache directory %s: %s", m_directory.c_str(),
+                      std::strerror(errno));
+        m_directory.clear();
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+ImageCache::~ImageCache()
+{
+    unlock();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool ImageCache::isValid() const
+{
+    return !m_directory.empty();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+std::string ImageCache::getPath(const std::string &checksum) const
+{
+    return m_directory + "/" + checksum;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool ImageCache::lock()
+{
+    std::string path = m_directory + "/" LOCK_FILE;
+
+    // several instances may run at the same time (one per interface)
+    m_lockFd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (m_lockFd < 0) {
+        BW_DEBUG_INFO("Cannot open %s: %s", path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    while (flock(m_lockFd, LOCK_EX) != 0) {
+        if (errno == EINTR)
+            continue;
+
+        BW_DEBUG_INFO("Cannot lock %s: %s", path.c_str(), std::strerror(errno));
+        close(m_lockFd);
+        m_lockFd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ImageCache::unlock()
+{
+    if (m_lockFd < 0)
+        return;
+
+    close(m_lockFd);
+    m_lockFd = -1;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+ImageCache::EntryVector ImageCache::readIndex() const
+{
+    EntryVector entries;
+    std::ifstream fin((m_directory + "/" INDEX_FILE).c_str());
+    std::string line;
+
+    while (std::getline(fin, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::stringstream ss(line);
+        Entry entry;
+        std::string size, lastUsed;
+
+        if (!std::getline(ss, entry.url, '\t') || !std::getline(ss, entry.validator, '\t') ||
+                !std::getline(ss, entry.checksum, '\t') || !std::getline(ss, size, '\t') ||
+                !std::getline(ss, lastUsed, '\t')) {
+            BW_DEBUG_INFO("Ignoring invalid cache index line '%s'", line.c_str());
+            continue;
+        }
+
+        entry.size = std::strtoull(size.c_str(), NULL, 10);
+        entry.lastUsed = std::strtol(lastUsed.c_str(), NULL, 10);
+        entries.push_back(entry);
+    }
+
+    return entries;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ImageCache::writeIndex(const EntryVector &entries) const
+{
+    std::string path = m_directory + "/" INDEX_FILE;
+    std::string tmppath = path + ".new";
+
+    std::ofstream fout(tmppath.c_str());
+    fout << "# pxe-kexec image cache: url, validator, sha256, size, last use" << std::endl;
+    for (EntryVector::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        fout << it->url << '\t' << it->validator << '\t' << it->checksum << '\t'
+             << it->size << '\t' << it->lastUsed << std::endl;
+    fout.close();
+
+    if (!fout || rename(tmppath.c_str(), path.c_str()) != 0) {
+        BW_DEBUG_INFO("Cannot write cache index %s", path.c_str());
+        remove(tmppath.c_str());
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ImageCache::removeEntry(EntryVector &entries, size_t index) const
+{
+    std::string checksum = entries[index].checksum;
+
+    entries.erase(entries.begin() + index);
+
+    // the same image may be referenced by another URL
+    for (EntryVector::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        if (it->checksum == checksum)
+            return;
+
+    BW_DEBUG_DBG("Removing %s from the cache", checksum.c_str());
+    remove(getPath(checksum).c_str());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ImageCache::evict(EntryVector &entries) const
+{
+    while (!entries.empty()) {
+        unsigned long long total = 0;
+        size_t oldest = 0;
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            bool counted = false;
+            for (size_t j = 0; j < i && !counted; j++)
+                counted = entries[j].checksum == entries[i].checksum;
+            if (!counted)
+                total += entries[i].size;
+
+            if (entries[i].lastUsed < entries[oldest].lastUsed)
+                oldest = i;
+        }
+
+        if (total <= m_maxSize)
+            break;
+
+        BW_DEBUG_DBG("Cache size %llu exceeds %llu, evicting %s", total, m_maxSize,
+                     entries[oldest].url.c_str());
+        removeEntry(entries, oldest);
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool ImageCache::restore(const std::string &url, const std::string &validator, int fd)
+{
+    if (!isValid() || validator.empty() || !lock())
+        return false;
+
+    EntryVector entries = readIndex();
+    size_t index;
+    for (index = 0; index < entries.size(); index++)
+        if (entries[index].url == url)
+            break;
+
+    if (index == entries.size()) {
+        BW_DEBUG_DBG("%s is not cached", url.c_str());
+        unlock();
+        return false;
+    }
+    if (entries[index].validator != validator) {
+        BW_DEBUG_DBG("Cached %s is outdated ('%s' != '%s')", url.c_str(),
+                     entries[index].validator.c_str(), validator.c_str());
+        unlock();
+        return false;
+    }
+
+    // copy and verify in one pass, the image is read only once
+    std::string checksum = entries[index].checksum;
+    std::string path = getPath(checksum);
+    Sha256 sha;
+    unsigned long long size = 0;
+    bool corrupted = false;
+    bool ok = true;
+
+    int src = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        BW_DEBUG_INFO("Cannot open %s: %s", path.c_str(), std::strerror(errno));
+        corrupted = true;
+    }
+
+    std::vector<char> buffer(COPY_BUFSIZE);
+    while (ok && !corrupted) {
+        ssize_t len = read(src, &buffer[0], buffer.size());
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            corrupted = true;
+        if (len <= 0)
+            break;
+
+        sha.update(&buffer[0], len);
+        size += len;
+        ok = write_all(fd, &buffer[0], len);
+    }
+    if (src >= 0)
+        close(src);
+
+    if (ok && !corrupted &&
+            (size != entries[index].size || sha.getHexDigest() != checksum)) {
+        BW_DEBUG_INFO("Cached image %s is corrupted", path.c_str());
+        corrupted = true;
+    }
+
+    // other URLs must not get the broken image either
+    if (corrupted) {
+        for (size_t i = entries.size(); i-- > 0; )
+            if (entries[i].checksum == checksum)
+                entries.erase(entries.begin() + i);
+        remove(path.c_str());
+        ok = false;
+    }
+
+    if (ok)
+        entries[index].lastUsed = std::time(NULL);
+    else if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0)
+        BW_DEBUG_INFO("Cannot truncate image: %s", std::strerror(errno));
+
+    writeIndex(entries);
+    unlock();
+
+    return ok;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ImageCache::store(const std::string &url, const std::string &validator, int fd)
+{
+    if (!isValid() || validator.empty())
+        return;
+
+    // that would break the index
+    if (url.find_first_of("\t\n") != std::string::npos ||
+            validator.find_first_of("\t\n") != std::string::npos)
+        return;
+
+    off_t imageSize = lseek(fd, 0, SEEK_END);
+    if (imageSize < 0 || (unsigned long long)imageSize > m_maxSize)
+        return;
+
+    if (!lock())
+        return;
+
+    std::string tmppath = m_directory + "/tmp.XXXXXX";
+    int dest = mkstemp(&tmppath[0]);
+    if (dest < 0) {
+        BW_DEBUG_INFO("Cannot create %s: %s", tmppath.c_str(), std::strerror(errno));
+        unlock();
+        return;
+    }
+
+    Sha256 sha;
+    std::vector<char> buffer(COPY_BUFSIZE);
+    off_t offset = 0;
+    bool ok = true;
+
+    while (ok && offset < imageSize) {
+        ssize_t len = pread(fd, &buffer[0], buffer.size(), offset);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            ok = false;
+            break;
+        }
+
+        sha.update(&buffer[0], len);
+        offset += len;
+        ok = write_all(dest, &buffer[0], len);
+    }
+    close(dest);
+
+    if (!ok) {
+        BW_DEBUG_INFO("Cannot copy %s into the cache: %s", url.c_str(), std::strerror(errno));
+        remove(tmppath.c_str());
+        unlock();
+        return;
+    }
+
+    Entry entry;
+    entry.url = url;
+    entry.validator = validator;
+    entry.checksum = sha.getHexDigest();
+    entry.size = imageSize;
+    entry.lastUsed = std::time(NULL);
+
+    std::string path = getPath(entry.checksum);
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+        remove(tmppath.c_str());
+    else if (rename(tmppath.c_str(), path.c_str()) != 0) {
+        BW_DEBUG_INFO("Cannot rename %s: %s", tmppath.c_str(), std::strerror(errno));
+        remove(tmppath.c_str());
+        unlock();
+        return;
+    }
+
+    // add the new entry first so that unchanged content is not removed
+    EntryVector entries = readIndex();
+    entries.push_back(entry);
+    for (size_t i = 0; i < entries.size() - 1; i++) {
+        if (entries[i].url == url) {
+            removeEntry(entries, i);
+            break;
+        }
+    }
+
+    BW_DEBUG_DBG("Cached %s as %s", url.c_str(), entry.checksum.c_str());
+
+    evict(entries);
+    writeIndex(entries);
+    unlock();
+}
+
+/* }}} */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
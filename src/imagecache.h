@@ -0,0 +1,149 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+/**
+ * @file imagecache.h
+ * @brief Local cache of downloaded images
+ *
+ * This file contains the cache that keeps kernels and initrds on the local
+ * disk so that booting the same label again doesn't need to download them.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <string>
+#include <vector>
+#include <ctime>
+
+/* ImageCache {{{ */
+
+/**
+ * @brief Cache of kernel and initrd images
+ *
+ * The cache directory contains one file per distinct image content, named
+ * after the SHA-256 checksum of the content, and an index that maps the URL
+ * of an image to its checksum and to the validator that the server sent for
+ * it (see Downloader::getValidator()). An image is only taken from the cache
+ * if the server still sends the same validator, and the checksum is verified
+ * each time the image is taken from the cache.
+ *
+ * When the total size of the cached images exceeds the limit, the least
+ * recently used images are removed.
+ *
+ * Errors never propagate to the caller: if the cache cannot be used, the
+ * image simply has to be downloaded.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class ImageCache {
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Creates a new ImageCache. The directory is created if it doesn't
+         * exist.
+         *
+         * @param[in] directory the cache directory
+         * @param[in] maxSize the maximum total size of the cached images in
+         *            bytes
+         */
+        ImageCache(const std::string &directory, unsigned long long maxSize);
+
+        /**
+         * @brief Destructor
+         *
+         * Deletes an ImageCache.
+         */
+        virtual ~ImageCache();
+
+    public:
+        /**
+         * @brief Checks if the cache can be used
+         *
+         * @return @c true if the cache directory is usable, @c false
+         *         otherwise
+         */
+        bool isValid() const;
+
+        /**
+         * @brief Takes an image from the cache
+         *
+         * Writes the cached image to @p fd if an image for @p url with the
+         * validator @p validator is in the cache and its checksum is still
+         * correct. Corrupted images are removed from the cache.
+         *
+         * @param[in] url the URL of the image
+         * @param[in] validator the current validator of the image on the
+         *            server
+         * @param[in] fd the empty file where the image is written to
+         * @return @c true if the image has been written to @p fd, @c false
+         *         if the image has to be downloaded (@p fd is empty then)
+         */
+        bool restore(const std::string &url, const std::string &validator, int fd);
+
+        /**
+         * @brief Puts an image into the cache
+         *
+         * Copies the content of @p fd into the cache and removes the least
+         * recently used images if the cache is too large now.
+         *
+         * @param[in] url the URL of the image
+         * @param[in] validator the validator of the image, if it's empty the
+         *            image is not cached
+         * @param[in] fd the file that contains the image
+         */
+        void store(const std::string &url, const std::string &validator, int fd);
+
+    protected:
+        /**
+         * @brief Entry of the index
+         */
+        struct Entry {
+            std::string         url;        /**< URL of the image */
+            std::string         validator;  /**< validator sent by the server */
+            std::string         checksum;   /**< SHA-256 checksum of the image */
+            unsigned long long  size;       /**< size of the image in bytes */
+            time_t              lastUsed;   /**< last time the image was used */
+        };
+
+        typedef std::vector<Entry> EntryVector;
+
+        bool lock();
+        void unlock();
+        EntryVector readIndex() const;
+        void writeIndex(const EntryVector &entries) const;
+        void evict(EntryVector &entries) const;
+        void removeEntry(EntryVector &entries, size_t index) const;
+        std::string getPath(const std::string &checksum) const;
+
+    private:
+        ImageCache(const ImageCache &);
+        ImageCache &operator=(const ImageCache &);
+
+    private:
+        std::string         m_directory;
+        unsigned long long  m_maxSize;
+        int                 m_lockFd;
+};
+
+/* }}} */
+
+#endif /* IMAGECACHE_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
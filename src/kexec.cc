@@ -16,11 +16,30 @@
  */
 #include <string>
 #include <iostream>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <libbw/debug.h>
 
 #include "kexec.h"
 #include "process.h"
 #include "console.h"
 #include "global.h"
+#include "config.h"
+
+#ifndef KEXEC_FILE_NO_INITRAMFS
+#  define KEXEC_FILE_NO_INITRAMFS 0x00000004
+#endif
+
+/* ---------------------------------------------------------------------------------------------- */
+Kexec::Kexec()
+    : m_kernelFd(-1)
+    , m_initrdFd(-1)
+{}
 
 /* ---------------------------------------------------------------------------------------------- */
 void Kexec::setKernel(const std::string &filename)
@@ -34,6 +53,12 @@ std::string Kexec::getKernel() const
     return m_kernel;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+void Kexec::setKernelFd(int fd)
+{
+    m_kernelFd = fd;
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 void Kexec::setInitrd(const std::string &filename)
 {
@@ -46,6 +71,12 @@ std::string Kexec::getInitrd() const
     return m_initrd;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+void Kexec::setInitrdFd(int fd)
+{
+    m_initrdFd = fd;
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 void Kexec::setAppend(const std::string &append)
 {
@@ -73,12 +104,68 @@ bool Kexec::reboot() const
 
 /* ---------------------------------------------------------------------------------------------- */
 bool Kexec::load()
+{
+    if (m_kernelFd >= 0) {
+        int err = loadFile();
+        if (err == 0)
+            return true;
+
+        BW_DEBUG_INFO("kexec_file_load() failed: %s, falling back to kexec", std::strerror(err));
+    }
+
+    return loadProcess();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+int Kexec::loadFile()
+{
+#if HAVE_KEXEC_FILE_LOAD
+    unsigned long flags = 0;
+    if (m_initrdFd < 0)
+        flags |= KEXEC_FILE_NO_INITRAMFS;
+
+    BW_DEBUG_DBG("kexec_file_load(%d, %d, '%s', %lu)",
+                 m_kernelFd, m_initrdFd, m_append.c_str(), flags);
+
+    if (Process::isDryRunMode()) {
+        std::cerr << "(dry run) kexec_file_load('" << m_append << "')" << std::endl;
+        return 0;
+    }
+
+    // the length includes the terminating NUL byte
+    long ret = syscall(SYS_kexec_file_load, m_kernelFd, m_initrdFd,
+                       m_append.size() + 1, m_append.c_str(), flags);
+
+    return ret == 0 ? 0 : errno;
+#else
+    return ENOSYS;
+#endif
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string fd_path(int fd)
+{
+    std::stringstream ss;
+    ss << "/proc/" << getpid() << "/fd/" << fd;
+    return ss.str();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool Kexec::loadProcess()
 {
     Process p("kexec");
 
+    std::string kernel = m_kernel;
+    if (kernel.empty() && m_kernelFd >= 0)
+        kernel = fd_path(m_kernelFd);
+
+    std::string initrd = m_initrd;
+    if (initrd.empty() && m_initrdFd >= 0)
+        initrd = fd_path(m_initrdFd);
+
     p.addArg("-l");
-    p.addArg(m_kernel);
-    p.addArg("--initrd=" + m_initrd);
+    p.addArg(kernel);
+    p.addArg("--initrd=" + initrd);
     p.addArg("--append=" + m_append);
 
     return p.execute() == 0;
@@ -26,6 +26,8 @@
  * @author Bernhard Walle <bernhard@bwalle.de>
  */
 
+#include <string>
+
 /* Kexec {{{ */
 
 /**
@@ -37,6 +39,14 @@
  */
 class Kexec {
 
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Creates a new Kexec object without kernel and initrd.
+         */
+        Kexec();
+
     public:
         /**
          * @brief Sets the kernel
@@ -56,6 +66,19 @@ class Kexec {
          */
         std::string getKernel() const;
 
+        /**
+         * @brief Sets the kernel file descriptor
+         *
+         * Sets an open file descriptor of the kernel image. If a file
+         * descriptor is set, load() passes it directly to the
+         * kexec_file_load(2) system call. The descriptor must be readable
+         * and is not closed by Kexec. A file name that has been set with
+         * setKernel() is still used by the fallback in load().
+         *
+         * @param[in] fd the file descriptor or -1 to unset it
+         */
+        void setKernelFd(int fd);
+
         /**
          * @brief Sets the initrd
          *
@@ -74,6 +97,15 @@ class Kexec {
          */
         std::string getInitrd() const;
 
+        /**
+         * @brief Sets the initrd file descriptor
+         *
+         * Sets an open file descriptor of the initrd. See setKernelFd().
+         *
+         * @param[in] fd the file descriptor or -1 to unset it
+         */
+        void setInitrdFd(int fd);
+
         /**
          * @brief Sets the append line
          *
@@ -120,6 +152,13 @@ class Kexec {
          * with the initrd that has been set with setInitrd() and the kernel
          * parameters (see setAppend() and addAppend()).
          *
+         * If the kernel has been set with setKernelFd(), the kernel is loaded
+         * with the kexec_file_load(2) system call without the need to have
+         * the images in the file system. If the running kernel doesn't
+         * support that system call, @c kexec is used as fallback. In that
+         * case, file descriptors without file name are passed as
+         * <tt>/proc/PID/fd/FD</tt>.
+         *
          * @return @c true on success, @c false on failure
          */
         bool load();
@@ -144,10 +183,27 @@ class Kexec {
          */
         bool execute();
 
+    protected:
+        /**
+         * @brief Loads the kernel with kexec_file_load(2)
+         *
+         * @return 0 on success, the @c errno value on failure
+         */
+        int loadFile();
+
+        /**
+         * @brief Loads the kernel with the @c kexec program
+         *
+         * @return @c true on success, @c false on failure
+         */
+        bool loadProcess();
+
     private:
         std::string m_kernel;
         std::string m_initrd;
         std::string m_append;
+        int m_kernelFd;
+        int m_initrdFd;
 };
 
 /* }}} */
@@ -0,0 +1,199 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+
+#include <strings.h>
+
+#include "labeltrie.h"
+
+#define NO_NODE     ((size_t)-1)
+
+/* ---------------------------------------------------------------------------------------------- */
+static inline char lower(char c)
+{
+    return std::tolower((unsigned char)c);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static bool starts_with_nocase(const std::string &str, const std::string &start)
+{
+    return str.size() >= start.size() &&
+        strncasecmp(str.c_str(), start.c_str(), start.size()) == 0;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static bool contains_nocase(const std::string &str, const std::string &pattern)
+{
+    if (pattern.size() > str.size())
+        return false;
+
+    for (size_t i = 0; i <= str.size() - pattern.size(); i++)
+        if (strncasecmp(str.c_str() + i, pattern.c_str(), pattern.size()) == 0)
+            return true;
+
+    return false;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static bool fuzzy_match(const std::string &str, const std::string &pattern)
+{
+    std::string::const_iterator p = pattern.begin();
+
+    for (std::string::const_iterator it = str.begin(); it != str.end() && p != pattern.end(); ++it)
+        if (lower(*it) == lower(*p))
+            ++p;
+
+    return p == pattern.end();
+}
+
+/* LabelTrie {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+LabelTrie::LabelTrie()
+{
+    build(StringVector());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+size_t LabelTrie::findChild(size_t node, char c) const
+{
+    const std::vector<std::pair<char, size_t> > &children = m_nodes[node].children;
+
+    std::vector<std::pair<char, size_t> >::const_iterator it =
+        std::lower_bound(children.begin(), children.end(), std::make_pair(c, size_t(0)));
+    if (it == children.end() || it->first != c)
+        return NO_NODE;
+
+    return it->second;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void LabelTrie::build(const StringVector &labels)
+{
+    m_labels = labels;
+    m_nodes.clear();
+    m_nodes.push_back(Node());
+    m_order.clear();
+    m_order.reserve(labels.size());
+    m_filterPattern.clear();
+    m_filterMatches.clear();
+
+    for (size_t i = 0; i < m_labels.size(); i++) {
+        const std::string &label = m_labels[i];
+        size_t node = 0;
+
+        for (std::string::const_iterator it = label.begin(); it != label.end(); ++it) {
+            char c = lower(*it);
+            size_t child = findChild(node, c);
+
+            if (child == NO_NODE) {
+                child = m_nodes.size();
+                m_nodes.push_back(Node());
+
+                std::vector<std::pair<char, size_t> > &children = m_nodes[node].children;
+                std::pair<char, size_t> edge(c, child);
+                children.insert(std::lower_bound(children.begin(), children.end(), edge), edge);
+            }
+            node = child;
+        }
+
+        m_nodes[node].labels.push_back(i);
+    }
+
+    number(0);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void LabelTrie::number(size_t node)
+{
+    // the labels of a node come before the labels of its children, so each
+    // subtree is a contiguous range in m_order, sorted case-insensitively
+    m_nodes[node].first = m_order.size();
+    m_order.insert(m_order.end(), m_nodes[node].labels.begin(), m_nodes[node].labels.end());
+    std::vector<size_t>().swap(m_nodes[node].labels);
+
+    for (size_t i = 0; i < m_nodes[node].children.size(); i++)
+        number(m_nodes[node].children[i].second);
+
+    m_nodes[node].last = m_order.size();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+StringVector LabelTrie::complete(const std::string &prefix) const
+{
+    StringVector result;
+    size_t node = 0;
+
+    for (std::string::const_iterator it = prefix.begin(); it != prefix.end(); ++it) {
+        node = findChild(node, lower(*it));
+        if (node == NO_NODE)
+            return result;
+    }
+
+    result.reserve(m_nodes[node].last - m_nodes[node].first);
+    for (size_t i = m_nodes[node].first; i < m_nodes[node].last; i++)
+        result.push_back(m_labels[m_order[i]]);
+
+    return result;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+size_t LabelTrie::filter(const std::string &pattern, StringVector &matches, size_t max)
+{
+    matches.clear();
+
+    if (pattern.empty()) {
+        m_filterPattern.clear();
+        m_filterMatches.clear();
+        return 0;
+    }
+
+    // a longer pattern only narrows the previous result
+    std::vector<size_t> candidates;
+    if (!m_filterPattern.empty() && starts_with_nocase(pattern, m_filterPattern))
+        candidates.swap(m_filterMatches);
+    else {
+        candidates.resize(m_labels.size());
+        for (size_t i = 0; i < m_labels.size(); i++)
+            candidates[i] = i;
+    }
+
+    m_filterPattern = pattern;
+    m_filterMatches.clear();
+    for (std::vector<size_t>::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+        if (fuzzy_match(m_labels[*it], pattern))
+            m_filterMatches.push_back(*it);
+
+    // substring matches are better than fuzzy matches
+    for (std::vector<size_t>::const_iterator it = m_filterMatches.begin();
+            it != m_filterMatches.end() && matches.size() < max; ++it)
+        if (contains_nocase(m_labels[*it], pattern))
+            matches.push_back(m_labels[*it]);
+    for (std::vector<size_t>::const_iterator it = m_filterMatches.begin();
+            it != m_filterMatches.end() && matches.size() < max; ++it)
+        if (!contains_nocase(m_labels[*it], pattern))
+            matches.push_back(m_labels[*it]);
+
+    return m_filterMatches.size();
+}
+
+/* }}} */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
@@ -0,0 +1,124 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LABELTRIE_H
+#define LABELTRIE_H
+
+/**
+ * @file labeltrie.h
+ * @brief Completion and search of labels
+ *
+ * This file contains the search structure that is used for the completion of
+ * labels in the boot prompt.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "global.h"
+
+/* LabelTrie {{{ */
+
+/**
+ * @brief Case-insensitive prefix trie of labels
+ *
+ * The trie is built once after the PXE configuration has been read. The
+ * labels are numbered in the order of the trie, so the labels below a node
+ * are a contiguous range and completing a prefix only has to walk down the
+ * prefix, independent of the number of labels.
+ *
+ * Additionally, the labels can be searched for a substring or a fuzzy pattern
+ * (the characters of the pattern in the same order, with other characters in
+ * between). That search is incremental: if the pattern only grows, only the
+ * labels that matched the previous pattern are searched again.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class LabelTrie {
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Creates an empty LabelTrie.
+         */
+        LabelTrie();
+
+    public:
+        /**
+         * @brief Builds the trie
+         *
+         * Replaces the content of the trie with @p labels.
+         *
+         * @param[in] labels the labels
+         */
+        void build(const StringVector &labels);
+
+        /**
+         * @brief Completes a prefix
+         *
+         * Returns all labels that start with @p prefix (case-insensitive),
+         * sorted case-insensitively.
+         *
+         * @param[in] prefix the prefix
+         * @return the matching labels
+         */
+        StringVector complete(const std::string &prefix) const;
+
+        /**
+         * @brief Searches labels
+         *
+         * Searches the labels that contain @p pattern or that match @p pattern
+         * fuzzily. Labels that contain @p pattern come first, otherwise the
+         * labels keep the order of the configuration.
+         *
+         * @param[in] pattern the search pattern
+         * @param[out] matches at most @p max matching labels
+         * @param[in] max the maximum number of labels that are returned in
+         *            @p matches
+         * @return the total number of matching labels
+         */
+        size_t filter(const std::string &pattern, StringVector &matches, size_t max);
+
+    protected:
+        /**
+         * @brief Node of the trie
+         */
+        struct Node {
+            std::vector<std::pair<char, size_t> > children; /**< sorted by character */
+            std::vector<size_t> labels;     /**< labels that end here (build only) */
+            size_t              first;      /**< first label in m_order below the node */
+            size_t              last;       /**< last label + 1 in m_order below the node */
+        };
+
+        size_t findChild(size_t node, char c) const;
+        void number(size_t node);
+
+    private:
+        StringVector        m_labels;
+        std::vector<Node>   m_nodes;
+        std::vector<size_t> m_order;
+        std::string         m_filterPattern;
+        std::vector<size_t> m_filterMatches;
+};
+
+/* }}} */
+
+#endif /* LABELTRIE_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
@@ -58,10 +58,19 @@ int main(int argc, char *argv[])
             return EXIT_SUCCESS;
         }
 
+        if (pe.getPrintServerStatisticsOnly()) {
+            pe.printServerStatistics();
+            return EXIT_SUCCESS;
+        }
+
+        if (pe.getReportDowntimeOnly())
+            return pe.reportDowntime() ? EXIT_SUCCESS : EXIT_FAILURE;
+
         if (!pe.checkEnv())
             return EXIT_FAILURE;
 
         pe.readPxeConfig();
+        pe.startPrefetch();
         pe.displayMessage();
         if (!pe.chooseEntry())
             return EXIT_SUCCESS;
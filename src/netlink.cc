@@ -0,0 +1,216 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <libbw/debug.h>
+
+#include "netlink.h"
+
+// large enough for the biggest message of a dump, the kernel fills at most
+// one page per recvmsg() unless the buffer is bigger
+#define RECEIVE_BUFFER_SIZE 32768
+
+/* Netlink {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+struct nlmsghdr *Netlink::first(std::vector<char> &messages)
+{
+    // NLMSG_OK() checks the remaining length (0) before it looks at the message
+    if (messages.empty())
+        return NULL;
+
+    return reinterpret_cast<struct nlmsghdr *>(&messages[0]);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+Netlink::Netlink()
+    : m_fd(-1)
+    , m_seq(0)
+{}
+
+/* ---------------------------------------------------------------------------------------------- */
+Netlink::~Netlink()
+{
+    close();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Netlink::open(unsigned int groups)
+    throw (ApplicationError)
+{
+    close();
+
+    m_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (m_fd < 0)
+        throw ApplicationError(std::string("socket(AF_NETLINK) failed: ")
+                               + std::strerror(errno));
+
+    struct sockaddr_nl addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+
+    if (bind(m_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+        int error = errno;
+        close();
+        throw ApplicationError(std::string("bind(AF_NETLINK) failed: ") + std::strerror(error));
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Netlink::close()
+{
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+int Netlink::getFd() const
+{
+    return m_fd;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Netlink::dump(int type, unsigned char family, std::vector<char> &messages)
+    throw (ApplicationError)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct rtgenmsg gen;
+    } req;
+
+    std::memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.gen));
+    req.nh.nlmsg_type = type;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.gen.rtgen_family = family;
+
+    request(&req.nh, messages);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Netlink::request(struct nlmsghdr *request, std::vector<char> &messages)
+    throw (ApplicationError)
+{
+    messages.clear();
+
+    request->nlmsg_seq = ++m_seq;
+    request->nlmsg_pid = 0;
+
+    struct sockaddr_nl kernel;
+    std::memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    ssize_t ret;
+    do {
+        ret = sendto(m_fd, request, request->nlmsg_len, 0,
+                     reinterpret_cast<struct sockaddr *>(&kernel), sizeof(kernel));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+        throw ApplicationError(std::string("Sending netlink request failed: ")
+                               + std::strerror(errno));
+
+    std::vector<char> buffer(RECEIVE_BUFFER_SIZE);
+    bool done = false;
+    while (!done) {
+        struct sockaddr_nl from;
+        socklen_t fromlen = sizeof(from);
+        ret = recvfrom(m_fd, &buffer[0], buffer.size(), 0,
+                       reinterpret_cast<struct sockaddr *>(&from), &fromlen);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            throw ApplicationError(std::string("Receiving netlink reply failed: ")
+                                   + std::strerror(errno));
+        if (ret == 0)
+            throw ApplicationError("Netlink socket closed unexpectedly");
+        if (from.nl_pid != 0)
+            continue;
+
+        int len = ret;
+        for (struct nlmsghdr *nh = reinterpret_cast<struct nlmsghdr *>(&buffer[0]);
+                NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+
+            // events of subscribed groups and late replies of older requests
+            if (nh->nlmsg_seq != m_seq)
+                continue;
+
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                done = true;
+                break;
+            }
+
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = static_cast<struct nlmsgerr *>(NLMSG_DATA(nh));
+                if (err->error != 0)
+                    throw ApplicationError(std::string("Netlink request failed: ")
+                                           + std::strerror(-err->error));
+                done = true;
+                break;
+            }
+
+            if (nh->nlmsg_flags & NLM_F_DUMP_INTR)
+                BW_DEBUG_DBG("Netlink dump was interrupted by a change");
+
+            messages.insert(messages.end(), reinterpret_cast<char *>(nh),
+                            reinterpret_cast<char *>(nh) + nh->nlmsg_len);
+            messages.resize(NLMSG_ALIGN(messages.size()));
+
+            if (!(nh->nlmsg_flags & NLM_F_MULTI)) {
+                done = true;
+                break;
+            }
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+int Netlink::discardEvents()
+{
+    std::vector<char> buffer(RECEIVE_BUFFER_SIZE);
+    int count = 0;
+
+    for (;;) {
+        ssize_t ret = recv(m_fd, &buffer[0], buffer.size(), MSG_DONTWAIT);
+        if (ret < 0 && (errno == EINTR || errno == ENOBUFS))
+            continue;
+        if (ret <= 0)
+            break;
+
+        int len = ret;
+        for (struct nlmsghdr *nh = reinterpret_cast<struct nlmsghdr *>(&buffer[0]);
+                NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+            count++;
+    }
+
+    return count;
+}
+
+/* }}} */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
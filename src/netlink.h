@@ -0,0 +1,156 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NETLINK_H
+#define NETLINK_H
+
+/**
+ * @file netlink.h
+ * @brief Routing netlink socket
+ *
+ * This file contains a small wrapper around the rtnetlink interface of the
+ * Linux kernel that is used to query links, addresses and routes.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <vector>
+
+#include <linux/netlink.h>
+
+#include "global.h"
+
+/* Netlink {{{ */
+
+/**
+ * @brief Socket for rtnetlink requests
+ *
+ * The replies are copied into one buffer, one message after another, so
+ * they can be walked with the @c NLMSG_OK and @c NLMSG_NEXT macros:
+ *
+ * @code
+ * std::vector<char> messages;
+ * netlink.dump(RTM_GETLINK, AF_UNSPEC, messages);
+ * int len = messages.size();
+ * for (struct nlmsghdr *nh = Netlink::first(messages); NLMSG_OK(nh, len);
+ *         nh = NLMSG_NEXT(nh, len))
+ *     // ...
+ * @endcode
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class Netlink {
+    public:
+        /**
+         * @brief Returns the first message of a reply
+         *
+         * @param[in] messages the reply
+         * @return the first message, which is only valid if @c NLMSG_OK says so;
+         *         @c NULL if @p messages is empty, which @c NLMSG_OK rejects
+         *         without dereferencing it because the length is 0
+         */
+        static struct nlmsghdr *first(std::vector<char> &messages);
+
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Creates a Netlink object that has no socket yet.
+         */
+        Netlink();
+
+        /**
+         * @brief Destructor
+         *
+         * Closes the socket.
+         */
+        virtual ~Netlink();
+
+    public:
+        /**
+         * @brief Opens the socket
+         *
+         * @param[in] groups the multicast groups (@c RTMGRP_*) to subscribe,
+         *            0 if only requests are sent
+         * @exception ApplicationError if the socket cannot be created
+         */
+        void open(unsigned int groups = 0)
+            throw (ApplicationError);
+
+        /**
+         * @brief Closes the socket
+         */
+        void close();
+
+        /**
+         * @brief Returns the file descriptor of the socket
+         *
+         * @return the file descriptor, -1 if the socket is not open
+         */
+        int getFd() const;
+
+        /**
+         * @brief Dumps a table of the kernel
+         *
+         * Gets all objects of one type, e.g. all links with
+         * @c RTM_GETLINK or all addresses with @c RTM_GETADDR.
+         *
+         * @param[in] type the request type
+         * @param[in] family the address family, @c AF_UNSPEC for all
+         * @param[out] messages the reply, without the @c NLMSG_DONE message
+         * @exception ApplicationError if the request fails
+         */
+        void dump(int type, unsigned char family, std::vector<char> &messages)
+            throw (ApplicationError);
+
+        /**
+         * @brief Sends a request and receives the reply
+         *
+         * The sequence number is filled in.
+         *
+         * @param[in] request the request including its attributes
+         * @param[out] messages the reply
+         * @exception ApplicationError if the request fails or the kernel
+         *            answers with an error
+         */
+        void request(struct nlmsghdr *request, std::vector<char> &messages)
+            throw (ApplicationError);
+
+        /**
+         * @brief Discards the pending events
+         *
+         * Reads all messages of the subscribed multicast groups that are
+         * queued without blocking. If the queue overflowed, the events that
+         * got lost are not reported.
+         *
+         * @return the number of messages that have been discarded
+         */
+        int discardEvents();
+
+    private:
+        Netlink(const Netlink &);
+        Netlink &operator=(const Netlink &);
+
+    private:
+        int             m_fd;
+        unsigned int    m_seq;
+};
+
+/* }}} */
+
+#endif /* NETLINK_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
@@ -18,35 +18,62 @@
 #include <vector>
 #include <cerrno>
 #include <cstring>
+#include <ctime>
 #include <algorithm>
 #include <fstream>
+#include <map>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <net/if.h>
-#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <unistd.h>
+#include <linux/rtnetlink.h>
 
+#include <libbw/clock.h>
 #include <libbw/stringutil.h>
 #include <libbw/debug.h>
 
 #include "networkhelper.h"
+#include "netlink.h"
+#include "trace.h"
+
+// not in <net/if.h>, and <linux/if.h> clashes with it
+#ifndef IFF_LOWER_UP
+#  define IFF_LOWER_UP 0x10000
+#endif
 
 /* NetworkInterface {{{ */
 
 /* ---------------------------------------------------------------------------------------------- */
 NetworkInterface::NetworkInterface()
     : m_isValid(false)
-{}
+    , m_up(false)
+    , m_carrier(false)
+    , m_index(0)
+    , m_ip(0)
+    , m_hasIp(false)
+{
+    std::memset(m_mac, 0, sizeof(m_mac));
+}
 
 /* ---------------------------------------------------------------------------------------------- */
 NetworkInterface::NetworkInterface(const std::string &name)
     : m_isValid(true)
     , m_up(false)
+    , m_carrier(false)
+    , m_index(0)
     , m_name(name)
-{}
+    , m_ip(0)
+    , m_hasIp(false)
+{
+    std::memset(m_mac, 0, sizeof(m_mac));
+}
 
 /* ---------------------------------------------------------------------------------------------- */
 bool NetworkInterface::isValid() const
@@ -66,6 +93,18 @@ void NetworkInterface::setName(const std::string &name)
     m_name = name;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+int NetworkInterface::getIndex() const
+{
+    return m_index;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void NetworkInterface::setIndex(int index)
+{
+    m_index = index;
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 bool NetworkInterface::isUp()
 {
@@ -78,6 +117,18 @@ void NetworkInterface::setUp(bool up)
     m_up = up;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+bool NetworkInterface::hasCarrier() const
+{
+    return m_carrier;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void NetworkInterface::setCarrier(bool carrier)
+{
+    m_carrier = carrier;
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 std::string NetworkInterface::getMac(int format)
 {
@@ -132,6 +183,25 @@ std::string NetworkInterface::getIp(int format)
 void NetworkInterface::setIp(int addr)
 {
     m_ip = addr;
+    m_hasIp = true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool NetworkInterface::hasIp() const
+{
+    return m_hasIp;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+const StringVector &NetworkInterface::getIpv6Addresses() const
+{
+    return m_ipv6;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void NetworkInterface::addIpv6Address(const std::string &ip)
+{
+    m_ipv6.push_back(ip);
 }
 
 /* ---------------------------------------------------------------------------------------------- */
@@ -147,6 +217,73 @@ std::string NetworkInterface::getDHCPServerIP() const
 }
 
 /* }}} */
+
+/**
+ * @brief Candidate for the boot interface
+ */
+struct Candidate {
+    NetworkInterface    interface;  /**< the interface */
+    long                speed;      /**< Mbit/s, -1 if unknown */
+};
+
+/* ---------------------------------------------------------------------------------------------- */
+static long link_speed(const std::string &ifname)
+{
+    // ethtool knows that, too, but the kernel has already asked the driver
+    std::ifstream fin(("/sys/class/net/" + ifname + "/speed").c_str());
+    long speed = -1;
+
+    if (!(fin >> speed))
+        return -1;
+
+    return speed;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static bool better_candidate(const Candidate &a, const Candidate &b)
+{
+    if (a.interface.hasCarrier() != b.interface.hasCarrier())
+        return a.interface.hasCarrier();
+
+    return a.speed > b.speed;
+}
+
+// the directories of dhcpcd and dhclient that contain the leases
+static const char *lease_directories[] = {
+    "/var/lib/dhcpcd",
+    "/var/lib/dhcp3",
+    "/var/lib/dhcp"
+};
+
+/* ---------------------------------------------------------------------------------------------- */
+static void discard_inotify_events(int fd)
+{
+    char buffer[4096];
+
+    for (;;) {
+        ssize_t ret = read(fd, buffer, sizeof(buffer));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string host_of_server(const std::string &server)
+{
+    // the server may be "host", "host:port", "[v6 address]:port" or have a path
+    if (!server.empty() && server[0] == '[') {
+        std::string::size_type end = server.find(']');
+        return end == std::string::npos ? std::string() : server.substr(1, end - 1);
+    }
+
+    if (std::count(server.begin(), server.end(), ':') > 1)
+        return server.substr(0, server.find('/'));
+
+    return server.substr(0, server.find_first_of(":/"));
+}
+
 /* NetworkHelper {{{ */
 
 /* ---------------------------------------------------------------------------------------------- */
@@ -177,7 +314,7 @@ NetworkInterface NetworkHelper::getInterface(const std::string &ifname)
 
 
 /* ---------------------------------------------------------------------------------------------- */
-std::vector<NetworkInterface> NetworkHelper::getInterfaces()
+NetworkInterface NetworkHelper::getInterfaceToHost(const std::string &server)
     throw (ApplicationError)
 {
     if (!m_ifDiscovered) {
@@ -185,81 +322,322 @@ std::vector<NetworkInterface> NetworkHelper::getInterfaces()
         m_ifDiscovered = true;
     }
 
-    return m_interfaces;
+    TraceSpan span("route to server", server);
+    std::vector<int> indexes;
+    if (!server.empty() && lookupRoute(server, indexes))
+        BW_DEBUG_DBG("Route to %s uses %lu interface(s)", server.c_str(),
+                     (unsigned long)indexes.size());
+
+    std::vector<Candidate> candidates;
+    for (int pass = 0; pass < 2 && candidates.empty(); pass++) {
+        for (std::vector<NetworkInterface>::iterator it = m_interfaces.begin();
+                it != m_interfaces.end(); ++it) {
+            if (!it->isUp() || !it->hasIp())
+                continue;
+
+            // the second pass ignores the route, the loopback interface is no candidate
+            if (pass == 0 && std::find(indexes.begin(), indexes.end(),
+                                       it->getIndex()) == indexes.end())
+                continue;
+
+            Candidate candidate;
+            candidate.interface = *it;
+            candidate.speed = link_speed(it->getName());
+            candidates.push_back(candidate);
+        }
+    }
+
+    if (candidates.empty())
+        return NetworkInterface();
+
+    std::stable_sort(candidates.begin(), candidates.end(), better_candidate);
+
+    return candidates.front().interface;
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-#define MAX_IFS 30
-void NetworkHelper::detectInterfaces()
+bool NetworkHelper::waitForNetwork(const std::string &ifname, const std::string &server,
+                                   int timeout, bool needLease)
     throw (ApplicationError)
 {
-    int sockfd;
-    struct ifreq *ifr;
+    TraceSpan span("wait for network");
+
+    // subscribe before the first check, so that no change gets lost
+    Netlink netlink;
+    netlink.open(RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+                 RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE);
+
+    // the lease files only matter if nobody else tells the server
+    int inotifyFd = -1;
+    if (server.empty() && needLease) {
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0)
+            BW_DEBUG_INFO("inotify_init1() failed: %s", std::strerror(errno));
+    }
+    for (size_t i = 0; inotifyFd >= 0 && i < ARRAY_SIZE(lease_directories); i++)
+        if (inotify_add_watch(inotifyFd, lease_directories[i],
+                              IN_CLOSE_WRITE | IN_MOVED_TO) >= 0)
+            BW_DEBUG_DBG("Watching %s for leases", lease_directories[i]);
+
+    long long deadline = bw::monotonicMs() + timeout * 1000LL;
+    bool ready = false;
+    try {
+        while (!(ready = isNetworkReady(ifname, server, needLease))) {
+            long long remaining = deadline - bw::monotonicMs();
+            if (remaining <= 0)
+                break;
+
+            struct pollfd fds[2];
+            fds[0].fd = netlink.getFd();
+            fds[0].events = POLLIN;
+            fds[1].fd = inotifyFd;
+            fds[1].events = POLLIN;
+
+            int ret = poll(fds, inotifyFd >= 0 ? 2 : 1, remaining);
+            if (ret < 0 && errno != EINTR)
+                throw ApplicationError(std::string("poll() failed: ") + std::strerror(errno));
+
+            // the events only tell that something changed, the check reads everything again
+            int events = netlink.discardEvents();
+            if (inotifyFd >= 0)
+                discard_inotify_events(inotifyFd);
+            BW_DEBUG_DBG("Network changed (%d netlink events)", events);
+        }
+    } catch (...) {
+        if (inotifyFd >= 0)
+            close(inotifyFd);
+        throw;
+    }
 
-    BW_DEBUG_TRACE("Detecting network interfaces");
+    if (inotifyFd >= 0)
+        close(inotifyFd);
 
-    sockfd = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
-    if (!sockfd)
-        throw ApplicationError(std::string("socket(PF_INET) failed: ") + std::strerror(errno));
+    return ready;
+}
 
-    struct ifconf ifc;
-    struct ifconf buffer[MAX_IFS];
-    ifc.ifc_buf = reinterpret_cast<char *>(buffer);
-    ifc.ifc_len = MAX_IFS * sizeof(struct ifreq);
+/* ---------------------------------------------------------------------------------------------- */
+bool NetworkHelper::isNetworkReady(const std::string &ifname, const std::string &server,
+                                   bool needLease)
+    throw (ApplicationError)
+{
+    m_interfaces.clear();
+    detectInterfaces();
+    m_ifDiscovered = true;
 
-    int ret = ioctl(sockfd, SIOCGIFCONF, &ifc);
-    int error = errno;
-    if (ret < 0) {
-        close(sockfd);
-        throw ApplicationError(std::string("ioctl(sockfd) failed: ") + std::strerror(error));
+    NetworkInterface netif = ifname.empty() ? getInterfaceToHost(server) : getInterface(ifname);
+    if (!netif.isValid()) {
+        BW_DEBUG_DBG("Waiting for the interface");
+        return false;
     }
+    if (!netif.isUp() || !netif.hasCarrier()) {
+        BW_DEBUG_DBG("Waiting for the link of %s", netif.getName().c_str());
+        return false;
+    }
+    if (!netif.hasIp()) {
+        BW_DEBUG_DBG("Waiting for an address of %s", netif.getName().c_str());
+        return false;
+    }
+    if (server.empty() && needLease && netif.getDHCPServerIP().empty()) {
+        BW_DEBUG_DBG("Waiting for the lease of %s", netif.getName().c_str());
+        return false;
+    }
+
+    return true;
+}
 
-    ifr = ifc.ifc_req;
-    for (int n = 0; n < ifc.ifc_len; n += sizeof(struct ifreq), ifr++) {
-        NetworkInterface interface(ifr->ifr_name);
-        interface.setUp(true);
+/* ---------------------------------------------------------------------------------------------- */
+bool NetworkHelper::lookupRoute(const std::string &server, std::vector<int> &indexes)
+{
+    std::string host = host_of_server(server);
+    struct addrinfo hints, *result;
 
-        BW_DEBUG_INFO("Found network interface %s", interface.getName().c_str());
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
 
-        // get flags to see if it's a loopback interface
-        ret = ioctl(sockfd, SIOCGIFFLAGS, ifr);
-        if (ret < 0) {
-            close(sockfd);
-            throw ApplicationError(std::string("ioctl(SIOCGIFHWADDR) failed: ")
-                                   + std::strerror(error));
-        }
-        if (ifr->ifr_flags & IFF_LOOPBACK) {
-            BW_DEBUG_TRACE("Interface %s is loopback", interface.getName().c_str());
+    int err = getaddrinfo(host.c_str(), NULL, &hints, &result);
+    if (err != 0) {
+        BW_DEBUG_INFO("Cannot resolve %s: %s", host.c_str(), gai_strerror(err));
+        return false;
+    }
+
+    struct {
+        struct nlmsghdr nh;
+        struct rtmsg    rt;
+        char            attrs[RTA_SPACE(sizeof(struct in6_addr))];
+    } req;
+
+    std::memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rt));
+    req.nh.nlmsg_type = RTM_GETROUTE;
+    req.nh.nlmsg_flags = NLM_F_REQUEST;
+    req.rt.rtm_family = result->ai_family;
+    // the route as it's in the table, including all next hops of a multipath route
+    req.rt.rtm_flags = RTM_F_FIB_MATCH;
+
+    struct rtattr *rta = reinterpret_cast<struct rtattr *>(
+            reinterpret_cast<char *>(&req) + NLMSG_ALIGN(req.nh.nlmsg_len));
+    rta->rta_type = RTA_DST;
+    if (result->ai_family == AF_INET) {
+        struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(result->ai_addr);
+        rta->rta_len = RTA_LENGTH(sizeof(sin->sin_addr));
+        std::memcpy(RTA_DATA(rta), &sin->sin_addr, sizeof(sin->sin_addr));
+        req.rt.rtm_dst_len = 32;
+    } else {
+        struct sockaddr_in6 *sin6 = reinterpret_cast<struct sockaddr_in6 *>(result->ai_addr);
+        rta->rta_len = RTA_LENGTH(sizeof(sin6->sin6_addr));
+        std::memcpy(RTA_DATA(rta), &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+        req.rt.rtm_dst_len = 128;
+    }
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+    freeaddrinfo(result);
+
+    std::vector<char> messages;
+    try {
+        Netlink netlink;
+        netlink.open();
+        netlink.request(&req.nh, messages);
+    } catch (const ApplicationError &err) {
+        // e.g. "Network is unreachable"
+        BW_DEBUG_INFO("No route to %s: %s", host.c_str(), err.what());
+        return false;
+    }
+
+    int len = messages.size();
+    for (struct nlmsghdr *nh = Netlink::first(messages); NLMSG_OK(nh, len);
+            nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type != RTM_NEWROUTE)
             continue;
-        }
 
-        // get MAC address
-        ret = ioctl(sockfd, SIOCGIFHWADDR, ifr);
-        if (ret < 0) {
-            close(sockfd);
-            throw ApplicationError(std::string("ioctl(SIOCGIFHWADDR) failed: ")
-                    + std::strerror(error));
+        struct rtmsg *rt = static_cast<struct rtmsg *>(NLMSG_DATA(nh));
+        int attrlen = RTM_PAYLOAD(nh);
+        for (rta = RTM_RTA(rt); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+            if (rta->rta_type == RTA_OIF) {
+                indexes.push_back(*static_cast<int *>(RTA_DATA(rta)));
+            } else if (rta->rta_type == RTA_MULTIPATH) {
+                struct rtnexthop *rtnh = static_cast<struct rtnexthop *>(RTA_DATA(rta));
+                int nhlen = RTA_PAYLOAD(rta);
+                while (RTNH_OK(rtnh, nhlen)) {
+                    indexes.push_back(rtnh->rtnh_ifindex);
+                    nhlen -= RTNH_ALIGN(rtnh->rtnh_len);
+                    rtnh = RTNH_NEXT(rtnh);
+                }
+            }
         }
-        interface.setMac(ifr->ifr_hwaddr.sa_data);
-
-        // get IP address
-        ret = ioctl(sockfd, SIOCGIFADDR, ifr);
-        if (ret < 0) {
-            close(sockfd);
-            throw ApplicationError(std::string("ioctl(SIOCGIFADDR) failed: ")
-                    + std::strerror(error));
+    }
+
+    return !indexes.empty();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+std::vector<NetworkInterface> NetworkHelper::getInterfaces()
+    throw (ApplicationError)
+{
+    if (!m_ifDiscovered) {
+        detectInterfaces();
+        m_ifDiscovered = true;
+    }
+
+    return m_interfaces;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void NetworkHelper::detectInterfaces()
+    throw (ApplicationError)
+{
+    BW_DEBUG_TRACE("Detecting network interfaces");
+    TraceSpan span("discover interfaces");
+
+    Netlink netlink;
+    netlink.open();
+
+    std::vector<char> messages;
+    std::map<int, size_t> indexes;
+
+    netlink.dump(RTM_GETLINK, AF_UNSPEC, messages);
+    int len = messages.size();
+    for (struct nlmsghdr *nh = Netlink::first(messages); NLMSG_OK(nh, len);
+            nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type != RTM_NEWLINK)
+            continue;
+
+        struct ifinfomsg *ifi = static_cast<struct ifinfomsg *>(NLMSG_DATA(nh));
+        if (ifi->ifi_flags & IFF_LOOPBACK)
+            continue;
+
+        const char *name = NULL, *mac = NULL;
+        int attrlen = IFLA_PAYLOAD(nh);
+        for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, attrlen);
+                rta = RTA_NEXT(rta, attrlen)) {
+            if (rta->rta_type == IFLA_IFNAME)
+                name = static_cast<const char *>(RTA_DATA(rta));
+            else if (rta->rta_type == IFLA_ADDRESS && RTA_PAYLOAD(rta) >= 6)
+                mac = static_cast<const char *>(RTA_DATA(rta));
         }
+        if (!name)
+            continue;
 
-        interface.setIp(((struct sockaddr_in *)&ifr->ifr_addr)->sin_addr.s_addr);
+        NetworkInterface interface(name);
+        interface.setIndex(ifi->ifi_index);
+        interface.setUp(ifi->ifi_flags & IFF_UP);
+        interface.setCarrier(ifi->ifi_flags & IFF_LOWER_UP);
+        if (mac)
+            interface.setMac(mac);
+
+        BW_DEBUG_INFO("Found network interface %s", interface.getName().c_str());
 
+        indexes[ifi->ifi_index] = m_interfaces.size();
         m_interfaces.push_back(interface);
     }
 
-    close(sockfd);
+    netlink.dump(RTM_GETADDR, AF_UNSPEC, messages);
+    len = messages.size();
+    for (struct nlmsghdr *nh = Netlink::first(messages); NLMSG_OK(nh, len);
+            nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type != RTM_NEWADDR)
+            continue;
+
+        struct ifaddrmsg *ifa = static_cast<struct ifaddrmsg *>(NLMSG_DATA(nh));
+        std::map<int, size_t>::const_iterator index = indexes.find(ifa->ifa_index);
+        if (index == indexes.end())
+            continue;
+        NetworkInterface &interface = m_interfaces[index->second];
+
+        // for point-to-point links, IFA_ADDRESS is the address of the peer
+        const void *address = NULL, *local = NULL;
+        int attrlen = IFA_PAYLOAD(nh);
+        for (struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, attrlen);
+                rta = RTA_NEXT(rta, attrlen)) {
+            if (rta->rta_type == IFA_ADDRESS)
+                address = RTA_DATA(rta);
+            else if (rta->rta_type == IFA_LOCAL)
+                local = RTA_DATA(rta);
+        }
+        if (local)
+            address = local;
+        if (!address)
+            continue;
+
+        if (ifa->ifa_family == AF_INET) {
+            // the primary address comes first, like SIOCGIFADDR returns it
+            if (interface.hasIp())
+                continue;
+
+            struct in_addr addr;
+            std::memcpy(&addr, address, sizeof(addr));
+            interface.setIp(addr.s_addr);
+        } else if (ifa->ifa_family == AF_INET6) {
+            char buffer[INET6_ADDRSTRLEN];
+            if (inet_ntop(AF_INET6, address, buffer, sizeof(buffer)))
+                interface.addIpv6Address(buffer);
+        }
+    }
+
+    netlink.close();
 
+    TraceSpan leaseSpan("parse leases");
     detectDHCPServers();
 }
-#undef MAX_IFS
 
 /* ---------------------------------------------------------------------------------------------- */
 bool NetworkHelper::detectDHCPServers()
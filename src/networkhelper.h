@@ -37,7 +37,8 @@
  * @brief Describes a network interface
  *
  * This class describes a Ethernet network interface. A network interface has
- * an IP address, a MAC address and a name (like @c eth0).
+ * a name (like @c eth0), an index, a MAC address and optionally an IPv4
+ * address and IPv6 addresses.
  *
  * @author Bernhard Walle <bernhard@bwalle.de>
  */
@@ -121,6 +122,22 @@ class NetworkInterface {
          */
         std::string getName() const;
 
+        /**
+         * @brief Returns the interface index
+         *
+         * Returns the index of the interface in the kernel.
+         *
+         * @return the index, 0 if unknown
+         */
+        int getIndex() const;
+
+        /**
+         * @brief Sets the interface index
+         *
+         * @param[in] index the index of the interface in the kernel
+         */
+        void setIndex(int index);
+
         /**
          * @brief Checks if the network interface is "up"
          *
@@ -142,6 +159,20 @@ class NetworkInterface {
          */
         void setUp(bool up);
 
+        /**
+         * @brief Checks if the network interface has a carrier
+         *
+         * @return @c true if the link is up, e.g. a cable is plugged in
+         */
+        bool hasCarrier() const;
+
+        /**
+         * @brief Sets the carrier status
+         *
+         * @param[in] carrier @c true if the link is up, @c false otherwise
+         */
+        void setCarrier(bool carrier);
+
         /**
          * @brief Retrieves the MAC address of the network interface
          *
@@ -196,6 +227,27 @@ class NetworkInterface {
          */
         void setIp(int ip);
 
+        /**
+         * @brief Checks if the network interface has an IPv4 address
+         *
+         * @return @c true if setIp() has been called, @c false otherwise
+         */
+        bool hasIp() const;
+
+        /**
+         * @brief Returns the IPv6 addresses
+         *
+         * @return the addresses in the usual notation, e.g. <tt>fe80::1</tt>
+         */
+        const StringVector &getIpv6Addresses() const;
+
+        /**
+         * @brief Adds an IPv6 address
+         *
+         * @param[in] ip the address in the usual notation
+         */
+        void addIpv6Address(const std::string &ip);
+
         /**
          * @brief Returns the IP address of the DHCP server
          *
@@ -219,10 +271,14 @@ class NetworkInterface {
     private:
         bool m_isValid;
         bool m_up;
+        bool m_carrier;
+        int m_index;
         std::string m_name;
         std::string m_dhcpServerIP;
         char m_mac[6];
         int m_ip;
+        bool m_hasIp;
+        StringVector m_ipv6;
 };
 
 /* }}} */
@@ -234,8 +290,11 @@ class NetworkInterface {
  * This object is responsible to getrieve NetworkInterface objects from system
  * information.
  *
+ * The interfaces are read from the kernel with rtnetlink, so there's no limit
+ * of the number of interfaces, and interfaces without IPv4 address are found,
+ * too. Loopback interfaces are left out.
+ *
  * @author Bernhard Walle <bernhard@bwalle.de>
- * @bug only 30 network interfaces can currently be managed by a NetworkHelper
  */
 class NetworkHelper {
 
@@ -278,17 +337,90 @@ class NetworkHelper {
          */
         NetworkInterface getInterface(const std::string &ifname);
 
+        /**
+         * @brief Returns the interface that leads to a server
+         *
+         * Asks the routing table of the kernel which interface is used to
+         * reach @p server. If the route has several next hops, or if there's
+         * no usable route (e.g. because @p server is empty, can't be resolved
+         * or is reached over the loopback interface), all interfaces that
+         * are up and have an IPv4 address are candidates. Among the
+         * candidates, interfaces with carrier win over the others, then the
+         * faster link wins.
+         *
+         * @param[in] server the host name or IP address, optionally followed
+         *            by a port or a path like the servers on the command
+         *            line, may be empty
+         * @return the interface, invalid if no interface is usable
+         * @exception ApplicationError if detecting network interfaces failed
+         */
+        NetworkInterface getInterfaceToHost(const std::string &server)
+            throw (ApplicationError);
+
+        /**
+         * @brief Waits until the network is ready
+         *
+         * The network is ready if the interface (@p ifname, or the one that
+         * getInterfaceToHost() returns) is up, has carrier and an IPv4
+         * address, and if there's a server: either @p server, or the DHCP
+         * server from the lease file. Without @p needLease, e.g. when the DHCP
+         * server is asked directly afterwards, link and address are enough.
+         * Instead of polling, the function
+         * sleeps until the kernel reports a change of the links, addresses
+         * or routes, or until a file in the lease directories is written.
+         *
+         * Afterwards, the interfaces are the ones of the last check.
+         *
+         * @param[in] ifname the interface, empty to choose one
+         * @param[in] server the server, empty to use the DHCP server
+         * @param[in] timeout the maximum time to wait in seconds
+         * @param[in] needLease @c false if a lease file is not needed when
+         *            @p server is empty
+         * @return @c true if the network is ready, @c false on timeout
+         * @exception ApplicationError if detecting network interfaces failed
+         */
+        bool waitForNetwork(const std::string &ifname, const std::string &server, int timeout,
+                            bool needLease = true)
+            throw (ApplicationError);
+
     protected:
         /**
          * @brief Detects interfaces
          *
-         * Detects the interfaces that are present in the system. Fills m_interfaces.
+         * Detects the interfaces that are present in the system. Fills
+         * m_interfaces with one dump of the links and one dump of the
+         * addresses.
          *
          * @throw ApplicationError on any error
          */
         void detectInterfaces()
             throw (ApplicationError);
 
+        /**
+         * @brief Looks up the route to a server
+         *
+         * @param[in] server the server like for getInterfaceToHost()
+         * @param[out] indexes the indexes of the outgoing interfaces, more than
+         *             one for multipath routes
+         * @return @c true if a route has been found, @c false otherwise
+         */
+        bool lookupRoute(const std::string &server, std::vector<int> &indexes);
+
+        /**
+         * @brief Checks once if the network is ready
+         *
+         * Detects the interfaces again.
+         *
+         * @param[in] ifname the interface like for waitForNetwork()
+         * @param[in] server the server like for waitForNetwork()
+         * @param[in] needLease like for waitForNetwork()
+         * @return @c true if the network is ready, @c false otherwise
+         * @exception ApplicationError if detecting network interfaces failed
+         */
+        bool isNetworkReady(const std::string &ifname, const std::string &server,
+                            bool needLease)
+            throw (ApplicationError);
+
 
         /**
          * @brief Detects the DHCP server
@@ -51,6 +51,13 @@ void Process::disableDryRunMode()
     m_dryRunMode = false;
 }
 
+/* -------------------------------------------------------------------------- */
+bool Process::isDryRunMode()
+    throw ()
+{
+    return m_dryRunMode;
+}
+
 /* -------------------------------------------------------------------------- */
 bool Process::isInPath(const std::string &program)
 {
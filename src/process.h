@@ -95,6 +95,18 @@ class Process {
         static void disableDryRunMode()
         throw ();
 
+        /**
+         * @brief Checks if the dry-run mode is enabled
+         *
+         * Code that doesn't use Process to change the system can use that
+         * function to behave like Process::execute() in dry-run mode.
+         *
+         * @return @c true if Process::enableDryRunMode() has been called,
+         *         @c false otherwise
+         */
+        static bool isDryRunMode()
+        throw ();
+
     public:
         /**
          * @brief Constructor
@@ -19,17 +19,28 @@
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <iomanip>
+#include <algorithm>
 #include <ctime>
 #include <cmath>
 #include <cstring>
 #include <cstring>
 #include <memory>
+#include <set>
+#include <tr1/memory>
 #include <cstdlib>
+#include <cerrno>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <termios.h>
 #include <unistd.h>
 
+#include <libbw/clock.h>
 #include <libbw/debug.h>
 #include <libbw/completion.h>
 #include <libbw/stringutil.h>
@@ -38,8 +49,12 @@
 #include "pxekexec.h"
 #include "networkhelper.h"
 #include "downloader.h"
+#include "tftp.h"
 #include "pxeparser.h"
 #include "kexec.h"
+#include "trace.h"
+#include "downtime.h"
+#include "dhcp.h"
 #include "config.h"
 #include "process.h"
 #include "linuxdb.h"
@@ -87,7 +102,68 @@ class SimpleNotifier : public ProgressNotifier {
         struct timeval m_lastDot;
 };
 
+/* }}} */
+/* ConfigSink definition {{{ */
+
+/**
+ * @brief Parser of a PXE configuration that is being downloaded
+ *
+ * Implements the DownloadSink interface, passing the data to a PxeParser
+ * while it arrives. Parse errors are kept until the download is finished.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class ConfigSink : public DownloadSink {
+
+    public:
+        /**
+         * @brief Default Constructor
+         *
+         * Creates a new instance of ConfigSink.
+         */
+        ConfigSink();
+
+    public:
+        /**
+         * @copydoc DownloadSink::write(const char *, size_t)
+         */
+        bool write(const char *buffer, size_t size);
+
+        /**
+         * @brief Finishes parsing
+         *
+         * @exception ParseError if the configuration is invalid
+         */
+        void finish()
+            throw (ParseError);
+
+        /**
+         * @brief Returns the parser
+         *
+         * @return the parser that contains the configuration after finish()
+         */
+        PxeParser &getParser();
+
+        /**
+         * @brief Returns the size of the configuration
+         *
+         * @return the number of bytes received
+         */
+        long long getSize() const;
+
+    private:
+        PxeParser      m_parser;
+        long long      m_size;
+        std::string    m_error;
+};
+
 #define CONNECTION_TIMEOUT 10
+#define DHCP_TIMEOUT       4
+#define DEFAULT_CACHE_DIR  "/var/cache/pxe-kexec"
+#define DEFAULT_CACHE_SIZE 512
+#define MIRROR_RACE_DELAY  250
+#define STALL_TIMEOUT      15
+#define DEFAULT_STATE_DIR  "/var/lib/pxe-kexec"
 
 /* }}} */
 /* SimpleNotifier implementation {{{ */
@@ -132,12 +208,121 @@ void SimpleNotifier::finished()
     std::cout << std::endl;
 }
 
+/* }}} */
+/* ConfigSink implementation {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+ConfigSink::ConfigSink()
+    : m_size(0)
+{}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool ConfigSink::write(const char *buffer, size_t size)
+{
+    m_size += size;
+
+    try {
+        m_parser.feed(buffer, size);
+    } catch (const ParseError &pe) {
+        m_error = pe.what();
+        return false;
+    }
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ConfigSink::finish()
+    throw (ParseError)
+{
+    if (!m_error.empty())
+        throw ParseError(m_error);
+
+    m_parser.finishParsing();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+PxeParser &ConfigSink::getParser()
+{
+    return m_parser;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+long long ConfigSink::getSize() const
+{
+    return m_size;
+}
+
 /* }}} */
 /* PxeKexec {{{ */
 
+/* ---------------------------------------------------------------------------------------------- */
+static StringVector menu_labels(const PxeConfig &config, bool submenu)
+{
+    const std::vector<PxeEntry> &entries = config.getEntries();
+    StringVector labels;
+
+    // a menu is opened by choosing it, the slash tells it from a label
+    for (std::vector<PxeEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        labels.push_back(it->isMenu() ? it->getLabel() + "/" : it->getLabel());
+    if (submenu)
+        labels.push_back("../");
+
+    return labels;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+// Returns 1 if a key has been pressed, 0 on timeout and -1 if no input can
+// arrive. The key is left in the input queue for the line reader.
+static int wait_for_input(long timeout)
+{
+    struct termios saved;
+    bool tty = tcgetattr(STDIN_FILENO, &saved) == 0;
+
+    // without ICANON, a single key makes the input readable
+    if (tty) {
+        struct termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+
+    int ret;
+    do {
+        fd_set fds;
+        struct timeval tv;
+
+        FD_ZERO(&fds);
+        FD_SET(STDIN_FILENO, &fds);
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        ret = select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv);
+    } while (ret < 0 && errno == EINTR);
+
+    if (tty)
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+
+    if (ret < 0)
+        return -1;
+    if (ret == 0)
+        return 0;
+
+    // a file, a pipe or /dev/null at its end is always readable
+    int pending = 0;
+    if (!tty && (ioctl(STDIN_FILENO, FIONREAD, &pending) != 0 || pending == 0))
+        return -1;
+
+    return 1;
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 PxeKexec::PxeKexec()
-    : m_noconfirm(false)
+    : m_waitNetwork(0)
+    , m_dhcpInform(false)
+    , m_kernelFd(-1)
+    , m_initrdFd(-1)
+    , m_noconfirm(false)
     , m_nodelete(false)
     , m_quiet(false)
     , m_protocol("tftp")
@@ -146,14 +331,30 @@ PxeKexec::PxeKexec()
     , m_force(false)
     , m_ignoreWhitelist(false)
     , m_detectDistOnly(false)
+    , m_serverStatsOnly(false)
+    , m_stats(false)
+    , m_serverHistory(DEFAULT_STATE_DIR)
+    , m_reportDowntime(false)
+    , m_downtime(DEFAULT_STATE_DIR)
     , m_loadOnly(false)
-{}
+    , m_noCache(false)
+    , m_cacheDir(DEFAULT_CACHE_DIR)
+    , m_cacheSize(DEFAULT_CACHE_SIZE * 1024ULL * 1024ULL)
+    , m_noPrefetch(false)
+    , m_autoBoot(false)
+    , m_prefetching(false)
+    , m_prefetchDone(false)
+{
+    pthread_mutex_init(&m_prefetchMutex, NULL);
+}
 
 /* ---------------------------------------------------------------------------------------------- */
 PxeKexec::~PxeKexec()
 {
+    finishPrefetch(false);
     deleteKernels();
     delete m_lineReader;
+    pthread_mutex_destroy(&m_prefetchMutex);
 }
 
 /* ---------------------------------------------------------------------------------------------- */
@@ -180,10 +381,38 @@ bool PxeKexec::parseCmdLine(int argc, char *argv[])
                             "Only load the kernel, don't reboot or 'kexec -e'"));
     op.addOption(bw::Option("force",               'f', bw::OT_FLAG,
                             "Immediately reboot without shutdown(8)"));
+    op.addOption(bw::Option("mirror-list",         'm', bw::OT_STRING,
+                            "Read additional servers from that file (one per line)"));
+    op.addOption(bw::Option("wait-network",        'A', bw::OT_INTEGER,
+                            "Wait up to that many seconds for the link, address and server"));
+    op.addOption(bw::Option("dhcp-inform",         'I', bw::OT_FLAG,
+                            "Ask the DHCP server for the boot server instead of reading the lease"));
     op.addOption(bw::Option("ftp",                 'F', bw::OT_FLAG,
                             "Use FTP instead of TFTP"));
+    op.addOption(bw::Option("tftp-blksize",        'B', bw::OT_INTEGER,
+                            "Request that TFTP block size (default: 1468)"));
+    op.addOption(bw::Option("tftp-windowsize",     'W', bw::OT_INTEGER,
+                            "Request that TFTP window size (default: 16)"));
+    op.addOption(bw::Option("http-segments",       'G', bw::OT_INTEGER,
+                            "Download large HTTP files in that many parts (default: 4)"));
+    op.addOption(bw::Option("multipath",           'M', bw::OT_STRING,
+                            "Download HTTP files over these interfaces (comma-separated)"));
+    op.addOption(bw::Option("curl-tftp",           'c', bw::OT_FLAG,
+                            "Use libcurl instead of the built-in TFTP client"));
+    op.addOption(bw::Option("no-cache",            'N', bw::OT_FLAG,
+                            "Don't use the local cache of kernels and initrds"));
+    op.addOption(bw::Option("cache-dir",           'C', bw::OT_STRING,
+                            "Use that cache directory (default: " DEFAULT_CACHE_DIR ")"));
+    op.addOption(bw::Option("cache-size",          'S', bw::OT_INTEGER,
+                            "Limit the cache to that number of MiB (default: 512)"));
+    op.addOption(bw::Option("no-prefetch",         'P', bw::OT_FLAG,
+                            "Don't download the default entry while waiting for input"));
     op.addOption(bw::Option("dry-run",             'Y', bw::OT_FLAG,
                             "Don't run the final kexec -e"));
+    op.addOption(bw::Option("stats",               's', bw::OT_FLAG,
+                            "Print the timing of each download"));
+    op.addOption(bw::Option("trace",               'T', bw::OT_STRING,
+                            "Write the timing of all phases to that file (Chrome trace format)"));
     op.addOption(bw::Option("debug",               'D', bw::OT_FLAG,
                             "Enable debugging output"));
     op.addOption(bw::Option("ignore-whitelist",    'w', bw::OT_FLAG,
@@ -191,6 +420,10 @@ bool PxeKexec::parseCmdLine(int argc, char *argv[])
                             "kexec in their reboot scripts"));
     op.addOption(bw::Option("print-distribution",  'p', bw::OT_FLAG,
                             "Only print the detected Linux distribution and exit"));
+    op.addOption(bw::Option("server-stats",        'H', bw::OT_FLAG,
+                            "Only print the history of the boot servers and exit"));
+    op.addOption(bw::Option("report-downtime",     'R', bw::OT_FLAG,
+                            "Only print the downtime of the reboot into this system and exit"));
 
     // do the parsing
     bool ret = op.parse(argc, argv);
@@ -209,6 +442,18 @@ bool PxeKexec::parseCmdLine(int argc, char *argv[])
 
     if (op.getValue("print-distribution").getFlag())
         m_detectDistOnly = true;
+    if (op.getValue("server-stats").getFlag())
+        m_serverStatsOnly = true;
+    if (op.getValue("report-downtime").getFlag())
+        m_reportDowntime = true;
+    if (op.getValue("stats").getFlag())
+        m_stats = true;
+    if (op.getValue("trace").getType() != bw::OT_INVALID) {
+        std::string filename = op.getValue("trace").getString();
+        if (!Tracer::tracer()->open(filename))
+            throw ApplicationError("Cannot create trace file " + filename + ": " +
+                                   std::strerror(errno));
+    }
     if (op.getValue("debug").getFlag())
         bw::Debug::debug()->setLevel(bw::Debug::DL_TRACE);
     if (op.getValue("noconfirm").getFlag())
@@ -227,8 +472,57 @@ bool PxeKexec::parseCmdLine(int argc, char *argv[])
     }
     if (op.getValue("interface").getType() != bw::OT_INVALID)
         m_networkInterface = op.getValue("interface").getString();
+    if (op.getValue("wait-network").getType() != bw::OT_INVALID) {
+        m_waitNetwork = op.getValue("wait-network").getInteger();
+        if (m_waitNetwork < 0)
+            throw ApplicationError("The time to wait for the network must not be negative.");
+    }
+    if (op.getValue("dhcp-inform").getFlag())
+        m_dhcpInform = true;
     if (op.getValue("ftp").getType() != bw::OT_INVALID)
         m_protocol = "ftp";
+    if (op.getValue("tftp-blksize").getType() != bw::OT_INVALID) {
+        int blocksize = op.getValue("tftp-blksize").getInteger();
+        if (blocksize < 8 || blocksize > 65464)
+            throw ApplicationError("The TFTP block size must be between 8 and 65464.");
+        m_transferContext.setTftpBlockSize(blocksize);
+    }
+    if (op.getValue("tftp-windowsize").getType() != bw::OT_INVALID) {
+        int windowsize = op.getValue("tftp-windowsize").getInteger();
+        if (windowsize < 1 || windowsize > 65535)
+            throw ApplicationError("The TFTP window size must be between 1 and 65535.");
+        m_transferContext.setTftpWindowSize(windowsize);
+    }
+    if (op.getValue("http-segments").getType() != bw::OT_INVALID) {
+        int segments = op.getValue("http-segments").getInteger();
+        if (segments < 1 || segments > 64)
+            throw ApplicationError("The number of HTTP segments must be between 1 and 64.");
+        m_transferContext.setHttpSegments(segments);
+    }
+    if (op.getValue("multipath").getType() != bw::OT_INVALID) {
+        StringVector parts = bw::stringsplit(op.getValue("multipath").getString(), ",");
+        StringVector interfaces;
+        for (StringVector::const_iterator it = parts.begin(); it != parts.end(); ++it)
+            if (!bw::strip(*it).empty())
+                interfaces.push_back(bw::strip(*it));
+        if (interfaces.empty())
+            throw ApplicationError("No interfaces specified for --multipath.");
+        m_transferContext.setInterfaces(interfaces);
+    }
+    if (op.getValue("curl-tftp").getFlag())
+        m_transferContext.setNativeTftp(false);
+    if (op.getValue("no-prefetch").getFlag())
+        m_noPrefetch = true;
+    if (op.getValue("no-cache").getFlag())
+        m_noCache = true;
+    if (op.getValue("cache-dir").getType() != bw::OT_INVALID)
+        m_cacheDir = op.getValue("cache-dir").getString();
+    if (op.getValue("cache-size").getType() != bw::OT_INVALID) {
+        int size = op.getValue("cache-size").getInteger();
+        if (size < 0)
+            throw ApplicationError("The cache size must not be negative.");
+        m_cacheSize = size * 1024ULL * 1024ULL;
+    }
     if (op.getValue("dry-run").getType() != bw::OT_INVALID) {
         Process::enableDryRunMode();
         m_dryRun = true;
@@ -236,11 +530,10 @@ bool PxeKexec::parseCmdLine(int argc, char *argv[])
     if (op.getValue("quiet").getType() != bw::OT_INVALID)
         m_quiet = true;
 
-    std::vector<std::string> args = op.getArgs();
-    if (args.size() > 1)
-        throw ApplicationError("Too many arguments.");
-    if (args.size() == 1)
-        m_pxeHost = args[0];
+    // each argument is a server, the servers of the list come afterwards
+    m_mirrors = op.getArgs();
+    if (op.getValue("mirror-list").getType() != bw::OT_INVALID)
+        readMirrorList(op.getValue("mirror-list").getString());
 
     BW_DEBUG_DBG("load_only=%d, force=%d, nodelete=%d",
                  int(m_loadOnly), int(m_force), int(m_nodelete));
@@ -248,24 +541,100 @@ bool PxeKexec::parseCmdLine(int argc, char *argv[])
     return true;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::readMirrorList(const std::string &filename)
+    throw (ApplicationError)
+{
+    std::ifstream fin(filename.c_str());
+    if (!fin)
+        throw ApplicationError("Cannot open mirror list " + filename + ".");
+
+    std::string line;
+    while (std::getline(fin, line)) {
+        line = bw::strip(line.substr(0, line.find('#')));
+        if (!line.empty())
+            m_mirrors.push_back(line);
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::raceMirrors()
+{
+    std::stringstream discard;
+    int fastest = -1;
+
+    // only the response time matters, so just ask for the default configuration
+    try {
+        MultiDownloader mdl;
+        for (size_t i = 0; i < m_mirrors.size(); i++) {
+            Downloader *dl = new Downloader(discard, CONNECTION_TIMEOUT);
+            mdl.addDownloader(dl);
+            dl->setTransferContext(&m_transferContext);
+            dl->setUrl(m_protocol + "://" + m_mirrors[i] + "/pxelinux.cfg/default");
+            dl->setNoBody(true);
+        }
+
+        TraceSpan span("race servers");
+        fastest = mdl.downloadFastest(MIRROR_RACE_DELAY);
+
+        // losing the race is no failure, the head start of a server that
+        // hasn't answered yet only tells that it's slower. Servers that are
+        // still connecting have measured nothing.
+        for (size_t i = 0; i < mdl.getSize(); i++) {
+            if (mdl.hasConnectionFailed(i))
+                m_serverHistory.recordFailure(m_mirrors[i]);
+            else
+                m_serverHistory.recordLatency(m_mirrors[i], mdl.getDownloader(i)->getStatistics());
+        }
+    } catch (const DownloadError &err) {
+        BW_DEBUG_INFO("Racing the servers failed: %s", err.what());
+    }
+
+    if (fastest < 0) {
+        BW_DEBUG_DBG("No server answered, keeping the order");
+        return;
+    }
+
+    BW_DEBUG_DBG("Server %s answered first", m_mirrors[fastest].c_str());
+
+    std::rotate(m_mirrors.begin(), m_mirrors.begin() + fastest, m_mirrors.begin() + fastest + 1);
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 void PxeKexec::readPxeConfig()
     throw (ApplicationError)
 {
+    TraceSpan span("read PXE configuration");
     NetworkHelper nh;
     NetworkInterface netif;
 
+    if (m_waitNetwork > 0) {
+        std::string server = m_mirrors.empty() ? std::string() : m_mirrors[0];
+        // DHCPINFORM asks the server itself, the lease file doesn't matter then
+        if (!nh.waitForNetwork(m_networkInterface, server, m_waitNetwork, !m_dhcpInform))
+            std::cerr << "The network is not ready after " << m_waitNetwork
+                      << " seconds, trying anyway." << std::endl;
+    }
+
+    // the server that answers first gets everything, the others are spares;
+    // servers that have been slow or unreliable before start late. That's
+    // also the server whose route tells the interface.
+    if (m_mirrors.size() > 1) {
+        TraceSpan span("rank servers");
+
+        m_mirrors = m_serverHistory.rank(m_mirrors);
+        raceMirrors();
+    }
+
     if (m_networkInterface.size() > 0) {
         netif = nh.getInterface(m_networkInterface);
         if (!netif.isValid())
             throw ApplicationError("Specified network interface does not exist.");
     } else {
-        std::vector<NetworkInterface> ifs = nh.getInterfaces();
-        if (ifs.size() < 1)
+        // without a server, the DHCP server of the best interface is used
+        netif = nh.getInterfaceToHost(m_mirrors.empty() ? std::string() : m_mirrors[0]);
+        if (!netif.isValid())
             throw ApplicationError("No network interfaces found");
-
-        // use the first interface that is up
-        netif = ifs[0];
     }
     BW_DEBUG_TRACE("Using interface '%s'", netif.getName().c_str());
 
@@ -274,70 +643,318 @@ void PxeKexec::readPxeConfig()
     std::string pxe_ip = netif.getIp(NetworkInterface::IF_HEX);
 
     // get PXE host
-    if (m_pxeHost.size() == 0)
-        m_pxeHost = netif.getDHCPServerIP();
-    if (m_pxeHost.size() == 0)
+    if (m_mirrors.empty() && m_dhcpInform)
+        queryDhcpServer(netif);
+    if (m_mirrors.empty() && netif.getDHCPServerIP().size() > 0)
+        m_mirrors.push_back(netif.getDHCPServerIP());
+    if (m_mirrors.empty())
         throw ApplicationError("No TFTP server specified and also no "
                 "DHCP server in the DHCP info file\n(/var/lib/dhcpcd/dhcpcd-<if>.info).");
 
-    char names[10][25];
+    // the configuration file from the DHCP server replaces the search
+    StringVector paths;
+    if (!m_configFile.empty()) {
+        paths.push_back(m_configFile);
+    } else {
+        paths.push_back("pxelinux.cfg/" + pxe_mac);
+        for (int i = 0; i < 8; i++)
+            paths.push_back("pxelinux.cfg/" + pxe_ip.substr(0, 8-i));
+        paths.push_back("pxelinux.cfg/default");
+    }
 
-    strcpy(names[0], pxe_mac.c_str());
-    for (int i = 1; i < 9; i++)
-        strcpy(names[i], pxe_ip.substr(0, 8-(i-1)).c_str());
-    strcpy(names[9], "default");
+    // all candidates are fetched at once, the first name in that list that
+    // exists wins like if we tried them one after another; each candidate is
+    // parsed while it arrives
+    int found = -1;
+    for (size_t mirror = 0; mirror < m_mirrors.size() && found < 0; mirror++) {
+        m_pxeHost = m_mirrors[mirror];
 
-    std::stringstream ss;
-    SimpleNotifier notifier;
-    for (int i = 0; i < 10; i++) {
-        std::string url = m_protocol + "://" + m_pxeHost + "/pxelinux.cfg/" + names[i];
+        TraceSpan span("fetch configuration", m_pxeHost);
+        SimpleNotifier notifier;
+        try {
+            std::vector<std::tr1::shared_ptr<ConfigSink> > sinks;
+            MultiDownloader mdl;
+            for (size_t i = 0; i < paths.size(); i++) {
+                std::string url = getImageUrl(paths[i], m_pxeHost);
+
+                BW_DEBUG_TRACE("Trying to retrieve %s", url.c_str());
+                sinks.push_back(std::tr1::shared_ptr<ConfigSink>(new ConfigSink()));
+                Downloader *dl = new Downloader(*sinks.back(), CONNECTION_TIMEOUT);
+                mdl.addDownloader(dl);
+                dl->setTransferContext(&m_transferContext);
+                dl->setUrl(url);
+            }
 
-        BW_DEBUG_TRACE("Trying to retrieve %s", url.c_str());
-        if (!m_quiet)
-            std::cout << "Trying " << "pxelinux.cfg/" << names[i] << " ";
+            if (!m_quiet) {
+                if (paths.size() > 1)
+                    std::cout << "Trying " << paths.size() << " names in pxelinux.cfg/ ";
+                else
+                    std::cout << "Trying " << paths[0] << " ";
+                mdl.setProgress(&notifier);
+            }
+            found = mdl.downloadFirst();
+            if (found >= 0) {
+                Downloader::Statistics statistics = mdl.getDownloader(found)->getStatistics();
 
-        try {
-            Downloader dl(ss, CONNECTION_TIMEOUT);
-            dl.setUrl(url);
-            if (!m_quiet)
-                dl.setProgress(&notifier);
-            dl.download();
-            break;
+                m_serverHistory.recordSuccess(m_pxeHost, statistics);
+                if (m_stats)
+                    printTransferStatistics(TransferStatisticsVector(1,
+                        std::make_pair(mdl.getDownloader(found)->getUrl(), statistics)));
+
+                if (sinks[found]->getSize() == 0)
+                    throw ApplicationError("No PXE configuration found.");
+
+                PxeParser &parser = sinks[found]->getParser();
+                PxeFileMap files;
+                PxeTextMap texts;
+
+                sinks[found]->finish();
+                readIncludes(parser.getFile(), files, texts);
+
+                TraceSpan parseSpan("parse configuration");
+                parser.buildConfig(files, texts);
+                m_pxeConfig.swap(parser.getConfig());
+            }
+        } catch (const ParseError &pe) {
+            throw ApplicationError(std::string("Parsing PXE config file failed: ") + pe.what());
         } catch (const DownloadError &err) {
             BW_DEBUG_TRACE("DownloadError: %s", err.what());
 
-            if (err.getErrorcode() == DownloadError::DEC_CONNECTION_FAILED) {
-                std::cerr << "Connection to " << m_pxeHost << " with protocol " << m_protocol
-                          << " failed. Aborting." << std::endl;
-                if (m_protocol == "tftp") {
-                    std::cerr << std::endl;
-                    std::cerr << "HINT: This failure could be because of Firewall settings. "
-                                 "Check your Firewall " << std::endl;
-                    std::cerr << "configuration. If your FTP server has the same directory layout "
-                              << "as your TFTP" << std::endl;
-                    std::cerr << "server, you may also consider the '-F' option." << std::endl;
-                    std::cerr << std::endl;
-                }
+            if (err.getErrorcode() != DownloadError::DEC_CONNECTION_FAILED)
                 break;
+
+            m_serverHistory.recordFailure(m_pxeHost);
+
+            if (mirror + 1 < m_mirrors.size()) {
+                if (!m_quiet)
+                    std::cout << "Connection to " << m_pxeHost << " failed, trying "
+                              << m_mirrors[mirror + 1] << "." << std::endl;
+                continue;
+            }
+
+            std::cerr << "Connection to " << m_pxeHost << " with protocol " << m_protocol
+                      << " failed. Aborting." << std::endl;
+            if (m_protocol == "tftp") {
+                std::cerr << std::endl;
+                std::cerr << "HINT: This failure could be because of Firewall settings. "
+                             "Check your Firewall " << std::endl;
+                std::cerr << "configuration. If your FTP server has the same directory layout "
+                          << "as your TFTP" << std::endl;
+                std::cerr << "server, you may also consider the '-F' option." << std::endl;
+                std::cerr << std::endl;
             }
         }
     }
 
-    if (ss.str().size() == 0)
+    if (found < 0)
         throw ApplicationError("No PXE configuration found.");
 
-    PxeParser parser;
+    // the images are downloaded from the same server
+    StringVector::iterator host = std::find(m_mirrors.begin(), m_mirrors.end(), m_pxeHost);
+    std::rotate(m_mirrors.begin(), host, host + 1);
+
+    BW_DEBUG_TRACE("Using %s", paths[found].c_str());
+    if (!m_quiet)
+        std::cout << "Using " << paths[found] << std::endl;
+
+    m_labelTrie.build(menu_labels(m_pxeConfig, false));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+PxeConfig *PxeKexec::openMenu(const PxeEntry &entry)
+{
+    if (entry.getSubmenu())
+        return entry.getSubmenu();
+
+    std::map<std::string, PxeConfig>::iterator it = m_chainedConfigs.find(entry.getConfig());
+    if (it != m_chainedConfigs.end())
+        return &it->second;
+
+    TraceSpan span("fetch chained configuration", entry.getConfig());
     try {
-        parser.parseStream(ss);
-        m_pxeConfig = parser.getConfig();
-    } catch (const ParseError &pe) {
-        throw ApplicationError(std::string("Parsing PXE config file failed: ") + pe.what());
+        ConfigSink sink;
+        Downloader dl(sink, CONNECTION_TIMEOUT);
+        dl.setTransferContext(&m_transferContext);
+        dl.setUrl(getImageUrl(entry.getConfig(), m_pxeHost));
+        dl.download();
+
+        PxeParser &parser = sink.getParser();
+        PxeFileMap files;
+        PxeTextMap texts;
+
+        sink.finish();
+        readIncludes(parser.getFile(), files, texts);
+        parser.buildConfig(files, texts);
+
+        PxeConfig &config = m_chainedConfigs[entry.getConfig()];
+        config.swap(parser.getConfig());
+        return &config;
+    } catch (const DownloadError &err) {
+        std::cerr << "Cannot download " << entry.getConfig() << ": " << err.what() << std::endl;
+    } catch (const ParseError &err) {
+        std::cerr << "Cannot parse " << entry.getConfig() << ": " << err.what() << std::endl;
+    }
+
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+PxeEntry PxeKexec::findEntry(const std::string &path, MenuPath &menus)
+{
+    // labels may contain slashes, too
+    PxeEntry entry = menus.back()->getEntry(path);
+    std::string::size_type slash = path.find('/');
+    std::string name = path.substr(0, slash);
+
+    if (!entry.isValid() && slash != std::string::npos)
+        entry = menus.back()->getEntry(name);
+    else
+        slash = std::string::npos;
+
+    if (name == ".." && !entry.isValid() && menus.size() > 1)
+        menus.pop_back();
+    else if (entry.isMenu()) {
+        PxeConfig *menu = openMenu(entry);
+        if (!menu)
+            return PxeEntry();
+        menus.push_back(menu);
+        entry = PxeEntry();
+    } else if (slash != std::string::npos)
+        return PxeEntry();
+
+    if (slash != std::string::npos && slash + 1 < path.size())
+        return findEntry(path.substr(slash + 1), menus);
+
+    return entry;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::showMenu(const MenuPath &menus)
+{
+    if (!m_quiet && !menus.back()->getMessage().empty())
+        std::cout << menus.back()->getMessage() << std::endl << std::endl;
+
+    m_labelTrie.build(menu_labels(*menus.back(), menus.size() > 1));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+std::string PxeKexec::getAutoBootLabel() const
+{
+    // both may be followed by options, we only need the label
+    std::string label = m_pxeConfig.getOnTimeout();
+    if (label.empty())
+        label = m_pxeConfig.getDefault();
+
+    return label.substr(0, label.find_first_of(" \t"));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool PxeKexec::countdown(const std::string &label, long timeout)
+{
+    long long start = bw::monotonicMs();
+    int ret = 0;
+
+    for (long remaining = timeout; remaining > 0;
+            remaining = timeout - long(bw::monotonicMs() - start)) {
+        std::cout << "\rBooting " << label << " in " << (remaining + 999) / 1000
+                  << " s, press any key to stop ";
+        std::cout.flush();
+
+        ret = wait_for_input(std::min(remaining, 1000L - remaining % 1000));
+        if (ret != 0)
+            break;
+    }
+
+    // the prompt starts at the beginning of the line again
+    std::cout << "\r\e[K";
+    std::cout.flush();
+
+    return ret <= 0;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::readIncludes(const PxeFile &file, PxeFileMap &files, PxeTextMap &texts)
+    throw (DownloadError, ParseError)
+{
+    typedef std::tr1::shared_ptr<ConfigSink> ConfigSinkPtr;
+    typedef std::tr1::shared_ptr<std::stringstream> StreamPtr;
+
+    std::set<std::string> requestedFiles, requestedTexts;
+    StringVector includes = file.getIncludes();
+    StringVector displays = file.getDisplays();
+
+    while (!includes.empty() || !displays.empty()) {
+        TraceSpan span("fetch includes");
+        std::vector<ConfigSinkPtr> sinks;
+        std::vector<StreamPtr> streams;
+        StringVector fileNames, textNames;
+        MultiDownloader mdl;
+
+        // a file that has been requested before doesn't need a download,
+        // even if it didn't exist
+        for (StringVector::const_iterator it = includes.begin(); it != includes.end(); ++it) {
+            if (!requestedFiles.insert(*it).second)
+                continue;
+
+            sinks.push_back(ConfigSinkPtr(new ConfigSink()));
+            Downloader *dl = new Downloader(*sinks.back(), CONNECTION_TIMEOUT);
+            mdl.addDownloader(dl);
+            dl->setTransferContext(&m_transferContext);
+            dl->setUrl(getImageUrl(*it, m_pxeHost));
+            fileNames.push_back(*it);
+        }
+        for (StringVector::const_iterator it = displays.begin(); it != displays.end(); ++it) {
+            if (!requestedTexts.insert(*it).second)
+                continue;
+
+            streams.push_back(StreamPtr(new std::stringstream()));
+            Downloader *dl = new Downloader(*streams.back(), CONNECTION_TIMEOUT);
+            mdl.addDownloader(dl);
+            dl->setTransferContext(&m_transferContext);
+            dl->setUrl(getImageUrl(*it, m_pxeHost));
+            textNames.push_back(*it);
+        }
+
+        if (mdl.getSize() == 0)
+            break;
+
+        BW_DEBUG_TRACE("Downloading %lu included files", (unsigned long)mdl.getSize());
+        mdl.downloadEach();
+
+        // the next level
+        includes.clear();
+        displays.clear();
+
+        for (size_t i = 0; i < fileNames.size(); i++) {
+            if (!mdl.isSuccessful(i)) {
+                BW_DEBUG_INFO("Cannot download include file %s", fileNames[i].c_str());
+                continue;
+            }
+
+            PxeFile &include = files[fileNames[i]];
+            sinks[i]->finish();
+            include.swap(sinks[i]->getParser().getFile());
+
+            StringVector more = include.getIncludes();
+            includes.insert(includes.end(), more.begin(), more.end());
+            more = include.getDisplays();
+            displays.insert(displays.end(), more.begin(), more.end());
+        }
+
+        for (size_t i = 0; i < textNames.size(); i++) {
+            if (mdl.isSuccessful(fileNames.size() + i))
+                texts[textNames[i]] = streams[i]->str();
+            else
+                BW_DEBUG_INFO("Cannot download display file %s", textNames[i].c_str());
+        }
     }
 }
 
 /* ---------------------------------------------------------------------------------------------- */
 bool PxeKexec::checkEnv()
 {
+    TraceSpan span("check environment");
+
     if (!Process::isInPath("kexec")) {
         std::cerr << "Error: kexec-tools are not installed." << std::endl;
         return false;
@@ -351,6 +968,7 @@ bool PxeKexec::checkEnv()
     // check distribution
     //
     if (!m_ignoreWhitelist) {
+        TraceSpan span("detect distribution");
 
         LinuxDistDetector *detector_ptr = LinuxDistDetector::getDetector();
         if (!detector_ptr) {
@@ -402,23 +1020,71 @@ void PxeKexec::displayMessage()
 /* ---------------------------------------------------------------------------------------------- */
 bool PxeKexec::chooseEntry()
 {
+    TraceSpan span("choose entry");
+    MenuPath menus(1, &m_pxeConfig);
     std::string choice;
-
-    if (m_preChoice.size() != 0)
-        m_choice = m_pxeConfig.getEntry(m_preChoice);
+    std::string autoBoot = getAutoBootLabel();
+    long totalTimeout = m_pxeConfig.getTotalTimeout() * 100L;
+    long long start = bw::monotonicMs();
+
+    if (m_preChoice.size() != 0) {
+        m_choice = findEntry(m_preChoice, menus);
+        if (menus.size() > 1)
+            showMenu(menus);
+    } else if (m_pxeConfig.getTimeout() > 0 && !autoBoot.empty()) {
+        TraceSpan span("countdown");
+
+        if (countdown(autoBoot, m_pxeConfig.getTimeout() * 100L))
+            m_autoBoot = true;
+    }
 
     m_lineReader->setCompletor(this);
+    m_lineReader->setIncrementalFilter(true);
     while (!m_lineReader->eof() && !m_choice.isValid()) {
+        // like in pxelinux, typing doesn't cancel TOTALTIMEOUT
+        long remaining = 0;
+        if (!m_autoBoot && totalTimeout > 0 && !autoBoot.empty() && m_preChoice.empty()) {
+            remaining = totalTimeout - long(bw::monotonicMs() - start);
+            if (remaining <= 0)
+                m_autoBoot = true;
+        }
+
+        if (m_autoBoot) {
+            MenuPath root(1, &m_pxeConfig);
+            m_choice = findEntry(autoBoot, root);
+            if (m_choice.isValid()) {
+                std::cout << "Booting " << autoBoot << std::endl;
+                break;
+            }
+
+            std::cout << "Entry " << autoBoot << " does not exist." << std::endl;
+            m_autoBoot = false;
+            totalTimeout = remaining = 0;
+        }
+
+        m_lineReader->setTimeout(std::max(remaining, 0L));
         choice = bw::strip(m_lineReader->readLine());
+        m_lineReader->setTimeout(0);
+        if (m_lineReader->timedOut()) {
+            m_autoBoot = true;
+            continue;
+        }
         if (choice.size() == 0 || choice == "quit" || choice == "exit") {
+            m_lineReader->setIncrementalFilter(false);
             m_lineReader->setCompletor(NULL);
             return false;
         }
-        m_choice = m_pxeConfig.getEntry(choice);
-        if (!m_choice.isValid())
+
+        MenuPath path = menus;
+        m_choice = findEntry(choice, path);
+        if (!m_choice.isValid() && path != menus) {
+            menus = path;
+            showMenu(menus);
+        } else if (!m_choice.isValid())
             std::cout << "Entry " << choice << " does not exist." << std::endl;
     }
 
+    m_lineReader->setIncrementalFilter(false);
     m_lineReader->setCompletor(NULL);
     return m_choice.isValid();
 }
@@ -429,25 +1095,30 @@ StringVector PxeKexec::complete(const std::string   &text,
                                 size_t              start_idx,
                                 ssize_t             end_idx)
 {
-    StringVector names = m_pxeConfig.getEntryNames();
-    StringVector result;
-
     (void)full_text;
     (void)start_idx;
     (void)end_idx;
 
-    for (StringVector::const_iterator it = names.begin(); it != names.end(); ++it) {
-        std::string name = *it;
-        if (strncasecmp(name.c_str(), text.c_str(), text.size()) == 0)
-            result.push_back(name);
-    }
+    return m_labelTrie.complete(text);
+}
 
-    return result;
+/* ---------------------------------------------------------------------------------------------- */
+size_t PxeKexec::filter(const std::string           &text,
+                        std::vector<std::string>    &matches,
+                        size_t                      max)
+{
+    return m_labelTrie.filter(bw::strip(text), matches, max);
 }
 
 /* ---------------------------------------------------------------------------------------------- */
 bool PxeKexec::confirmBoot()
 {
+    TraceSpan span("confirm boot");
+
+    // nobody has chosen the entry, so there's nobody to ask
+    if (m_autoBoot)
+        return true;
+
 begin:
     if (!(m_noconfirm && m_quiet)) {
         std::cout << "Booting following entry:" << std::endl;
@@ -491,76 +1162,589 @@ again:
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-void PxeKexec::downloadStuff()
+int PxeKexec::createImage(const std::string &name, std::string &filename)
     throw (ApplicationError)
 {
+    int fd;
+
+    filename.clear();
+
+#if HAVE_MEMFD_CREATE
+    if (!m_nodelete) {
+        fd = memfd_create(("pxe-kexec-" + name).c_str(), MFD_CLOEXEC);
+        if (fd >= 0)
+            return fd;
+        BW_DEBUG_INFO("memfd_create() failed: %s", std::strerror(errno));
+    }
+#endif
+
     std::string tmpdir = std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp";
-    tmpdir += "/";
+    filename = tmpdir + "/pxe-kexec-" + name;
+
+    while ((fd = open(filename.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+        if (errno != EEXIST)
+            throw ApplicationError("Cannot create " + filename + ": " + std::strerror(errno));
+        filename += "_";
+    }
 
-    std::string kernel = tmpdir + "pxe-kexec-kernel";
-    std::string initrd = tmpdir + "pxe-kexec-initrd";
+    return fd;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+std::string PxeKexec::getImageUrl(const std::string &path, const std::string &host) const
+{
+    // If the configuration file contains a url preserve it
+    if (path.find("://") != std::string::npos)
+        return path;
+
+    if (m_pathPrefix.empty())
+        return m_protocol + "://" + host + "/" + path;
+    if (bw::startsWith(path, "/"))
+        return m_protocol + "://" + host + path;
+
+    // the prefix may be a URL, too
+    std::string prefixed = m_pathPrefix + path;
+    if (prefixed.find("://") != std::string::npos)
+        return prefixed;
+
+    return m_protocol + "://" + host + "/" + prefixed;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::queryDhcpServer(const NetworkInterface &netif)
+    throw (ApplicationError)
+{
+    DhcpInform inform(netif);
+    DhcpInform::Reply reply;
+
+    if (!inform.query(reply, DHCP_TIMEOUT)) {
+        std::cerr << "No answer to DHCPINFORM on " << netif.getName() << "." << std::endl;
+        return;
+    }
+
+    if (!reply.tftpServer.empty())
+        m_mirrors.push_back(reply.tftpServer);
+    else if (!reply.nextServer.empty())
+        m_mirrors.push_back(reply.nextServer);
+    else if (!reply.serverIdentifier.empty())
+        m_mirrors.push_back(reply.serverIdentifier);
+
+    // like pxelinux, the boot file's directory is the default prefix
+    std::string prefix = reply.pathPrefix;
+    if (prefix.empty() && reply.bootFile.find('/') != std::string::npos)
+        prefix = reply.bootFile.substr(0, reply.bootFile.rfind('/') + 1);
+
+    // relative to the TFTP root; like for pxelinux, the prefix is prepended
+    // literally, so it usually ends with a slash
+    if (prefix.find("://") == std::string::npos)
+        while (bw::startsWith(prefix, "/"))
+            prefix.erase(0, 1);
+
+    m_pathPrefix = prefix;
+    m_configFile = reply.configFile;
+
+    BW_DEBUG_DBG("DHCP: server '%s', path prefix '%s', configuration file '%s'",
+                 m_mirrors.empty() ? "" : m_mirrors.back().c_str(), m_pathPrefix.c_str(),
+                 m_configFile.c_str());
+}
 
-    struct stat statbuf;
-    while (stat(kernel.c_str(), &statbuf) >= 0)
-        kernel += "_";
+/* ---------------------------------------------------------------------------------------------- */
+static void append_image(int dest, int src)
+    throw (ApplicationError)
+{
+    char buffer[BUFSIZ];
+
+    // like pxelinux, align each initrd at 4 bytes
+    off_t size = lseek(dest, 0, SEEK_END);
+    if (size < 0)
+        throw ApplicationError(std::string("lseek() failed: ") + std::strerror(errno));
+    memset(buffer, 0, 4);
+    if (size % 4 != 0 && write(dest, buffer, 4 - size % 4) != 4 - size % 4)
+        throw ApplicationError(std::string("write() failed: ") + std::strerror(errno));
+
+    if (lseek(src, 0, SEEK_SET) < 0)
+        throw ApplicationError(std::string("lseek() failed: ") + std::strerror(errno));
+
+    ssize_t len;
+    while ((len = read(src, buffer, sizeof(buffer))) != 0) {
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            throw ApplicationError(std::string("read() failed: ") + std::strerror(errno));
+
+        for (ssize_t written = 0; written < len; ) {
+            ssize_t ret = write(dest, buffer + written, len - written);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0)
+                throw ApplicationError(std::string("write() failed: ") + std::strerror(errno));
+            written += ret;
+        }
+    }
+}
 
-    while (stat(initrd.c_str(), &statbuf) >= 0)
-        initrd += "_";
+/* ---------------------------------------------------------------------------------------------- */
+std::vector<bool> PxeKexec::restoreImages(ImageCache &cache, const StringVector &urls,
+                                          const std::vector<int> &fds, bool quiet)
+{
+    std::vector<bool> cached(urls.size(), false);
+    std::stringstream discard;
 
-    SimpleNotifier notifier;
-    std::string url;
     try {
-        std::cout << "Downloading kernel ";
-        std::ofstream os(kernel.c_str(), std::ios::binary);
-        Downloader dl(os);
-        url = m_choice.getKernel();
-        // If the configuration file contains a url preserve it
-        if (url.find( "://") == std::string::npos)
-            url = m_protocol + "://" + m_pxeHost + "/" + url;
-        dl.setUrl(url);
-        dl.setProgress(&notifier);
-        dl.download();
-        os.close();
-        m_downloadedKernel = kernel;
+        MultiDownloader mdl;
+        for (size_t i = 0; i < urls.size(); i++) {
+            Downloader *dl = new Downloader(discard, CONNECTION_TIMEOUT);
+            mdl.addDownloader(dl);
+            dl->setTransferContext(&m_transferContext);
+            dl->setUrl(urls[i]);
+            dl->setNoBody(true);
+        }
+
+        mdl.downloadEach();
+
+        for (size_t i = 0; i < urls.size(); i++) {
+            if (!mdl.isSuccessful(i))
+                continue;
+
+            cached[i] = cache.restore(urls[i], mdl.getDownloader(i)->getValidator(), fds[i]);
+            if (cached[i] && !quiet)
+                std::cout << "Using cached " << urls[i] << std::endl;
+        }
     } catch (const DownloadError &err) {
-        throw ApplicationError("Downloading kernel "+ url +" failed: " + std::string(err.what()));
+        BW_DEBUG_INFO("Revalidating the cached images failed: %s", err.what());
     }
 
-    if (m_choice.getInitrd().size() > 0) {
-        try {
-            std::cout << "Downloading initrd ";
-            std::ofstream os(initrd.c_str(), std::ios::binary);
-            Downloader dl(os);
-            url = m_choice.getInitrd();
-            // If the configuration file contains a url preserve it
-            if (url.find( "://") == std::string::npos)
-                url = m_protocol + "://" + m_pxeHost + "/" + url;
-            dl.setUrl(url);
-            dl.setProgress(&notifier);
-            dl.download();
-            os.close();
-            m_downloadedInitrd = initrd;
-        } catch (const DownloadError &err) {
-            throw ApplicationError("Downloading initrd "+url + " failed: " + std::string(err.what()));
+    return cached;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static Downloader::Statistics combine_statistics(const MultiDownloader &mdl)
+{
+    Downloader::Statistics combined = mdl.getDownloader(0)->getStatistics();
+
+    // the downloads ran in parallel, so the throughput is that of all of them
+    for (size_t i = 1; i < mdl.getSize(); i++) {
+        Downloader::Statistics statistics = mdl.getDownloader(i)->getStatistics();
+
+        if (combined.nameLookupTime < 0 || (statistics.nameLookupTime >= 0 &&
+                statistics.nameLookupTime < combined.nameLookupTime))
+            combined.nameLookupTime = statistics.nameLookupTime;
+        if (combined.connectTime < 0 ||
+                (statistics.connectTime >= 0 && statistics.connectTime < combined.connectTime))
+            combined.connectTime = statistics.connectTime;
+        if (combined.firstByteTime < 0 ||
+                (statistics.firstByteTime >= 0 && statistics.firstByteTime < combined.firstByteTime))
+            combined.firstByteTime = statistics.firstByteTime;
+        combined.totalTime = std::max(combined.totalTime, statistics.totalTime);
+        combined.bytes += statistics.bytes;
+        combined.stalls += statistics.stalls;
+        combined.retransmits += statistics.retransmits;
+    }
+
+    // the peaks of the downloads were not at the same time
+    if (mdl.getSize() > 1) {
+        double seconds = combined.totalTime - std::max(combined.firstByteTime, 0.0);
+        combined.averageRate = seconds > 0 ? combined.bytes / seconds : -1.0;
+        combined.peakRate = -1.0;
+    }
+
+    return combined;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+StringVector PxeKexec::getImageUrls(PxeEntry entry, const std::string &host) const
+{
+    StringVector initrds = entry.getInitrds();
+    StringVector urls;
+
+    urls.push_back(getImageUrl(entry.getKernel(), host));
+    for (StringVector::const_iterator it = initrds.begin(); it != initrds.end(); ++it)
+        urls.push_back(getImageUrl(*it, host));
+
+    return urls;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::downloadImages(const PxeEntry &entry, bool quiet)
+    throw (ApplicationError)
+{
+    StringVector urls = getImageUrls(entry, m_mirrors[0]);
+    m_imageStatistics.clear();
+    StringVector initrds(urls.begin() + 1, urls.end());
+    std::vector<int> extraFds;
+    StringVector extraFiles;
+    std::vector<int> fds;
+
+    // more than one initrd: the additional ones are appended to the first
+    // one after all downloads have finished
+    try {
+        m_kernelFd = createImage("kernel", m_downloadedKernel);
+        fds.push_back(m_kernelFd);
+
+        for (size_t i = 0; i < initrds.size(); i++) {
+            int fd;
+            if (i == 0) {
+                m_initrdFd = fd = createImage("initrd", m_downloadedInitrd);
+            } else {
+                std::stringstream name;
+                name << "initrd-" << i + 1;
+                extraFiles.push_back(std::string());
+                fd = createImage(name.str(), extraFiles.back());
+                extraFds.push_back(fd);
+            }
+            fds.push_back(fd);
         }
+
+        std::auto_ptr<ImageCache> cache;
+        std::vector<bool> cached(urls.size(), false);
+        if (!m_noCache) {
+            cache.reset(new ImageCache(m_cacheDir, m_cacheSize));
+            if (cache->isValid()) {
+                TraceSpan span("revalidate cache");
+                cached = restoreImages(*cache, urls, fds, quiet);
+            }
+        }
+
+        std::vector<size_t> pending;
+        for (size_t i = 0; i < urls.size(); i++)
+            if (!cached[i])
+                pending.push_back(i);
+
+        // a server that fails or stalls is replaced by the next one
+        for (size_t mirror = 0; !pending.empty(); mirror++) {
+            MultiDownloader mdl;
+            for (size_t k = 0; k < pending.size(); k++) {
+                Downloader *dl = new Downloader(fds[pending[k]]);
+                mdl.addDownloader(dl);
+                dl->setTransferContext(&m_transferContext);
+                dl->setUrl(urls[pending[k]]);
+                if (m_mirrors.size() > 1)
+                    dl->setStallTimeout(STALL_TIMEOUT);
+            }
+
+            size_t pendingInitrds = pending.size() - (cached[0] ? 0 : 1);
+
+            SimpleNotifier notifier;
+            if (!quiet) {
+                std::cout << "Downloading";
+                if (!cached[0])
+                    std::cout << " kernel" << (pendingInitrds > 0 ? " and" : "");
+                if (pendingInitrds == 1)
+                    std::cout << " initrd";
+                else if (pendingInitrds > 1)
+                    std::cout << " " << pendingInitrds << " initrds";
+                std::cout << " ";
+                mdl.setProgress(&notifier);
+            }
+
+            try {
+                TraceSpan span("download images", m_mirrors[mirror]);
+                mdl.downloadAll();
+            } catch (const DownloadError &err) {
+                if (err.getErrorcode() != DownloadError::DEC_ABORTED)
+                    m_serverHistory.recordFailure(m_mirrors[mirror]);
+
+                StringVector next;
+                if (err.getErrorcode() != DownloadError::DEC_ABORTED &&
+                        mirror + 1 < m_mirrors.size())
+                    next = getImageUrls(entry, m_mirrors[mirror + 1]);
+
+                // absolute URLs in the configuration don't change
+                if (!next.empty() && next != urls) {
+                    if (!quiet)
+                        std::cout << "Downloading from " << m_mirrors[mirror] << " failed ("
+                                  << err.what() << "), trying " << m_mirrors[mirror + 1]
+                                  << "." << std::endl;
+
+                    for (size_t k = 0; k < pending.size(); k++)
+                        if (ftruncate(fds[pending[k]], 0) != 0 ||
+                                lseek(fds[pending[k]], 0, SEEK_SET) != 0)
+                            throw ApplicationError(std::string("Cannot truncate image: ") +
+                                                   std::strerror(errno));
+                    urls = next;
+                    continue;
+                }
+
+                int failed = mdl.getFailedIndex();
+                if (failed < 0)
+                    throw ApplicationError("Downloading failed: " + std::string(err.what()));
+
+                failed = pending[failed];
+                throw ApplicationError("Downloading " + std::string(failed == 0 ? "kernel " : "initrd ")
+                                       + urls[failed] + " failed: " + std::string(err.what()));
+            }
+
+            m_serverHistory.recordSuccess(m_mirrors[mirror], combine_statistics(mdl));
+            for (size_t k = 0; k < pending.size(); k++)
+                m_imageStatistics.push_back(std::make_pair(urls[pending[k]],
+                                            mdl.getDownloader(k)->getStatistics()));
+            if (!quiet)
+                printInterfaceStatistics();
+
+            if (cache.get() && cache->isValid()) {
+                TraceSpan span("store in cache");
+                for (size_t k = 0; k < pending.size(); k++)
+                    cache->store(urls[pending[k]], mdl.getDownloader(k)->getValidator(),
+                                 fds[pending[k]]);
+            }
+            break;
+        }
+
+        if (!extraFds.empty()) {
+            TraceSpan span("append initrds");
+            for (size_t i = 0; i < extraFds.size(); i++)
+                append_image(m_initrdFd, extraFds[i]);
+        }
+    } catch (...) {
+        for (size_t i = 0; i < extraFds.size(); i++) {
+            close(extraFds[i]);
+            if (!m_nodelete && !extraFiles[i].empty())
+                remove(extraFiles[i].c_str());
+        }
+        throw;
     }
+
+    for (size_t i = 0; i < extraFds.size(); i++) {
+        close(extraFds[i]);
+        if (!m_nodelete && !extraFiles[i].empty())
+            remove(extraFiles[i].c_str());
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::printInterfaceStatistics() const
+{
+    std::vector<TransferContext::InterfaceStatistics> stats =
+        m_transferContext.getInterfaceStatistics();
+
+    for (size_t i = 0; i < stats.size(); i++) {
+        double mib = stats[i].bytes / (1024.0 * 1024.0);
+        std::stringstream ss;
+
+        ss << "  " << stats[i].interface << ": " << std::fixed << std::setprecision(1)
+           << mib << " MiB";
+        if (stats[i].seconds > 0)
+            ss << " in " << stats[i].seconds << " s (" << mib / stats[i].seconds << " MiB/s)";
+        std::cout << ss.str() << std::endl;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string format_time(double seconds)
+{
+    std::stringstream ss;
+
+    if (seconds < 0)
+        return "-";
+
+    ss << std::fixed << std::setprecision(1) << seconds * 1000 << " ms";
+    return ss.str();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string format_rate(double rate)
+{
+    std::stringstream ss;
+
+    if (rate < 0)
+        return "-";
+
+    ss << std::fixed << std::setprecision(1) << rate / (1024 * 1024) << " MiB/s";
+    return ss.str();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string format_size(long long bytes)
+{
+    std::stringstream ss;
+
+    ss << std::fixed << std::setprecision(1);
+    if (bytes < 1024 * 1024)
+        ss << bytes / 1024.0 << " KiB";
+    else
+        ss << bytes / (1024.0 * 1024.0) << " MiB";
+    return ss.str();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::printTransferStatistics(const TransferStatisticsVector &statistics) const
+{
+    for (TransferStatisticsVector::const_iterator it = statistics.begin();
+            it != statistics.end(); ++it) {
+        const Downloader::Statistics &st = it->second;
+        std::string name = it->first.substr(it->first.rfind('/') + 1);
+
+        std::cout << name << ": " << format_size(st.bytes) << " in " << format_time(st.totalTime)
+                  << " (lookup " << format_time(st.nameLookupTime)
+                  << ", connect " << format_time(st.connectTime)
+                  << ", first byte " << format_time(st.firstByteTime) << ")" << std::endl;
+        std::cout << "  " << format_rate(st.averageRate) << ", peak "
+                  << format_rate(st.peakRate) << ", " << st.stalls << " stalls";
+        if (TftpClient::isTftpUrl(it->first))
+            std::cout << ", " << st.retransmits << " retransmits";
+        std::cout << std::endl;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void *PxeKexec::prefetchThread(void *arg)
+{
+    reinterpret_cast<PxeKexec *>(arg)->runPrefetch();
+
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::startPrefetch()
+{
+    // without any question, downloadStuff() is called immediately anyway
+    if (m_noPrefetch || (m_preChoice.size() > 0 && m_noconfirm))
+        return;
+
+    std::string label = m_preChoice;
+    if (label.empty())
+        label = getAutoBootLabel();
+    if (label.empty())
+        return;
+
+    MenuPath menus(1, &m_pxeConfig);
+    m_prefetchEntry = findEntry(label, menus);
+    if (!m_prefetchEntry.isValid()) {
+        BW_DEBUG_DBG("Not prefetching, no entry '%s'", label.c_str());
+        return;
+    }
+
+    BW_DEBUG_TRACE("Prefetching the images of '%s'", label.c_str());
+    m_prefetchDone = false;
+    m_prefetchError.clear();
+    m_transferContext.resetAbort();
+
+    int err = pthread_create(&m_prefetchThread, NULL, prefetchThread, this);
+    if (err != 0) {
+        BW_DEBUG_INFO("Cannot create prefetch thread: %s", std::strerror(err));
+        return;
+    }
+    m_prefetching = true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::runPrefetch()
+{
+    TraceSpan span("prefetch");
+    std::string error;
+
+    try {
+        downloadImages(m_prefetchEntry, true);
+    } catch (const std::exception &ex) {
+        error = ex.what();
+    }
+
+    pthread_mutex_lock(&m_prefetchMutex);
+    m_prefetchError = error;
+    m_prefetchDone = true;
+    pthread_mutex_unlock(&m_prefetchMutex);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool PxeKexec::finishPrefetch(bool wait)
+{
+    if (!m_prefetching)
+        return false;
+
+    TraceSpan span(wait ? "wait for prefetch" : "abort prefetch");
+
+    if (wait) {
+        // the progress of the background download is unknown, so just
+        // show that something happens
+        SimpleNotifier notifier;
+        bool done = false;
+        bool first = true;
+
+        while (true) {
+            pthread_mutex_lock(&m_prefetchMutex);
+            done = m_prefetchDone;
+            pthread_mutex_unlock(&m_prefetchMutex);
+            if (done)
+                break;
+
+            if (first) {
+                std::cout << "Waiting for the download of kernel and initrd ";
+                first = false;
+            }
+            notifier.progressed(0.0, 0.0);
+            usleep(100000);
+        }
+
+        if (!first)
+            notifier.finished();
+    } else {
+        BW_DEBUG_TRACE("Aborting the prefetch");
+        m_transferContext.abort();
+    }
+
+    pthread_join(m_prefetchThread, NULL);
+    m_prefetching = false;
+    m_transferContext.resetAbort();
+
+    if (wait && m_prefetchError.empty())
+        return true;
+
+    if (wait)
+        BW_DEBUG_INFO("Prefetching failed: %s", m_prefetchError.c_str());
+    deleteKernels();
+
+    return false;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::downloadStuff()
+    throw (ApplicationError)
+{
+    TraceSpan span("download");
+    m_downtime.markConfirmed();
+
+    // the prefetched images are only useful if they are the same
+    bool prefetched = false;
+    if (m_prefetching) {
+        bool same = getImageUrls(m_prefetchEntry, m_pxeHost) ==
+            getImageUrls(m_choice, m_pxeHost);
+        prefetched = finishPrefetch(same);
+    }
+
+    if (!prefetched)
+        downloadImages(m_choice, false);
+
+    if (m_stats)
+        printTransferStatistics(m_imageStatistics);
 }
 
 /* ---------------------------------------------------------------------------------------------- */
 void PxeKexec::deleteKernels()
 {
+    if (m_kernelFd >= 0) {
+        close(m_kernelFd);
+        m_kernelFd = -1;
+    }
+
+    if (m_initrdFd >= 0) {
+        close(m_initrdFd);
+        m_initrdFd = -1;
+    }
+
     if (m_nodelete)
         return;
 
     // delete kernel and initrd since they have been loaded
-    if (m_downloadedInitrd.size() > 0) {
+    if (m_downloadedKernel.size() > 0) {
         if (remove(m_downloadedKernel.c_str()) != 0)
             BW_DEBUG_INFO("Removal of %s failed.", m_downloadedKernel.c_str());
+        m_downloadedKernel.clear();
     }
 
     if (m_downloadedInitrd.size() > 0) {
         if (remove(m_downloadedInitrd.c_str()) != 0)
             BW_DEBUG_INFO("Removal of %s failed.", m_downloadedInitrd.c_str());
+        m_downloadedInitrd.clear();
     }
 
 }
@@ -569,21 +1753,31 @@ void PxeKexec::deleteKernels()
 void PxeKexec::execute()
     throw (ApplicationError)
 {
+    TraceSpan span("execute");
     Kexec ke;
 
-    if (m_downloadedKernel.size() == 0)
+    if (m_kernelFd < 0)
         throw ApplicationError("No kernel downloaded.");
     ke.setKernel(m_downloadedKernel);
+    ke.setKernelFd(m_kernelFd);
 
-    if (m_downloadedInitrd.size() > 0)
+    if (m_initrdFd >= 0) {
         ke.setInitrd(m_downloadedInitrd);
+        ke.setInitrdFd(m_initrdFd);
+    }
 
     ke.setAppend(m_choice.getAppend());
-    bool loaded = ke.load();
-    deleteKernels();
+    ke.addAppend(m_downtime.markLoadStart());
+    bool loaded;
+    {
+        TraceSpan span("load kernel");
+        loaded = ke.load();
+        deleteKernels();
+    }
 
     if (!loaded)
         throw ApplicationError("Loading kernel failed.");
+    m_downtime.markLoaded();
 
     if (m_loadOnly) {
         std::cerr << "Kernel loaded" << std::endl;
@@ -597,11 +1791,13 @@ void PxeKexec::execute()
             }
 
             // this never returns on success
+            Tracer::tracer()->instant("kexec -e");
             if (!ke.execute()) {
                 throw ApplicationError("Executing kernel failed");
             }
         } else {
             std::cerr << "Initiating reboot" << std::endl;
+            TraceSpan span("reboot");
             ke.reboot();
         }
     }
@@ -630,6 +1826,95 @@ void PxeKexec::printLinuxDistribution()
     std::cout << "Description : " << detector->getDescription()  << std::endl;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+bool PxeKexec::getPrintServerStatisticsOnly() const
+{
+    return m_serverStatsOnly;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeKexec::printServerStatistics()
+{
+    ServerHistory::EntryVector entries = m_serverHistory.getEntries();
+
+    if (entries.empty()) {
+        std::cout << "No server history in " DEFAULT_STATE_DIR "." << std::endl;
+        return;
+    }
+
+    std::cout << std::left << std::setw(24) << "Server" << std::right
+              << std::setw(10) << "Connect" << std::setw(12) << "First byte"
+              << std::setw(14) << "Throughput" << std::setw(7) << "OK"
+              << std::setw(8) << "Failed" << "  Last use" << std::endl;
+
+    for (ServerHistory::EntryVector::const_iterator it = entries.begin();
+            it != entries.end(); ++it) {
+        std::stringstream connect, firstByte, throughput;
+        char lastUsed[32];
+
+        connect << std::fixed << std::setprecision(1);
+        firstByte << std::fixed << std::setprecision(1);
+        throughput << std::fixed << std::setprecision(1);
+
+        if (it->connectTime >= 0)
+            connect << it->connectTime * 1000 << " ms";
+        else
+            connect << "-";
+        if (it->firstByteTime >= 0)
+            firstByte << it->firstByteTime * 1000 << " ms";
+        else
+            firstByte << "-";
+        if (it->throughput >= 0)
+            throughput << it->throughput / (1024 * 1024) << " MiB/s";
+        else
+            throughput << "-";
+
+        strftime(lastUsed, sizeof(lastUsed), "%Y-%m-%d %H:%M", localtime(&it->lastUsed));
+
+        std::cout << std::left << std::setw(24) << it->server << std::right
+                  << std::setw(10) << connect.str() << std::setw(12) << firstByte.str()
+                  << std::setw(14) << throughput.str() << std::setw(7) << it->successes
+                  << std::setw(8) << it->failures << "  " << lastUsed;
+        if (it->failureStreak > 0)
+            std::cout << " (failed " << it->failureStreak << "x)";
+        std::cout << std::endl;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool PxeKexec::getReportDowntimeOnly() const
+{
+    return m_reportDowntime;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool PxeKexec::reportDowntime()
+{
+    std::ifstream fin("/proc/cmdline");
+    std::string cmdline;
+    Downtime::Report report;
+
+    std::getline(fin, cmdline);
+    if (!m_downtime.compute(cmdline, report)) {
+        std::cerr << "This system has not been booted by pxe-kexec." << std::endl;
+        return false;
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "Download          : " << std::setw(9) << report.download << " s" << std::endl;
+    if (report.load >= 0) {
+        std::cout << "Load              : " << std::setw(9) << report.load << " s" << std::endl;
+        std::cout << "Shutdown          : " << std::setw(9) << report.shutdown << " s"
+                  << std::endl;
+    } else
+        std::cout << "Load and shutdown : " << std::setw(9) << report.shutdown << " s"
+                  << std::endl;
+    std::cout << "Kernel boot       : " << std::setw(9) << report.kernelBoot << " s" << std::endl;
+    std::cout << "Total             : " << std::setw(9) << report.total << " s" << std::endl;
+
+    return true;
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 void PxeKexec::printVersion()
 {
@@ -28,10 +28,20 @@
  */
 
 #include <string>
+#include <map>
+
+#include <pthread.h>
 
 #include <libbw/completion.h>
 #include "global.h"
 #include "pxeparser.h"
+#include "downloader.h"
+#include "imagecache.h"
+#include "serverhistory.h"
+#include "downtime.h"
+#include "labeltrie.h"
+
+class NetworkInterface;
 
 /* PxeKexec {{{ */
 
@@ -104,6 +114,20 @@ class PxeKexec : public bw::Completor {
          */
         void displayMessage();
 
+        /**
+         * @brief Starts downloading the likely entry in the background
+         *
+         * Starts downloading the kernel and initrd of the entry that will
+         * probably be booted, i.e. the entry specified with @c -l or the
+         * @c DEFAULT entry of the PXE configuration, while chooseEntry() and
+         * confirmBoot() wait for the user. downloadStuff() uses the result if
+         * that entry has been chosen and cancels the download otherwise.
+         *
+         * Needs to be called after readPxeConfig(). Does nothing if there is
+         * no such entry or if the user won't be asked anyway.
+         */
+        void startPrefetch();
+
         /**
          * @brief Displays a prompt and chooses the entry
          *
@@ -129,7 +153,10 @@ class PxeKexec : public bw::Completor {
          * @brief Download kernel and initrd
          *
          * Called after confirmBoot(), downloads kernel and initrd needed for
-         * the next step.
+         * the next step. All images are downloaded concurrently. If the
+         * entry has more than one initrd, they are concatenated. If the
+         * images have already been downloaded in the background (see
+         * startPrefetch()), only the end of that download is awaited.
          *
          * @throw ApplicationError if downloading failed
          */
@@ -150,7 +177,8 @@ class PxeKexec : public bw::Completor {
          * @brief Delete kernel and initrd
          *
          * This function has to be called after loading kernel and initrd.
-         * If deletion failed, only a debugging message is printed.
+         * It closes the downloaded images and deletes them unless they should
+         * be kept. If deletion failed, only a debugging message is printed.
          */
         void deleteKernels();
 
@@ -171,6 +199,21 @@ class PxeKexec : public bw::Completor {
                                           size_t                start_idx,
                                           ssize_t               end_idx);
 
+        /**
+         * @brief Filter
+         *
+         * This is the incremental filter of the prompt in chooseEntry(). It
+         * searches the labels that contain @p text or match it fuzzily.
+         *
+         * @param[in] text the current line
+         * @param[out] matches at most @p max matching labels
+         * @param[in] max the maximum number of labels in @p matches
+         * @return the total number of matching labels
+         */
+        size_t filter(const std::string         &text,
+                      std::vector<std::string>  &matches,
+                      size_t                    max);
+
         /**
          * @brief Checks if we should only print the Linux distribution and exit
          *
@@ -183,18 +226,301 @@ class PxeKexec : public bw::Completor {
          */
         void printLinuxDistribution();
 
+        /**
+         * @brief Checks if we should only print the server history and exit
+         *
+         * @return @c true if <tt>--server-stats</tt> has been specified
+         */
+        bool getPrintServerStatisticsOnly() const;
+
+        /**
+         * @brief Prints the history of the boot servers
+         */
+        void printServerStatistics();
+
+        /**
+         * @brief Checks if we should only report the downtime and exit
+         *
+         * @return @c true if <tt>--report-downtime</tt> has been specified
+         */
+        bool getReportDowntimeOnly() const;
+
+        /**
+         * @brief Prints the downtime of the reboot that started this system
+         *
+         * @return @c false if this system has not been booted by pxe-kexec
+         */
+        bool reportDowntime();
+
         /**
          * @brief Prints the version to stdout
          */
         void printVersion();
 
+    protected:
+        /**
+         * @brief Returns the URL of an image
+         *
+         * Returns the URL of the kernel or initrd @p path as specified in
+         * the PXE configuration. If @p path is no URL, it is relative to
+         * the path prefix from the DHCP server (if any) on the PXE server
+         * @p host. Like for pxelinux, absolute paths don't use the prefix.
+         *
+         * @param[in] path the path or URL of the image
+         * @param[in] host the PXE server
+         * @return the URL
+         */
+        std::string getImageUrl(const std::string &path, const std::string &host) const;
+
+        /**
+         * @brief Reads a list of servers
+         *
+         * Appends the servers in @p filename to the list of servers. The file
+         * contains one server per line, everything after a @c # is ignored.
+         *
+         * @param[in] filename the name of the file
+         * @throw ApplicationError if the file cannot be read
+         */
+        void readMirrorList(const std::string &filename)
+            throw (ApplicationError);
+
+        /**
+         * @brief Asks the DHCP server for the boot options
+         *
+         * Sends a DHCPINFORM on @p netif. The server of the reply is added
+         * to the list of servers: the TFTP server name (option 66), else
+         * the next server (@c siaddr), else the DHCP server itself. The
+         * PXELINUX configuration file (option 209) replaces the search in
+         * <tt>pxelinux.cfg/</tt>, and the path prefix (option 210, else the
+         * directory of the boot file) is used for all relative paths.
+         *
+         * If the server doesn't answer, nothing changes.
+         *
+         * @param[in] netif the interface
+         * @exception ApplicationError if the request cannot be sent
+         */
+        void queryDhcpServer(const NetworkInterface &netif)
+            throw (ApplicationError);
+
+        /**
+         * @brief Finds the server that answers first
+         *
+         * Asks all servers for the default PXE configuration at nearly the
+         * same time (see MultiDownloader::downloadFastest()) and moves the
+         * server that answers first to the front of the list of servers. The
+         * order of the other servers is kept. A server whose connection
+         * failed is recorded as failed in the server history; for every
+         * other server that answered, only its latency is recorded, so
+         * losing the race doesn't count as a failure.
+         */
+        void raceMirrors();
+
+        /**
+         * @brief Downloads the files that a configuration references
+         *
+         * Downloads the files of all @c INCLUDE, <tt>MENU INCLUDE</tt> and
+         * @c DISPLAY statements of @p file from the PXE server, then the
+         * files that those files reference and so on. All files of one
+         * level are downloaded at the same time, and each file is only
+         * downloaded and parsed once. Missing files are ignored.
+         *
+         * @param[in] file the PXE configuration
+         * @param[out] files the included configuration files
+         * @param[out] texts the displayed text files
+         * @exception DownloadError if the server cannot be reached
+         * @exception ParseError if an included file cannot be parsed
+         */
+        void readIncludes(const PxeFile &file, PxeFileMap &files, PxeTextMap &texts)
+            throw (DownloadError, ParseError);
+
+        /**
+         * @brief Creates the file for a downloaded image
+         *
+         * Creates an anonymous memory file (see memfd_create(2)) for the
+         * image @p name, so that the image never hits the file system. If
+         * the downloaded files should be kept (@c --nodelete) or if the
+         * system doesn't support memory files, a file in <tt>$TMPDIR</tt>
+         * is created instead.
+         *
+         * @param[in] name the name of the image, e.g. @c kernel
+         * @param[out] filename the name of the created file or the empty
+         *             string if an anonymous memory file has been created
+         * @return the file descriptor, opened for reading and writing
+         * @throw ApplicationError if the file cannot be created
+         */
+        int createImage(const std::string &name, std::string &filename)
+            throw (ApplicationError);
+
+        /**
+         * @brief Takes images from the cache
+         *
+         * Asks the server for the validators of the images @p urls (which is
+         * much cheaper than downloading them) and writes each image that is
+         * cached with the same validator to the corresponding file of @p fds.
+         *
+         * @param[in] cache the image cache
+         * @param[in] urls the URLs of the images
+         * @param[in] fds the empty files for the images
+         * @param[in] quiet @c true if the images that are taken from the
+         *            cache should not be printed
+         * @return for each image @c true if it has been taken from the cache
+         */
+        std::vector<bool> restoreImages(ImageCache &cache, const StringVector &urls,
+                                        const std::vector<int> &fds, bool quiet);
+
+        /**
+         * @brief Downloads the images of an entry
+         *
+         * Does the work of downloadStuff() for @p entry.
+         *
+         * @param[in] entry the PXE entry
+         * @param[in] quiet @c true if nothing should be printed
+         * @throw ApplicationError if downloading failed
+         */
+        void downloadImages(const PxeEntry &entry, bool quiet)
+            throw (ApplicationError);
+
+        /**
+         * @brief Returns the URLs of the images of an entry
+         *
+         * @param[in] entry the PXE entry
+         * @param[in] host the PXE server
+         * @return the URL of the kernel, followed by the URLs of the initrds
+         */
+        StringVector getImageUrls(PxeEntry entry, const std::string &host) const;
+
+        /**
+         * @brief Body of the background download thread
+         *
+         * See startPrefetch().
+         */
+        void runPrefetch();
+
+        /**
+         * @brief Start function for pthread_create()
+         *
+         * @param[in] arg the PxeKexec object
+         * @return always @c NULL
+         */
+        static void *prefetchThread(void *arg);
+
+        /**
+         * @brief Ends the background download
+         *
+         * Waits until the background download has finished if @p wait is
+         * @c true, aborts it otherwise. The images of an aborted or failed
+         * download are deleted.
+         *
+         * @param[in] wait @c true if the download should be finished,
+         *            @c false if it should be aborted
+         * @return @c true if the images have been downloaded successfully
+         */
+        bool finishPrefetch(bool wait);
+
+        /**
+         * @brief Prints how much each interface has downloaded
+         *
+         * Only prints something if multipath downloads are enabled.
+         */
+        void printInterfaceStatistics() const;
+
+        /**
+         * @brief URLs and timing of downloads
+         */
+        typedef std::vector<std::pair<std::string, Downloader::Statistics> >
+            TransferStatisticsVector;
+
+        /**
+         * @brief Prints the timing of downloads
+         *
+         * Prints a short summary of each download for <tt>--stats</tt>.
+         *
+         * @param[in] statistics the URLs and the timing of the downloads
+         */
+        void printTransferStatistics(const TransferStatisticsVector &statistics) const;
+
+        /**
+         * @brief Path from the main menu to a submenu
+         */
+        typedef std::vector<PxeConfig *> MenuPath;
+
+        /**
+         * @brief Returns the configuration of a menu entry
+         *
+         * A chained configuration file is downloaded the first time it's
+         * opened and kept for the rest of the run.
+         *
+         * @param[in] entry an entry with PxeEntry::isMenu()
+         * @return the configuration or @c NULL if it cannot be downloaded,
+         *         the pointer stays valid for the rest of the run
+         */
+        PxeConfig *openMenu(const PxeEntry &entry);
+
+        /**
+         * @brief Finds an entry by its path
+         *
+         * Resolves @p path like <tt>submenu/label</tt> relative to the last
+         * menu of @p menus. Each menu on the way is opened and appended to
+         * @p menus, <tt>..</tt> goes back to the parent menu. Only the
+         * chained configuration files on the way are downloaded.
+         *
+         * @param[in] path the path of the entry
+         * @param[in,out] menus the current menu path
+         * @return the entry or an invalid entry if the path doesn't exist
+         *         or if it names a menu, which is opened then
+         */
+        PxeEntry findEntry(const std::string &path, MenuPath &menus);
+
+        /**
+         * @brief Shows a menu after it has been opened
+         *
+         * Prints the message of the menu and offers its entries for the
+         * completion.
+         *
+         * @param[in] menus the menu path, the last menu is shown
+         */
+        void showMenu(const MenuPath &menus);
+
+        /**
+         * @brief Returns the label that is booted without user input
+         *
+         * @return the first word of @c ONTIMEOUT or, if that is not set, of
+         *         @c DEFAULT
+         */
+        std::string getAutoBootLabel() const;
+
+        /**
+         * @brief Counts down the @c TIMEOUT
+         *
+         * Displays the remaining time until the entry is booted
+         * automatically. Pressing a key cancels the countdown; the key is
+         * not consumed, it's the first character of the input line.
+         *
+         * @param[in] label the label that is booted after the timeout
+         * @param[in] timeout the timeout in milliseconds
+         * @return @c true if the timeout expired or if nobody can press a
+         *         key because the standard input is at its end, @c false if
+         *         a key has been pressed
+         */
+        bool countdown(const std::string &label, long timeout);
+
     private:
+        TransferContext m_transferContext;
         std::string    m_pxeHost;
+        StringVector   m_mirrors;
         std::string    m_networkInterface;
+        int            m_waitNetwork;
+        bool           m_dhcpInform;
+        std::string    m_pathPrefix;
+        std::string    m_configFile;
         PxeConfig      m_pxeConfig;
+        std::map<std::string, PxeConfig> m_chainedConfigs;
+        LabelTrie      m_labelTrie;
         PxeEntry       m_choice;
         std::string    m_downloadedKernel;
         std::string    m_downloadedInitrd;
+        int            m_kernelFd;
+        int            m_initrdFd;
         bool           m_noconfirm;
         bool           m_nodelete;
         bool           m_quiet;
@@ -205,7 +531,24 @@ class PxeKexec : public bw::Completor {
         bool           m_force;
         bool           m_ignoreWhitelist;
         bool           m_detectDistOnly;
+        bool           m_serverStatsOnly;
+        bool           m_stats;
+        ServerHistory  m_serverHistory;
+        bool           m_reportDowntime;
+        Downtime       m_downtime;
+        TransferStatisticsVector m_imageStatistics;
         bool           m_loadOnly;
+        bool           m_noCache;
+        std::string    m_cacheDir;
+        unsigned long long m_cacheSize;
+        bool           m_noPrefetch;
+        bool           m_autoBoot;
+        PxeEntry       m_prefetchEntry;
+        bool           m_prefetching;
+        pthread_t      m_prefetchThread;
+        pthread_mutex_t m_prefetchMutex;
+        bool           m_prefetchDone;
+        std::string    m_prefetchError;
 };
 
 /* }}} */
@@ -15,7 +15,12 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <string>
+#include <sstream>
 #include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
 
 #include <strings.h>
 
@@ -24,6 +29,9 @@
 
 #include "pxeparser.h"
 
+// pxelinux has the same limit, it also stops include loops
+#define MAX_INCLUDE_DEPTH 16
+
 /* PxeEntry {{{ */
 
 /* ---------------------------------------------------------------------------------------------- */
@@ -46,13 +54,13 @@ bool PxeEntry::isValid() const
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-std::string PxeEntry::getLabel() const
+const std::string &PxeEntry::getLabel() const
 {
     return m_label;
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-std::string PxeEntry::getKernel() const
+const std::string &PxeEntry::getKernel() const
 {
     return m_kernel;
 }
@@ -85,7 +93,24 @@ std::string PxeEntry::getInitrd()
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-std::string PxeEntry::getAppend() const
+StringVector PxeEntry::getInitrds()
+{
+    StringVector initrds;
+    std::string initrd = getInitrd();
+
+    if (initrd.empty())
+        return initrds;
+
+    StringVector parts = bw::stringsplit(initrd, ",");
+    for (StringVector::const_iterator it = parts.begin(); it != parts.end(); ++it)
+        if (!it->empty())
+            initrds.push_back(*it);
+
+    return initrds;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+const std::string &PxeEntry::getAppend() const
 {
     return m_append;
 }
@@ -97,9 +122,45 @@ void PxeEntry::setAppend(const std::string &append)
     m_initrdParsed = false;
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+bool PxeEntry::isMenu() const
+{
+    return m_submenu.get() != NULL || !m_config.empty();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+PxeConfig *PxeEntry::getSubmenu() const
+{
+    return m_submenu.get();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeEntry::setSubmenu(const std::tr1::shared_ptr<PxeConfig> &submenu)
+{
+    m_submenu = submenu;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+const std::string &PxeEntry::getConfig() const
+{
+    return m_config;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeEntry::setConfig(const std::string &config)
+{
+    m_config = config;
+}
+
 /* }}} */
 /* PxeConfig {{{ */
 
+/* ---------------------------------------------------------------------------------------------- */
+PxeConfig::PxeConfig()
+    : m_timeout(0)
+    , m_totalTimeout(0)
+{}
+
 /* ---------------------------------------------------------------------------------------------- */
 std::string PxeConfig::getMessage() const
 {
@@ -125,137 +186,654 @@ void PxeConfig::setDefault(const std::string &def)
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-void PxeConfig::addEntry(PxeEntry entry)
+int PxeConfig::getTimeout() const
+{
+    return m_timeout;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeConfig::setTimeout(int timeout)
+{
+    m_timeout = timeout;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+int PxeConfig::getTotalTimeout() const
+{
+    return m_totalTimeout;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeConfig::setTotalTimeout(int timeout)
+{
+    m_totalTimeout = timeout;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+std::string PxeConfig::getOnTimeout() const
+{
+    return m_onTimeout;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeConfig::setOnTimeout(const std::string &ontimeout)
+{
+    m_onTimeout = ontimeout;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static inline unsigned char lower(char c)
+{
+    // std::tolower() is undefined for negative values, i.e. bytes >= 0x80
+    return std::tolower((unsigned char)c);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+size_t PxeConfig::LabelHash::operator()(const std::string &label) const
+{
+    // FNV-1a
+    size_t hash = 2166136261U;
+
+    for (std::string::const_iterator it = label.begin(); it != label.end(); ++it)
+        hash = (hash ^ lower(*it)) * 16777619U;
+
+    return hash;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool PxeConfig::LabelEqual::operator()(const std::string &a, const std::string &b) const
 {
+    // the same folding as LabelHash, so that equal labels have equal hashes
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); i++)
+        if (lower(a[i]) != lower(b[i]))
+            return false;
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+PxeEntry &PxeConfig::addEntry(const PxeEntry &entry)
+{
+    // like a linear search, the first entry with a label wins
+    m_index.insert(std::make_pair(entry.getLabel(), m_entries.size()));
+    m_entryNames.push_back(entry.getLabel());
     m_entries.push_back(entry);
+
+    return m_entries.back();
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-std::vector<PxeEntry> PxeConfig::getEntries() const
+const std::vector<PxeEntry> &PxeConfig::getEntries() const
 {
     return m_entries;
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-std::vector<std::string> PxeConfig::getEntryNames() const
+const StringVector &PxeConfig::getEntryNames() const
+{
+    return m_entryNames;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+const PxeEntry &PxeConfig::getEntry(const std::string &label) const
 {
-    std::vector<std::string> names;
+    static const PxeEntry invalid;
+
+    LabelIndex::const_iterator it = m_index.find(label);
 
-    for (std::vector<PxeEntry>::const_iterator it = m_entries.begin();
-            it != m_entries.end(); ++it) {
-        names.push_back(it->getLabel());
+    return it != m_index.end() ? m_entries[it->second] : invalid;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeConfig::swap(PxeConfig &other)
+{
+    m_message.swap(other.m_message);
+    m_default.swap(other.m_default);
+    m_onTimeout.swap(other.m_onTimeout);
+    std::swap(m_timeout, other.m_timeout);
+    std::swap(m_totalTimeout, other.m_totalTimeout);
+    m_entry.swap(other.m_entry);
+    m_entries.swap(other.m_entries);
+    m_entryNames.swap(other.m_entryNames);
+    m_index.swap(other.m_index);
+}
+
+/* }}} */
+/* PxeFile {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeFile::appendText(const char *buffer, size_t len)
+{
+    m_text.append(buffer, len);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+const std::string &PxeFile::getText() const
+{
+    return m_text;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeFile::add(Keyword keyword, size_t offset, size_t length)
+{
+    Statement statement;
+
+    statement.keyword = keyword;
+    statement.offset = offset;
+    statement.length = length;
+    m_statements.push_back(statement);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+std::string PxeFile::getArgument(const Statement &statement) const
+{
+    return m_text.substr(statement.offset, statement.length);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+const PxeFile::StatementVector &PxeFile::getStatements() const
+{
+    return m_statements;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+StringVector PxeFile::getArguments(Keyword keyword) const
+{
+    StringVector arguments;
+
+    for (StatementVector::const_iterator it = m_statements.begin();
+            it != m_statements.end(); ++it) {
+        if (it->keyword != keyword)
+            continue;
+
+        std::string argument = getArgument(*it);
+        if (std::find(arguments.begin(), arguments.end(), argument) == arguments.end())
+            arguments.push_back(argument);
     }
 
-    return names;
+    return arguments;
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-bool compare_entry_name(PxeEntry entry, std::string label)
+StringVector PxeFile::getIncludes() const
 {
-    return strcasecmp(entry.getLabel().c_str(), label.c_str()) == 0;
+    return getArguments(KW_INCLUDE);
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-PxeEntry PxeConfig::getEntry(const std::string &label) const
+StringVector PxeFile::getDisplays() const
 {
-    std::vector<PxeEntry>::const_iterator it =
-        find_if(m_entries.begin(), m_entries.end(),
-                std::bind2nd(std::ptr_fun(compare_entry_name), label));
+    return getArguments(KW_DISPLAY);
+}
 
-    return it != m_entries.end() ? *it : PxeEntry();
+/* ---------------------------------------------------------------------------------------------- */
+void PxeFile::swap(PxeFile &other)
+{
+    m_text.swap(other.m_text);
+    m_statements.swap(other.m_statements);
+}
+
+/* }}} */
+/* Keywords {{{ */
+
+/**
+ * @brief Part of a line
+ *
+ * Points into the buffer that is parsed, so nothing has to be copied.
+ */
+struct Slice {
+    const char *begin;
+    const char *end;
+
+    Slice(const char *b, const char *e) : begin(b), end(e) {}
+    size_t size() const { return end - begin; }
+    bool empty() const { return begin == end; }
+    std::string str() const { return std::string(begin, end); }
+};
+
+typedef PxeFile::Keyword Keyword;
+
+struct KeywordEntry {
+    const char  *name;
+    Keyword     keyword;
+};
+
+static const KeywordEntry keywords[] = {
+    { "say",           PxeFile::KW_SAY           },
+    { "label",         PxeFile::KW_LABEL         },
+    { "kernel",        PxeFile::KW_KERNEL        },
+    { "append",        PxeFile::KW_APPEND        },
+    { "default",       PxeFile::KW_DEFAULT       },
+    { "include",       PxeFile::KW_INCLUDE       },
+    { "display",       PxeFile::KW_DISPLAY       },
+    { "menu",          PxeFile::KW_MENU          },
+    { "config",        PxeFile::KW_CONFIG        },
+    { "timeout",       PxeFile::KW_TIMEOUT       },
+    { "totaltimeout",  PxeFile::KW_TOTALTIMEOUT  },
+    { "ontimeout",     PxeFile::KW_ONTIMEOUT     }
+};
+
+// The hash over the first and last character and the length has no collisions
+// for the keywords above, but it isn't perfect for all pxelinux keywords (e.g.
+// "label" and "comboot", or "kernel" and "path" share a slot). Collisions are
+// resolved by linear probing, so adding a keyword never breaks another one.
+// The size is a power of two and much larger than the number of keywords, so
+// the probe sequences stay short.
+#define KEYWORD_TABLE_SIZE 64
+
+// at least one slot must stay empty, it ends the probing for unknown words
+typedef char keyword_table_too_small[ARRAY_SIZE(keywords) < KEYWORD_TABLE_SIZE ? 1 : -1];
+
+/* ---------------------------------------------------------------------------------------------- */
+static inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static Slice strip(Slice slice)
+{
+    while (!slice.empty() && is_space(*slice.begin))
+        slice.begin++;
+    while (!slice.empty() && is_space(*(slice.end - 1)))
+        slice.end--;
+
+    return slice;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static Slice next_word(Slice &rest)
+{
+    const char *p = rest.begin;
+
+    while (p != rest.end && !is_space(*p))
+        p++;
+
+    Slice word(rest.begin, p);
+    rest = strip(Slice(p, rest.end));
+
+    return word;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static inline unsigned int keyword_hash(const char *word, size_t len)
+{
+    return (lower(word[0]) * 2 + lower(word[len-1]) * 18 + len) % KEYWORD_TABLE_SIZE;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static Keyword lookup_keyword(const Slice &word)
+{
+    static const KeywordEntry *table[KEYWORD_TABLE_SIZE];
+    static bool initialised = false;
+
+    if (!initialised) {
+        for (size_t i = 0; i < ARRAY_SIZE(keywords); i++) {
+            unsigned int slot = keyword_hash(keywords[i].name, strlen(keywords[i].name));
+            while (table[slot]) {
+                BW_DEBUG_DBG("Keyword '%s' collides with '%s'", keywords[i].name,
+                             table[slot]->name);
+                slot = (slot + 1) % KEYWORD_TABLE_SIZE;
+            }
+            table[slot] = &keywords[i];
+        }
+        initialised = true;
+    }
+
+    if (word.empty())
+        return PxeFile::KW_NONE;
+
+    for (unsigned int slot = keyword_hash(word.begin, word.size()); table[slot];
+            slot = (slot + 1) % KEYWORD_TABLE_SIZE) {
+        const KeywordEntry *entry = table[slot];
+        if (strlen(entry->name) == word.size() &&
+                strncasecmp(entry->name, word.begin, word.size()) == 0)
+            return entry->keyword;
+    }
+
+    return PxeFile::KW_NONE;
 }
 
 /* }}} */
 /* PxeParser {{{ */
 
+/* ---------------------------------------------------------------------------------------------- */
+static void add_statement(PxeFile &file, Keyword keyword, const Slice &argument)
+{
+    file.add(keyword, argument.begin - file.getText().data(), argument.size());
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 PxeParser::PxeParser()
-    : m_state(PS_GLOBAL)
+    : m_currentEntry(NULL)
+    , m_state(PS_GLOBAL)
+    , m_lineStart(0)
 {}
 
 /* ---------------------------------------------------------------------------------------------- */
-void PxeParser::feedLine(std::string line)
+void PxeParser::feedLine(const std::string &line)
     throw (ParseError)
 {
-    line = bw::strip(line);
+    feedLine(line.data(), line.data() + line.size());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeParser::feedLine(const char *begin, const char *end)
+    throw (ParseError)
+{
+    feed(begin, end - begin);
+    feed("\n", 1);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeParser::parseLine(size_t begin, size_t end)
+    throw (ParseError)
+{
+    // the text doesn't change while the line is parsed, the slices stay valid
+    const char *text = m_file.getText().data();
+    Slice line = strip(Slice(text + begin, text + end));
 
     // skip comments and empty lines
-    if (line.size() == 0 || line[0] == '#')
+    if (line.empty() || *line.begin == '#')
         return;
 
-    BW_DEBUG_DBG("Line: %s (label:%d)\n", line.c_str(), bw::startsWith(line, "label ", false) );
+    BW_DEBUG_DBG("Line: %.*s", int(line.size()), line.begin);
 
-    switch (m_state) {
-        case PS_GLOBAL:
-            // parse "say"
-            if (bw::startsWith(line, "say ", false) ||
-                    bw::startsWith(line, "say\t", false)) {
-                m_config.addMessage(bw::stripr(bw::getRest(line, "say")));
-                return;
-            }
-
-            // parse "label"
-            if (bw::startsWith(line, "label ", false) ||
-                    bw::startsWith(line, "label\t", false)) {
-                m_currentEntry = PxeEntry(bw::strip(bw::getRest(line, "label")));
-                m_state = PS_ENTRY;
-                return;
-            }
+    Slice rest = line;
+    Slice word = next_word(rest);
+    Keyword keyword = lookup_keyword(word);
 
+    switch (keyword) {
+        case PxeFile::KW_SAY:
+            // the text is taken verbatim, including the leading whitespace
+            add_statement(m_file, keyword, Slice(word.end, line.end));
             break;
 
-        case PS_ENTRY:
-            // parse "label"
-            if (bw::startsWith(line, "label ", false)) {
-                BW_DEBUG_TRACE("Adding entry with label=%s, kernel=%s, initrd=%s, append=%s",
-                        m_currentEntry.getLabel().c_str(),
-                        m_currentEntry.getKernel().c_str(),
-                        m_currentEntry.getInitrd().c_str(),
-                        m_currentEntry.getAppend().c_str());
-                m_config.addEntry(m_currentEntry);
-                m_currentEntry = PxeEntry();
-                m_state = PS_GLOBAL;
-                feedLine(line);
-                return;
-            }
+        case PxeFile::KW_INCLUDE:
+        case PxeFile::KW_DISPLAY:
+        case PxeFile::KW_CONFIG:
+            // CONFIG may be followed by a new working directory, which is ignored
+            word = next_word(rest);
+            if (!word.empty())
+                add_statement(m_file, keyword, word);
+            break;
 
-            // parse "kernel"
-            if (bw::startsWith(line, "kernel ", false)) {
-                m_currentEntry.setKernel(bw::strip(bw::getRest(line, "kernel")));
-                return;
-            }
+        case PxeFile::KW_MENU:
+            // all other MENU keywords only change the look of the menu
+            word = next_word(rest);
+            if (word.size() == 7 && strncasecmp(word.begin, "include", 7) == 0) {
+                // the optional menu title is ignored
+                word = next_word(rest);
+                if (!word.empty())
+                    add_statement(m_file, PxeFile::KW_INCLUDE, word);
+            } else if (word.size() == 7 && strncasecmp(word.begin, "default", 7) == 0)
+                add_statement(m_file, PxeFile::KW_MENU_DEFAULT, Slice(line.end, line.end));
+            else if (word.size() == 5 && strncasecmp(word.begin, "begin", 5) == 0)
+                add_statement(m_file, PxeFile::KW_MENU_BEGIN, next_word(rest));
+            else if (word.size() == 3 && strncasecmp(word.begin, "end", 3) == 0)
+                add_statement(m_file, PxeFile::KW_MENU_END, Slice(line.end, line.end));
+            break;
 
-            // parse "append"
-            if (bw::startsWith(line, "append ", false)) {
-                m_currentEntry.setAppend(bw::strip(bw::getRest(line, "append")));
-                return;
-            }
+        case PxeFile::KW_NONE:
+        case PxeFile::KW_MENU_DEFAULT:
+        case PxeFile::KW_MENU_BEGIN:
+        case PxeFile::KW_MENU_END:
+            break;
 
+        default:
+            add_statement(m_file, keyword, rest);
             break;
     }
 }
 
+/* ---------------------------------------------------------------------------------------------- */
+void PxeParser::parseBuffer(const char *buffer, size_t len)
+    throw (ParseError)
+{
+    feed(buffer, len);
+    finishParsing();
+    buildConfig(PxeFileMap(), PxeTextMap());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeParser::feed(const char *buffer, size_t len)
+    throw (ParseError)
+{
+    m_file.appendText(buffer, len);
+
+    // a line that crosses the chunk boundary is complete as soon as its newline arrives
+    const std::string &text = m_file.getText();
+    std::string::size_type eol;
+    while ((eol = text.find('\n', m_lineStart)) != std::string::npos) {
+        parseLine(m_lineStart, eol);
+        m_lineStart = eol + 1;
+    }
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 void PxeParser::parseStream(std::istream &stream)
     throw (ParseError)
 {
-    std::string line;
+    char buffer[4096];
 
-    while (std::getline(stream, line))
-        feedLine(line);
+    while (stream.read(buffer, sizeof(buffer)) || stream.gcount() > 0)
+        feed(buffer, stream.gcount());
 
     finishParsing();
+    buildConfig(PxeFileMap(), PxeTextMap());
 }
 
 /* ---------------------------------------------------------------------------------------------- */
 void PxeParser::finishParsing()
+    throw (ParseError)
+{
+    size_t size = m_file.getText().size();
+
+    if (m_lineStart < size) {
+        parseLine(m_lineStart, size);
+        m_lineStart = size;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static bool is_module(const std::string &command)
+{
+    std::string name = command.substr(0, command.find_first_of(" \t"));
+
+    return name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".c32") == 0;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string display_text(const std::string &text)
+{
+    std::string ret;
+
+    // drop the control codes of the pxelinux console: ^L clears the screen,
+    // ^O is followed by two digits of a colour
+    for (std::string::size_type i = 0; i < text.size(); i++) {
+        if (text[i] == '\x0f') {
+            i += 2;
+            continue;
+        }
+        if ((unsigned char)text[i] < 0x20 && text[i] != '\n' && text[i] != '\t')
+            continue;
+        ret += text[i];
+    }
+
+    while (!ret.empty() && ret[ret.size() - 1] == '\n')
+        ret.erase(ret.size() - 1);
+
+    return ret;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static bool is_config_file(const std::string &kernel)
+{
+    return bw::startsWith(kernel, "pxelinux.cfg/") ||
+        (kernel.size() > 4 && strcasecmp(kernel.c_str() + kernel.size() - 4, ".cfg") == 0);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeParser::apply(const PxeFile &file, const PxeFileMap &files, const PxeTextMap &texts,
+                      int depth)
 {
-    if (m_currentEntry.isValid())
-        m_config.addEntry(m_currentEntry);
+    const PxeFile::StatementVector &statements = file.getStatements();
+    std::string argument;
+
+    // the only copy of an argument is the one that the entry or menu keeps,
+    // argument is re-used and doesn't allocate once it's large enough
+    for (PxeFile::StatementVector::const_iterator it = statements.begin();
+            it != statements.end(); ++it) {
+        argument.assign(file.getText(), it->offset, it->length);
+        PxeConfig &menu = *m_menus.back();
+
+        switch (it->keyword) {
+            case PxeFile::KW_DEFAULT:
+                // global, but pxelinux accepts it everywhere; "DEFAULT
+                // vesamenu.c32" starts a menu module, which lists the labels
+                if (!is_module(argument))
+                    m_config.setDefault(argument);
+                break;
+
+            case PxeFile::KW_SAY:
+                if (m_state == PS_GLOBAL)
+                    menu.addMessage(argument);
+                break;
+
+            case PxeFile::KW_TIMEOUT:
+                m_config.setTimeout(std::atoi(argument.c_str()));
+                break;
+
+            case PxeFile::KW_TOTALTIMEOUT:
+                m_config.setTotalTimeout(std::atoi(argument.c_str()));
+                break;
+
+            case PxeFile::KW_ONTIMEOUT:
+                m_config.setOnTimeout(argument);
+                break;
+
+            case PxeFile::KW_LABEL:
+                if (argument.empty())
+                    break;
+                m_currentEntry = &menu.addEntry(PxeEntry(argument));
+                m_state = PS_ENTRY;
+                break;
+
+            case PxeFile::KW_KERNEL:
+                if (m_state != PS_ENTRY)
+                    break;
+                if (is_config_file(argument))
+                    m_currentEntry->setConfig(argument);
+                else
+                    m_currentEntry->setKernel(argument);
+                break;
+
+            case PxeFile::KW_APPEND:
+                if (m_state == PS_ENTRY)
+                    m_currentEntry->setAppend(argument);
+                break;
+
+            case PxeFile::KW_CONFIG:
+                // a global CONFIG would replace the whole configuration
+                if (m_state == PS_ENTRY)
+                    m_currentEntry->setConfig(argument);
+                else
+                    BW_DEBUG_INFO("Ignoring CONFIG %s outside of a label", argument.c_str());
+                break;
+
+            case PxeFile::KW_MENU_DEFAULT:
+                if (m_state == PS_ENTRY)
+                    menu.setDefault(m_currentEntry->getLabel());
+                break;
+
+            case PxeFile::KW_MENU_BEGIN: {
+                std::tr1::shared_ptr<PxeConfig> submenu(new PxeConfig());
+                std::string name = argument;
+
+                // a submenu needs a name to be chosen
+                if (name.empty()) {
+                    std::stringstream ss;
+                    ss << "menu" << menu.getEntries().size() + 1;
+                    name = ss.str();
+                }
+
+                PxeEntry entry(name);
+                entry.setSubmenu(submenu);
+                menu.addEntry(entry);
+                m_menus.push_back(submenu.get());
+                m_currentEntry = NULL;
+                m_state = PS_GLOBAL;
+                break;
+            }
+
+            case PxeFile::KW_MENU_END:
+                if (m_menus.size() > 1)
+                    m_menus.pop_back();
+                m_currentEntry = NULL;
+                m_state = PS_GLOBAL;
+                break;
+
+            case PxeFile::KW_INCLUDE: {
+                PxeFileMap::const_iterator include = files.find(argument);
+                if (include == files.end())
+                    BW_DEBUG_INFO("Ignoring missing include file %s", argument.c_str());
+                else if (depth >= MAX_INCLUDE_DEPTH)
+                    BW_DEBUG_INFO("Ignoring %s, includes are nested too deep",
+                                  argument.c_str());
+                else
+                    apply(include->second, files, texts, depth + 1);
+                break;
+            }
+
+            case PxeFile::KW_DISPLAY: {
+                PxeTextMap::const_iterator text = texts.find(argument);
+                if (text == texts.end())
+                    BW_DEBUG_INFO("Ignoring missing display file %s", argument.c_str());
+                else
+                    menu.addMessage(display_text(text->second));
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void PxeParser::buildConfig(const PxeFileMap &files, const PxeTextMap &texts)
+{
+    m_menus.assign(1, &m_config);
+    apply(m_file, files, texts, 0);
+    m_menus.clear();
+
+    if (m_currentEntry)
+        BW_DEBUG_TRACE("Last entry: label=%s, kernel=%s, append=%s",
+                       m_currentEntry->getLabel().c_str(),
+                       m_currentEntry->getKernel().c_str(),
+                       m_currentEntry->getAppend().c_str());
+
+    m_currentEntry = NULL;
+    m_state = PS_GLOBAL;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+PxeFile &PxeParser::getFile()
+{
+    return m_file;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+PxeConfig &PxeParser::getConfig()
+{
+    return m_config;
 }
 
 /* ---------------------------------------------------------------------------------------------- */
-PxeConfig PxeParser::getConfig() const
+const PxeConfig &PxeParser::getConfig() const
 {
     return m_config;
 }
@@ -28,16 +28,26 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include <iostream>
+#include <tr1/unordered_map>
+#include <tr1/memory>
 
 #include "global.h"
 
+class PxeConfig;
+
 /* PxeEntry {{{ */
 
 /**
  * @brief Entry in the PXE configuration
  *
- * This class represents an entry in a PXE configuration file.
+ * This class represents an entry in a PXE configuration file. Besides
+ * entries that boot a kernel, there are two kinds of menu entries: a submenu
+ * (<tt>MENU BEGIN</tt> ... <tt>MENU END</tt>) that is part of the same
+ * configuration file, and a chained configuration file (@c CONFIG or a
+ * @c KERNEL that is a configuration file), which is only downloaded when
+ * it's opened.
  *
  * @author Bernhard Walle <bernhard@bwalle.de>
  */
@@ -86,7 +96,7 @@ class PxeEntry {
          *
          * @return the label
          */
-        std::string getLabel() const;
+        const std::string &getLabel() const;
 
         /**
          * @brief Returns the kernel of the PxeEntry
@@ -95,7 +105,7 @@ class PxeEntry {
          *
          * @return the kernel
          */
-        std::string getKernel() const;
+        const std::string &getKernel() const;
 
         /**
          * @brief Sets the kernel of the PxeEntry
@@ -113,7 +123,7 @@ class PxeEntry {
          *
          * @return the append line
          */
-        std::string getAppend() const;
+        const std::string &getAppend() const;
 
         /**
          * @brief Returns the initrd
@@ -125,6 +135,18 @@ class PxeEntry {
          */
         std::string getInitrd();
 
+        /**
+         * @brief Returns all initrds
+         *
+         * Like pxelinux, more than one initrd can be specified, separated by
+         * commas, e.g. <tt>initrd=initrd.img,firmware.img</tt>. This
+         * function returns that list.
+         *
+         * @return the list of initrds, empty if there is no <tt>initrd=</tt>
+         *         parameter in the append line
+         */
+        StringVector getInitrds();
+
         /**
          * @brief Sets the append line
          *
@@ -134,6 +156,42 @@ class PxeEntry {
          */
         void setAppend(const std::string &append);
 
+        /**
+         * @brief Checks if the entry opens a menu
+         *
+         * @return @c true for submenus and chained configuration files
+         */
+        bool isMenu() const;
+
+        /**
+         * @brief Returns the submenu
+         *
+         * @return the submenu or @c NULL if the entry is no submenu
+         */
+        PxeConfig *getSubmenu() const;
+
+        /**
+         * @brief Makes the entry a submenu
+         *
+         * @param[in] submenu the entries of the submenu
+         */
+        void setSubmenu(const std::tr1::shared_ptr<PxeConfig> &submenu);
+
+        /**
+         * @brief Returns the chained configuration file
+         *
+         * @return the file name as specified in the PXE configuration or
+         *         the empty string if the entry is no chained configuration
+         */
+        const std::string &getConfig() const;
+
+        /**
+         * @brief Makes the entry a chained configuration file
+         *
+         * @param[in] config the file name as specified in the PXE configuration
+         */
+        void setConfig(const std::string &config);
+
     private:
         bool m_valid;
         std::string m_label;
@@ -141,6 +199,8 @@ class PxeEntry {
         std::string m_initrd;
         std::string m_append;
         bool m_initrdParsed;
+        std::tr1::shared_ptr<PxeConfig> m_submenu;
+        std::string m_config;
 };
 
 /* }}} */
@@ -153,10 +213,20 @@ class PxeEntry {
  * parameters like the message or the default entry. And it has a number of
  * PxeEntry entries.
  *
+ * The entries are indexed by their label (case-insensitive), so getEntry()
+ * doesn't depend on the number of entries.
+ *
  * @author Bernhard Walle <bernhard@bwalle.de>
  */
 class PxeConfig {
     public:
+        /**
+         * @brief Constructor
+         *
+         * Creates an empty PxeConfig.
+         */
+        PxeConfig();
+
         /**
          * @brief Destructor
          *
@@ -204,14 +274,64 @@ class PxeConfig {
          */
         void setDefault(const std::string &def);
 
+        /**
+         * @brief Returns the time after which an entry is booted
+         *
+         * @return the time in 1/10 seconds, 0 means no timeout
+         */
+        int getTimeout() const;
+
+        /**
+         * @brief Sets the time after which an entry is booted
+         *
+         * The timeout (@c TIMEOUT) is cancelled when a key is pressed.
+         *
+         * @param[in] timeout the time in 1/10 seconds
+         */
+        void setTimeout(int timeout);
+
+        /**
+         * @brief Returns the time after which an entry is booted anyway
+         *
+         * @return the time in 1/10 seconds, 0 means no timeout
+         */
+        int getTotalTimeout() const;
+
+        /**
+         * @brief Sets the time after which an entry is booted anyway
+         *
+         * Unlike the timeout, the total timeout (@c TOTALTIMEOUT) is not
+         * cancelled by pressing a key.
+         *
+         * @param[in] timeout the time in 1/10 seconds
+         */
+        void setTotalTimeout(int timeout);
+
+        /**
+         * @brief Returns the entry that is booted after the timeout
+         *
+         * @return the @c ONTIMEOUT entry or the empty string if the default
+         *         entry is booted
+         */
+        std::string getOnTimeout() const;
+
+        /**
+         * @brief Sets the entry that is booted after the timeout
+         *
+         * @param[in] ontimeout the entry as specified with @c ONTIMEOUT
+         */
+        void setOnTimeout(const std::string &ontimeout);
+
         /**
          * @brief Add a PXE entry
          *
          * Adds a PxeEntry object to the list of entries.
          *
          * @param[in] entry the entry to add
+         * @return the added entry, the reference is valid until the next
+         *         call of addEntry()
          */
-        void addEntry(PxeEntry entry);
+        PxeEntry &addEntry(const PxeEntry &entry);
 
         /**
          * @brief Returns a list of entries
@@ -220,7 +340,7 @@ class PxeConfig {
          *
          * @return the vector of entries
          */
-        std::vector<PxeEntry> getEntries() const;
+        const std::vector<PxeEntry> &getEntries() const;
 
         /**
          * @brief Returns a list of entry names
@@ -229,32 +349,208 @@ class PxeConfig {
          *
          * @return the list
          */
-        std::vector<std::string> getEntryNames() const;
+        const StringVector &getEntryNames() const;
 
         /**
          * @brief Returns a named entry object
          *
-         * Searches the entry with label @p label and returns the object on
-         * success. Returns a invalid PxeEntry object on failure.
+         * Searches the entry with label @p label (case-insensitive) and
+         * returns the object on success. Returns a invalid PxeEntry object
+         * on failure. If more than one entry has that label, the first one
+         * is returned.
          *
-         * @return a PxeEntry object
+         * @return a PxeEntry object, the reference is valid until the next
+         *         call of addEntry()
          */
-        PxeEntry getEntry(const std::string &label) const;
+        const PxeEntry &getEntry(const std::string &label) const;
+
+        /**
+         * @brief Exchanges the content of two configurations
+         *
+         * @param[in,out] other the other configuration
+         */
+        void swap(PxeConfig &other);
+
+    private:
+        /**
+         * @brief Case-insensitive hash function for labels
+         */
+        struct LabelHash {
+            size_t operator()(const std::string &label) const;
+        };
+
+        /**
+         * @brief Case-insensitive comparison of labels
+         */
+        struct LabelEqual {
+            bool operator()(const std::string &a, const std::string &b) const;
+        };
+
+        typedef std::tr1::unordered_map<std::string, size_t, LabelHash, LabelEqual> LabelIndex;
 
     private:
         std::string m_message;
         std::string m_default;
+        std::string m_onTimeout;
+        int m_timeout;
+        int m_totalTimeout;
         std::string m_entry;
         std::vector<PxeEntry> m_entries;
+        StringVector m_entryNames;
+        LabelIndex m_index;
+};
+
+/* }}} */
+/* PxeFile {{{ */
+
+/**
+ * @brief Tokenized PXE configuration file
+ *
+ * Contains the statements of one configuration file that matter for
+ * pxe-kexec, in the order of the file. Comments and unknown keywords are
+ * dropped. The file keeps its text, and the statements only refer to their
+ * arguments in it, so tokenizing doesn't allocate per statement. Included
+ * files are kept as separate PxeFile objects and
+ * referenced by name, so a file that is included several times is only
+ * downloaded and tokenized once.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class PxeFile {
+    public:
+        /**
+         * @brief Keyword of a statement
+         */
+        enum Keyword {
+            KW_NONE,            /**< unknown keyword, not stored */
+            KW_SAY,             /**< @c SAY text */
+            KW_LABEL,           /**< @c LABEL name */
+            KW_KERNEL,          /**< @c KERNEL image */
+            KW_APPEND,          /**< @c APPEND options */
+            KW_DEFAULT,         /**< @c DEFAULT label */
+            KW_INCLUDE,         /**< @c INCLUDE file or <tt>MENU INCLUDE</tt> file */
+            KW_DISPLAY,         /**< @c DISPLAY file */
+            KW_CONFIG,          /**< @c CONFIG file */
+            KW_TIMEOUT,         /**< @c TIMEOUT 1/10 seconds */
+            KW_TOTALTIMEOUT,    /**< @c TOTALTIMEOUT 1/10 seconds */
+            KW_ONTIMEOUT,       /**< @c ONTIMEOUT label */
+            KW_MENU,            /**< prefix of the @c MENU keywords, not stored */
+            KW_MENU_DEFAULT,    /**< <tt>MENU DEFAULT</tt> */
+            KW_MENU_BEGIN,      /**< <tt>MENU BEGIN</tt> name */
+            KW_MENU_END         /**< <tt>MENU END</tt> */
+        };
+
+        /**
+         * @brief One statement
+         */
+        struct Statement {
+            Keyword         keyword;    /**< the keyword */
+            size_t          offset;     /**< start of the argument in the text */
+            size_t          length;     /**< length of the argument */
+        };
+
+        /**
+         * @brief Vector of statements
+         */
+        typedef std::vector<Statement> StatementVector;
+
+    public:
+        /**
+         * @brief Appends text to the file
+         *
+         * @param[in] buffer the text
+         * @param[in] len the number of bytes in @p buffer
+         */
+        void appendText(const char *buffer, size_t len);
+
+        /**
+         * @brief Returns the text of the file
+         *
+         * @return everything that has been appended with appendText()
+         */
+        const std::string &getText() const;
+
+        /**
+         * @brief Adds a statement
+         *
+         * @param[in] keyword the keyword
+         * @param[in] offset the start of the argument in getText()
+         * @param[in] length the length of the argument
+         */
+        void add(Keyword keyword, size_t offset, size_t length);
+
+        /**
+         * @brief Returns the argument of a statement
+         *
+         * @param[in] statement a statement of this file
+         * @return a copy of the argument
+         */
+        std::string getArgument(const Statement &statement) const;
+
+        /**
+         * @brief Returns the statements
+         *
+         * @return the statements in the order of the file
+         */
+        const StatementVector &getStatements() const;
+
+        /**
+         * @brief Returns the included configuration files
+         *
+         * @return the names of the files of all @c INCLUDE and <tt>MENU
+         *         INCLUDE</tt> statements, without duplicates
+         */
+        StringVector getIncludes() const;
+
+        /**
+         * @brief Returns the displayed text files
+         *
+         * @return the names of the files of all @c DISPLAY statements,
+         *         without duplicates
+         */
+        StringVector getDisplays() const;
+
+        /**
+         * @brief Exchanges the content of two files
+         *
+         * @param[in,out] other the other file
+         */
+        void swap(PxeFile &other);
+
+    private:
+        StringVector getArguments(Keyword keyword) const;
+
+    private:
+        std::string     m_text;
+        StatementVector m_statements;
 };
 
+/**
+ * @brief Included configuration files by name
+ */
+typedef std::map<std::string, PxeFile> PxeFileMap;
+
+/**
+ * @brief Displayed text files by name
+ */
+typedef std::map<std::string, std::string> PxeTextMap;
+
 /* }}} */
 /* PxeParser {{{ */
 
 /**
  * @brief PXE configuration file parser
  *
- * Parses a PXE configuration file.
+ * Parses a PXE configuration file in two steps. First, the lines are
+ * tokenized into a PxeFile. The data is appended to the text of the PxeFile
+ * and the lines are parsed in place; the arguments are only copied when
+ * buildConfig() creates the entries. Keywords are looked up in a hash table.
+ *
+ * Then buildConfig() creates the PxeConfig from the statements and inserts
+ * the included files at the position of their @c INCLUDE statement. The
+ * caller has to download the included files with another PxeParser each;
+ * see PxeFile::getIncludes() and PxeFile::getDisplays(). Chained
+ * configuration files are not downloaded, see PxeEntry::getConfig().
  *
  * @author Bernhard Walle <bernhard@bwalle.de>
  */
@@ -291,20 +587,89 @@ class PxeParser {
          * @param[in] line the input line
          * @exception ParseError if parsing of @p line failed
          */
-        void feedLine(std::string line)
+        void feedLine(const std::string &line)
+            throw (ParseError);
+
+        /**
+         * @brief Feeds the parser with a line
+         *
+         * Feeds the parser with the line from @p begin to @p end (exclusive,
+         * without the newline). The line is appended to the text of the file.
+         *
+         * @param[in] begin the first character of the line
+         * @param[in] end the end of the line
+         * @exception ParseError if parsing of the line failed
+         */
+        void feedLine(const char *begin, const char *end)
+            throw (ParseError);
+
+        /**
+         * @brief Feeds the parser with a chunk of the file
+         *
+         * Appends the chunk to the text of the file and parses all lines
+         * that are complete now. A line that continues in the next chunk is
+         * parsed when the rest arrives (or when finishParsing() is called),
+         * so the chunks may be split anywhere.
+         *
+         * @param[in] buffer the data
+         * @param[in] len the number of bytes in @p buffer
+         * @exception ParseError if parsing of a line failed
+         */
+        void feed(const char *buffer, size_t len)
             throw (ParseError);
 
         /**
          * @brief Finishes parsing
          *
-         * Tells the parser that we're now done.
+         * Tells the parser that we're now done. Parses the last line
+         * that has been passed to feed() if it had no newline. After that,
+         * getFile() contains all statements of the file.
+         *
+         * @exception ParseError if parsing of that line failed
          */
-        void finishParsing();
+        void finishParsing()
+            throw (ParseError);
+
+        /**
+         * @brief Creates the configuration
+         *
+         * Creates the configuration from the statements of the file. Each
+         * @c INCLUDE is replaced by the statements of the included file, and
+         * the text of each @c DISPLAY file is added to the message. Missing
+         * files are ignored like pxelinux does.
+         *
+         * @param[in] files the included configuration files
+         * @param[in] texts the displayed text files
+         */
+        void buildConfig(const PxeFileMap &files, const PxeTextMap &texts);
+
+        /**
+         * @brief Returns the tokenized file
+         *
+         * @return the statements that have been parsed so far
+         */
+        PxeFile &getFile();
+
+        /**
+         * @brief Parses a buffer
+         *
+         * Parses a complete configuration file that is in memory, finishes
+         * parsing and creates the configuration without included files. The
+         * buffer is copied, so it is only needed while this function runs.
+         *
+         * @param[in] buffer the content of the configuration file
+         * @param[in] len the number of bytes in @p buffer
+         * @exception ParseError on a parser error
+         */
+        void parseBuffer(const char *buffer, size_t len)
+            throw (ParseError);
 
         /**
          * @brief Parses a stream
          *
-         * Parses a complete stream, repeatedly calling feedLine().
+         * Reads the stream in chunks and parses it with feed(), so the
+         * lines are parsed while the stream is read. Like parseBuffer(),
+         * included files are not used.
          *
          * @param[in] stream the stream that should be parsed
          * @exception ParseError on a parser error
@@ -315,18 +680,36 @@ class PxeParser {
         /**
          * @brief Returns the PXE config
          *
-         * If parsing has been finished, returns the completely parsed PXE
-         * configuration.
+         * If the configuration has been created with buildConfig(), returns
+         * the completely parsed PXE configuration. Use PxeConfig::swap() to
+         * take it without a copy.
          *
          * @return the parsed PxeConfig or a invalid PxeConfig if parsing
          *         failed
          */
-        PxeConfig getConfig() const;
+        PxeConfig &getConfig();
+
+        /**
+         * @copydoc getConfig()
+         */
+        const PxeConfig &getConfig() const;
+
+    private:
+        PxeParser(const PxeParser &);
+        PxeParser &operator=(const PxeParser &);
+
+        void parseLine(size_t begin, size_t end)
+            throw (ParseError);
+        void apply(const PxeFile &file, const PxeFileMap &files, const PxeTextMap &texts,
+                   int depth);
 
     private:
+        PxeFile m_file;
         PxeConfig m_config;
-        PxeEntry m_currentEntry;
+        std::vector<PxeConfig *> m_menus;
+        PxeEntry *m_currentEntry;
         ParserState m_state;
+        size_t m_lineStart;
 };
 
 /* }}} */
@@ -0,0 +1,337 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libbw/debug.h>
+
+#include "serverhistory.h"
+
+// longer than an interface name, so it cannot clash with the files of the
+// dhclient hook script
+#define HISTORY_FILE        "server-history"
+#define LOCK_FILE           "server-history.lock"
+
+// weight of the last run in the moving averages
+#define AVERAGE_WEIGHT      0.3
+
+// smaller transfers don't tell anything about the throughput
+#define MIN_THROUGHPUT_SIZE (1024LL * 1024)
+
+// the size of a typical kernel and initrd, to weigh latency and throughput
+#define TYPICAL_SIZE        (64.0 * 1024 * 1024)
+
+#define MAX_ENTRIES         64
+
+/* ---------------------------------------------------------------------------------------------- */
+static double average(double old, double value)
+{
+    if (old < 0)
+        return value;
+
+    return old * (1.0 - AVERAGE_WEIGHT) + value * AVERAGE_WEIGHT;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static double estimated_time(const ServerHistory::Entry &entry)
+{
+    double time = 0.0;
+
+    if (entry.connectTime > 0)
+        time += entry.connectTime;
+    if (entry.firstByteTime > 0)
+        time += entry.firstByteTime;
+    if (entry.throughput > 0)
+        time += TYPICAL_SIZE / entry.throughput;
+
+    return time;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static bool used_later(const ServerHistory::Entry &a, const ServerHistory::Entry &b)
+{
+    return a.lastUsed > b.lastUsed;
+}
+
+/**
+ * @brief Orders servers by their history
+ */
+struct RankOrder {
+    const ServerHistory::EntryVector &entries;
+
+    RankOrder(const ServerHistory::EntryVector &e) : entries(e) {}
+
+    bool operator()(size_t a, size_t b) const
+    {
+        if (entries[a].failureStreak != entries[b].failureStreak)
+            return entries[a].failureStreak < entries[b].failureStreak;
+
+        return estimated_time(entries[a]) < estimated_time(entries[b]);
+    }
+};
+
+/* ServerHistory {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+ServerHistory::ServerHistory(const std::string &directory)
+    : m_directory(directory)
+{}
+
+/* ---------------------------------------------------------------------------------------------- */
+ServerHistory::~ServerHistory()
+{}
+
+/* ---------------------------------------------------------------------------------------------- */
+int ServerHistory::lock() const
+{
+    if (mkdir(m_directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        BW_DEBUG_INFO("Cannot create %s: %s", m_directory.c_str(), std::strerror(errno));
+        return -1;
+    }
+
+    // one file descriptor per call, the background download thread records, too
+    std::string path = m_directory + "/" LOCK_FILE;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        BW_DEBUG_INFO("Cannot open %s: %s", path.c_str(), std::strerror(errno));
+        return -1;
+    }
+
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno == EINTR)
+            continue;
+
+        BW_DEBUG_INFO("Cannot lock %s: %s", path.c_str(), std::strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+ServerHistory::EntryVector ServerHistory::readFile() const
+{
+    EntryVector entries;
+    std::ifstream fin((m_directory + "/" HISTORY_FILE).c_str());
+    std::string line;
+
+    while (std::getline(fin, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::stringstream ss(line);
+        Entry entry;
+        if (!std::getline(ss, entry.server, '\t') ||
+                !(ss >> entry.connectTime >> entry.firstByteTime >> entry.throughput
+                     >> entry.successes >> entry.failures >> entry.failureStreak
+                     >> entry.lastUsed)) {
+            BW_DEBUG_INFO("Ignoring invalid server history line '%s'", line.c_str());
+            continue;
+        }
+
+        entries.push_back(entry);
+    }
+
+    return entries;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ServerHistory::writeFile(EntryVector &entries) const
+{
+    std::string path = m_directory + "/" HISTORY_FILE;
+    std::string tmppath = path + ".new";
+
+    // servers that are gone are forgotten eventually
+    std::stable_sort(entries.begin(), entries.end(), used_later);
+    if (entries.size() > MAX_ENTRIES)
+        entries.resize(MAX_ENTRIES);
+
+    std::ofstream fout(tmppath.c_str());
+    fout << "# pxe-kexec server history: server, connect time, first byte time, "
+            "throughput, successes, failures, failures since the last success, last use"
+         << std::endl;
+    for (EntryVector::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        fout << it->server << '\t' << it->connectTime << '\t' << it->firstByteTime << '\t'
+             << it->throughput << '\t' << it->successes << '\t' << it->failures << '\t'
+             << it->failureStreak << '\t' << it->lastUsed << std::endl;
+    fout.close();
+
+    if (!fout || rename(tmppath.c_str(), path.c_str()) != 0) {
+        BW_DEBUG_INFO("Cannot write server history %s", path.c_str());
+        remove(tmppath.c_str());
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+ServerHistory::Entry &ServerHistory::findEntry(EntryVector &entries,
+                                               const std::string &server) const
+{
+    for (EntryVector::iterator it = entries.begin(); it != entries.end(); ++it)
+        if (it->server == server)
+            return *it;
+
+    Entry entry;
+    entry.server = server;
+    entry.connectTime = -1.0;
+    entry.firstByteTime = -1.0;
+    entry.throughput = -1.0;
+    entry.successes = 0;
+    entry.failures = 0;
+    entry.failureStreak = 0;
+    entry.lastUsed = 0;
+    entries.push_back(entry);
+
+    return entries.back();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ServerHistory::recordSuccess(const std::string &server,
+                                  const Downloader::Statistics &statistics)
+{
+    // that would break the file
+    if (server.find_first_of("\t\n") != std::string::npos)
+        return;
+
+    int fd = lock();
+    if (fd < 0)
+        return;
+
+    EntryVector entries = readFile();
+    Entry &entry = findEntry(entries, server);
+
+    if (statistics.connectTime >= 0)
+        entry.connectTime = average(entry.connectTime, statistics.connectTime);
+    if (statistics.firstByteTime >= 0)
+        entry.firstByteTime = average(entry.firstByteTime, statistics.firstByteTime);
+
+    double seconds = statistics.totalTime - std::max(statistics.firstByteTime, 0.0);
+    if (statistics.bytes >= MIN_THROUGHPUT_SIZE && seconds > 0)
+        entry.throughput = average(entry.throughput, statistics.bytes / seconds);
+
+    entry.successes++;
+    entry.failureStreak = 0;
+    entry.lastUsed = std::time(NULL);
+
+    BW_DEBUG_DBG("History of %s: connect %.3f s, first byte %.3f s, %.0f bytes/s",
+                 server.c_str(), entry.connectTime, entry.firstByteTime, entry.throughput);
+
+    writeFile(entries);
+    close(fd);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ServerHistory::recordFailure(const std::string &server)
+{
+    if (server.find_first_of("\t\n") != std::string::npos)
+        return;
+
+    int fd = lock();
+    if (fd < 0)
+        return;
+
+    EntryVector entries = readFile();
+    Entry &entry = findEntry(entries, server);
+
+    entry.failures++;
+    entry.failureStreak++;
+    entry.lastUsed = std::time(NULL);
+
+    BW_DEBUG_DBG("History of %s: %lu failures in a row", server.c_str(), entry.failureStreak);
+
+    writeFile(entries);
+    close(fd);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void ServerHistory::recordLatency(const std::string &server,
+                                  const Downloader::Statistics &statistics)
+{
+    if (server.find_first_of("\t\n") != std::string::npos)
+        return;
+    if (statistics.connectTime < 0 && statistics.firstByteTime < 0)
+        return;
+
+    int fd = lock();
+    if (fd < 0)
+        return;
+
+    EntryVector entries = readFile();
+    Entry &entry = findEntry(entries, server);
+
+    if (statistics.connectTime >= 0)
+        entry.connectTime = average(entry.connectTime, statistics.connectTime);
+    if (statistics.firstByteTime >= 0)
+        entry.firstByteTime = average(entry.firstByteTime, statistics.firstByteTime);
+    entry.lastUsed = std::time(NULL);
+
+    BW_DEBUG_DBG("History of %s: connect %.3f s, first byte %.3f s",
+                 server.c_str(), entry.connectTime, entry.firstByteTime);
+
+    writeFile(entries);
+    close(fd);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+StringVector ServerHistory::rank(const StringVector &servers) const
+{
+    // the file is replaced atomically, so reading doesn't need the lock
+    EntryVector history = readFile();
+    EntryVector entries;
+    std::vector<size_t> order;
+
+    for (size_t i = 0; i < servers.size(); i++) {
+        entries.push_back(findEntry(history, servers[i]));
+        order.push_back(i);
+    }
+
+    std::stable_sort(order.begin(), order.end(), RankOrder(entries));
+
+    StringVector ranked;
+    for (size_t i = 0; i < order.size(); i++)
+        ranked.push_back(servers[order[i]]);
+
+    return ranked;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+ServerHistory::EntryVector ServerHistory::getEntries() const
+{
+    EntryVector entries = readFile();
+
+    std::stable_sort(entries.begin(), entries.end(), used_later);
+
+    return entries;
+}
+
+/* }}} */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
@@ -0,0 +1,159 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SERVERHISTORY_H
+#define SERVERHISTORY_H
+
+/**
+ * @file serverhistory.h
+ * @brief Persistent statistics of the boot servers
+ *
+ * This file contains the history of the boot servers that is used to try
+ * the fastest and most reliable server first.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <string>
+#include <vector>
+#include <ctime>
+
+#include "global.h"
+#include "downloader.h"
+
+/* ServerHistory {{{ */
+
+/**
+ * @brief History of the boot servers
+ *
+ * For each server, the history keeps the connect time, the time until the
+ * first byte arrived and the throughput of past runs (as moving averages, so
+ * that the history follows changes of the network) and how often
+ * downloading from the server succeeded or failed.
+ *
+ * The history is a text file in the state directory, next to the files that
+ * the dhclient hook script writes there. Several instances may update it at
+ * the same time. Like for the ImageCache, errors never propagate to the
+ * caller: without a history, the servers are simply used in the specified
+ * order.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class ServerHistory {
+    public:
+        /**
+         * @brief Statistics of one server
+         */
+        struct Entry {
+            std::string     server;         /**< the server as specified by the user */
+            double          connectTime;    /**< seconds, negative if unknown */
+            double          firstByteTime;  /**< seconds, negative if unknown */
+            double          throughput;     /**< bytes per second, negative if unknown */
+            unsigned long   successes;      /**< number of successful downloads */
+            unsigned long   failures;       /**< number of failed downloads */
+            unsigned long   failureStreak;  /**< failures since the last success */
+            time_t          lastUsed;       /**< time of the last download */
+        };
+
+        /**
+         * @brief Vector of entries
+         */
+        typedef std::vector<Entry> EntryVector;
+
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Creates a new ServerHistory. The directory is created when the
+         * history is written the first time.
+         *
+         * @param[in] directory the state directory
+         */
+        ServerHistory(const std::string &directory);
+
+        /**
+         * @brief Destructor
+         *
+         * Deletes a ServerHistory.
+         */
+        virtual ~ServerHistory();
+
+    public:
+        /**
+         * @brief Records a successful download
+         *
+         * The throughput is only updated for transfers that are large
+         * enough to measure it, small files only tell the latency.
+         *
+         * @param[in] server the server
+         * @param[in] statistics the timing of the download
+         */
+        void recordSuccess(const std::string &server, const Downloader::Statistics &statistics);
+
+        /**
+         * @brief Records a failed download
+         *
+         * @param[in] server the server
+         */
+        void recordFailure(const std::string &server);
+
+        /**
+         * @brief Records the response time of a server
+         *
+         * Only updates the connect and first byte times that have been
+         * measured, e.g. for a transfer that has been cancelled. Neither the
+         * successes nor the failures are counted.
+         *
+         * @param[in] server the server
+         * @param[in] statistics the timing of the (partial) transfer
+         */
+        void recordLatency(const std::string &server, const Downloader::Statistics &statistics);
+
+        /**
+         * @brief Sorts servers by their history
+         *
+         * Servers that failed the last time(s) come last, the others are
+         * sorted by the estimated time to download a typical kernel and
+         * initrd. Servers without history are tried first, so that they get
+         * a history, and otherwise keep their order.
+         *
+         * @param[in] servers the servers
+         * @return the sorted servers
+         */
+        StringVector rank(const StringVector &servers) const;
+
+        /**
+         * @brief Returns the history
+         *
+         * @return the entries of all servers, the most recently used first
+         */
+        EntryVector getEntries() const;
+
+    protected:
+        int lock() const;
+        EntryVector readFile() const;
+        void writeFile(EntryVector &entries) const;
+        Entry &findEntry(EntryVector &entries, const std::string &server) const;
+
+    private:
+        std::string     m_directory;
+};
+
+/* }}} */
+
+#endif /* SERVERHISTORY_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
@@ -0,0 +1,93 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SHA256_H
+#define SHA256_H
+
+/**
+ * @file sha256.h
+ * @brief SHA-256 implementation
+ *
+ * This file contains a small SHA-256 implementation (FIPS 180-2) that is
+ * used to verify cached images. We don't want to depend on a crypto library
+ * just for that.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <string>
+#include <stdint.h>
+
+/* Sha256 {{{ */
+
+/**
+ * @brief Computes SHA-256 checksums
+ *
+ * Example:
+ *
+ * @code
+ * Sha256 sha;
+ * sha.update(buffer, len);
+ * std::string checksum = sha.getHexDigest();
+ * @endcode
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class Sha256 {
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Creates a new Sha256 object without data.
+         */
+        Sha256();
+
+    public:
+        /**
+         * @brief Adds data
+         *
+         * Adds @p len bytes of @p data to the checksum.
+         *
+         * @param[in] data the data
+         * @param[in] len the number of bytes in @p data
+         */
+        void update(const void *data, size_t len);
+
+        /**
+         * @brief Returns the checksum
+         *
+         * Finishes the computation and returns the checksum. After that
+         * function has been called, update() must not be called any more.
+         *
+         * @return the checksum as 64 lowercase hexadecimal digits
+         */
+        std::string getHexDigest();
+
+    protected:
+        void transform(const unsigned char *block);
+
+    private:
+        uint32_t        m_state[8];
+        uint64_t        m_length;
+        unsigned char   m_buffer[64];
+        size_t          m_bufferLen;
+};
+
+/* }}} */
+
+#endif /* SHA256_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
@@ -0,0 +1,652 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <libbw/clock.h>
+#include <libbw/debug.h>
+#include <libbw/stringutil.h>
+
+#include "tftp.h"
+
+#define TFTP_RRQ                1
+#define TFTP_DATA               3
+#define TFTP_ACK                4
+#define TFTP_ERROR              5
+#define TFTP_OACK               6
+
+#define TFTP_EUNDEF             0
+#define TFTP_EACCESS            2
+#define TFTP_EDISKFULL          3
+#define TFTP_EBADOP             4
+#define TFTP_EBADID             5
+#define TFTP_EOPTNEG            8
+
+#define TFTP_DEFAULT_BLOCKSIZE  512
+#define TFTP_MAX_BLOCKSIZE      65464
+#define TFTP_RETRANSMIT_MS      1000
+#define TFTP_MAX_RETRIES        5
+
+/* Helper functions {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string url_decode(const std::string &str)
+{
+    std::string ret;
+
+    for (std::string::size_type i = 0; i < str.size(); i++) {
+        if (str[i] == '%' && i + 2 < str.size()) {
+            ret += char(std::strtol(str.substr(i+1, 2).c_str(), NULL, 16));
+            i += 2;
+        } else
+            ret += str[i];
+    }
+
+    return ret;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void append_option(std::string &packet, const std::string &name, unsigned long value)
+{
+    std::stringstream ss;
+    ss << value;
+
+    packet += name;
+    packet += '\0';
+    packet += ss.str();
+    packet += '\0';
+}
+
+/* }}} */
+/* TftpClient {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+bool TftpClient::isTftpUrl(const std::string &url)
+{
+    return bw::startsWith(url, "tftp://", false);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+TftpClient::TftpClient(const std::string &url)
+    throw (DownloadError)
+    : m_port("69")
+    , m_socket(-1)
+    , m_state(S_INIT)
+    , m_serverLen(0)
+    , m_peerLen(0)
+    , m_useOptions(true)
+    , m_sizeOnly(false)
+    , m_requestedBlockSize(TFTP_DEFAULT_BLOCKSIZE)
+    , m_requestedWindowSize(1)
+    , m_blockSize(TFTP_DEFAULT_BLOCKSIZE)
+    , m_windowSize(1)
+    , m_lastBlock(0)
+    , m_windowBlocks(0)
+    , m_outOfOrderAcked(false)
+    , m_retries(0)
+    , m_deadline(0)
+    , m_transferSize(-1)
+    , m_received(0)
+    , m_startTime(0)
+    , m_resolveTime(0)
+    , m_answerTime(0)
+    , m_retransmits(0)
+    , m_writeFunction(NULL)
+    , m_writeData(NULL)
+    , m_progressFunction(NULL)
+    , m_progressData(NULL)
+{
+    if (!isTftpUrl(url))
+        throw DownloadError("Not a TFTP URL: " + url);
+
+    std::string rest = url.substr(std::strlen("tftp://"));
+    std::string::size_type slash = rest.find('/');
+    if (slash == std::string::npos)
+        throw DownloadError("No file name in TFTP URL: " + url);
+
+    m_host = rest.substr(0, slash);
+    m_file = url_decode(rest.substr(slash + 1));
+
+    // strip the transfer mode, we always use octet
+    std::string::size_type mode = m_file.find(";mode=");
+    if (mode != std::string::npos)
+        m_file = m_file.substr(0, mode);
+
+    // [ipv6]:port or host:port
+    std::string::size_type colon = m_host.rfind(':');
+    if (colon != std::string::npos && m_host.find(']', colon) == std::string::npos) {
+        m_port = m_host.substr(colon + 1);
+        m_host = m_host.substr(0, colon);
+    }
+    if (m_host.size() > 1 && m_host[0] == '[' && m_host[m_host.size()-1] == ']')
+        m_host = m_host.substr(1, m_host.size() - 2);
+
+    if (m_host.empty() || m_file.empty())
+        throw DownloadError("Invalid TFTP URL: " + url);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+TftpClient::~TftpClient()
+{
+    cancel();
+
+    if (m_socket >= 0)
+        close(m_socket);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::setBlockSize(unsigned int blocksize)
+{
+    if (blocksize < 8)
+        blocksize = 8;
+    if (blocksize > TFTP_MAX_BLOCKSIZE)
+        blocksize = TFTP_MAX_BLOCKSIZE;
+
+    m_requestedBlockSize = blocksize;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::setWindowSize(unsigned int windowsize)
+{
+    if (windowsize < 1)
+        windowsize = 1;
+    if (windowsize > 65535)
+        windowsize = 65535;
+
+    m_requestedWindowSize = windowsize;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::setSizeOnly(bool sizeOnly)
+{
+    m_sizeOnly = sizeOnly;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::setWriteFunction(WriteFunction function, void *data)
+{
+    m_writeFunction = function;
+    m_writeData = data;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::setProgressFunction(ProgressFunction function, void *data)
+{
+    m_progressFunction = function;
+    m_progressData = data;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+int TftpClient::getSocket() const
+{
+    return m_socket;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+long TftpClient::getTimeout() const
+{
+    long long now = bw::monotonicMs();
+
+    return m_deadline > now ? long(m_deadline - now) : 0;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned int TftpClient::getBlockSize() const
+{
+    return m_blockSize;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned int TftpClient::getWindowSize() const
+{
+    return m_windowSize;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+long long TftpClient::getTransferSize() const
+{
+    return m_transferSize;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+long long TftpClient::getBytesReceived() const
+{
+    return m_received;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+double TftpClient::getResolveTime() const
+{
+    return m_resolveTime > 0 ? (m_resolveTime - m_startTime) / 1e6 : -1.0;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+double TftpClient::getAnswerTime() const
+{
+    return m_answerTime > 0 ? (m_answerTime - m_startTime) / 1e6 : -1.0;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned int TftpClient::getRetransmits() const
+{
+    return m_retransmits;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::start()
+    throw (DownloadError)
+{
+    struct addrinfo hints, *result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    BW_DEBUG_DBG("TFTP: Resolving %s:%s", m_host.c_str(), m_port.c_str());
+    m_startTime = bw::monotonicUs();
+    int err = getaddrinfo(m_host.c_str(), m_port.c_str(), &hints, &result);
+    m_resolveTime = bw::monotonicUs();
+    if (err != 0) {
+        DownloadError error("Cannot resolve " + m_host + ": " + gai_strerror(err));
+        error.setErrorcode(DownloadError::DEC_CONNECTION_FAILED);
+        throw error;
+    }
+
+    m_socket = socket(result->ai_family, SOCK_DGRAM, 0);
+    if (m_socket < 0) {
+        freeaddrinfo(result);
+        throw DownloadError(std::string("socket() failed: ") + std::strerror(errno));
+    }
+    fcntl(m_socket, F_SETFL, fcntl(m_socket, F_GETFL) | O_NONBLOCK);
+    fcntl(m_socket, F_SETFD, FD_CLOEXEC);
+
+    memcpy(&m_server, result->ai_addr, result->ai_addrlen);
+    m_serverLen = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    // a full window of data must fit into the socket buffer
+    int rcvbuf = m_requestedBlockSize * m_requestedWindowSize * 2;
+    if (rcvbuf > 256 * 1024)
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    m_buffer.resize(TFTP_MAX_BLOCKSIZE + 4);
+    sendRequest();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::sendRequest()
+    throw (DownloadError)
+{
+    std::string packet;
+
+    packet += char(0);
+    packet += char(TFTP_RRQ);
+    packet += m_file;
+    packet += '\0';
+    packet += "octet";
+    packet += '\0';
+
+    if (m_useOptions) {
+        if (m_requestedBlockSize != TFTP_DEFAULT_BLOCKSIZE)
+            append_option(packet, "blksize", m_requestedBlockSize);
+        if (m_requestedWindowSize != 1)
+            append_option(packet, "windowsize", m_requestedWindowSize);
+        append_option(packet, "tsize", 0);
+    }
+
+    BW_DEBUG_DBG("TFTP: Requesting %s (blksize=%u, windowsize=%u, options=%d)",
+                 m_file.c_str(), m_requestedBlockSize, m_requestedWindowSize,
+                 int(m_useOptions));
+
+    ssize_t ret = sendto(m_socket, packet.data(), packet.size(), 0,
+                         (struct sockaddr *)&m_server, m_serverLen);
+    if (ret < 0) {
+        DownloadError error(std::string("sendto() failed: ") + std::strerror(errno));
+        error.setErrorcode(DownloadError::DEC_CONNECTION_FAILED);
+        throw error;
+    }
+
+    m_state = S_REQUESTED;
+    m_peerLen = 0;
+    resetTimer();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::sendAck(unsigned short block)
+{
+    unsigned char packet[4];
+
+    packet[0] = 0;
+    packet[1] = TFTP_ACK;
+    packet[2] = block >> 8;
+    packet[3] = block & 0xff;
+
+    if (sendto(m_socket, packet, sizeof(packet), 0,
+               (struct sockaddr *)&m_peer, m_peerLen) < 0)
+        BW_DEBUG_DBG("TFTP: Sending ACK %hu failed: %s", block, std::strerror(errno));
+
+    m_windowBlocks = 0;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::sendError(unsigned short code, const char *message)
+{
+    std::string packet;
+
+    packet += char(0);
+    packet += char(TFTP_ERROR);
+    packet += char(code >> 8);
+    packet += char(code & 0xff);
+    packet += message;
+    packet += '\0';
+
+    if (m_peerLen > 0)
+        sendto(m_socket, packet.data(), packet.size(), 0, (struct sockaddr *)&m_peer, m_peerLen);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::resetTimer()
+{
+    m_deadline = bw::monotonicMs() + TFTP_RETRANSMIT_MS;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::cancel()
+{
+    if (m_state == S_TRANSFER) {
+        BW_DEBUG_DBG("TFTP: Cancelling transfer of %s", m_file.c_str());
+        sendError(TFTP_EUNDEF, "Transfer cancelled");
+    }
+
+    m_state = S_DONE;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool TftpClient::process(bool readable)
+    throw (DownloadError)
+{
+    if (m_state == S_DONE)
+        return true;
+
+    while (readable && m_state != S_DONE) {
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+
+        ssize_t len = recvfrom(m_socket, &m_buffer[0], m_buffer.size(), 0,
+                               (struct sockaddr *)&from, &fromlen);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            m_state = S_DONE;
+            DownloadError error(std::string("recvfrom() failed: ") + std::strerror(errno));
+            if (errno == ECONNREFUSED)
+                error.setErrorcode(DownloadError::DEC_CONNECTION_FAILED);
+            throw error;
+        }
+
+        handlePacket(&m_buffer[0], len, (struct sockaddr *)&from, fromlen);
+    }
+
+    if (m_state != S_DONE && bw::monotonicMs() >= m_deadline)
+        handleTimeout();
+
+    return m_state == S_DONE;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::handlePacket(const char *packet, size_t len,
+                              const struct sockaddr *from, socklen_t fromlen)
+    throw (DownloadError)
+{
+    if (len < 4)
+        return;
+
+    // the server answers from a new port (the transfer ID), everything
+    // else is ignored after that
+    if (m_peerLen > 0 && (fromlen != m_peerLen || memcmp(from, &m_peer, fromlen) != 0)) {
+        BW_DEBUG_DBG("TFTP: Ignoring packet from unknown transfer ID");
+        return;
+    }
+
+    unsigned short opcode = (unsigned char)packet[0] << 8 | (unsigned char)packet[1];
+    unsigned short arg = (unsigned char)packet[2] << 8 | (unsigned char)packet[3];
+
+    if (m_peerLen == 0 && (opcode == TFTP_OACK || opcode == TFTP_DATA || opcode == TFTP_ERROR)) {
+        memcpy(&m_peer, from, fromlen);
+        m_peerLen = fromlen;
+        m_answerTime = bw::monotonicUs();
+    }
+
+    switch (opcode) {
+        case TFTP_ERROR: {
+            std::string message(packet + 4, strnlen(packet + 4, len - 4));
+
+            // servers that don't know options may refuse the request, try again
+            // like a RFC 1350 client
+            if (m_state == S_REQUESTED && m_useOptions &&
+                    (arg == TFTP_EOPTNEG || arg == TFTP_EBADOP || arg == TFTP_EUNDEF)) {
+                // without options, there's no size
+                if (m_sizeOnly) {
+                    BW_DEBUG_DBG("TFTP: Server refused options, size unknown");
+                    m_state = S_DONE;
+                    return;
+                }
+
+                BW_DEBUG_INFO("TFTP: Server refused options (%hu: %s), retrying without",
+                              arg, message.c_str());
+                m_useOptions = false;
+                m_retries = 0;
+                sendRequest();
+                return;
+            }
+
+            m_state = S_DONE;
+            std::stringstream ss;
+            ss << "TFTP error " << arg << ": " << message;
+            throw DownloadError(ss.str());
+        }
+
+        case TFTP_OACK:
+            if (m_state != S_REQUESTED)
+                return;
+            handleOptions(packet + 2, len - 2);
+            m_state = S_TRANSFER;
+            if (m_sizeOnly) {
+                sendError(TFTP_EUNDEF, "Size query only");
+                m_state = S_DONE;
+                return;
+            }
+            m_retries = 0;
+            sendAck(0);
+            resetTimer();
+            return;
+
+        case TFTP_DATA:
+            if (m_state == S_REQUESTED) {
+                // the server ignored all options
+                BW_DEBUG_DBG("TFTP: Server doesn't support options");
+                if (m_sizeOnly) {
+                    sendError(TFTP_EUNDEF, "Size query only");
+                    m_state = S_DONE;
+                    return;
+                }
+                m_blockSize = TFTP_DEFAULT_BLOCKSIZE;
+                m_windowSize = 1;
+                m_state = S_TRANSFER;
+            }
+            if (m_state == S_TRANSFER)
+                handleData(arg, packet + 4, len - 4);
+            return;
+
+        default:
+            BW_DEBUG_DBG("TFTP: Ignoring packet with opcode %hu", opcode);
+            return;
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::handleOptions(const char *options, size_t len)
+    throw (DownloadError)
+{
+    const char *end = options + len;
+
+    m_blockSize = TFTP_DEFAULT_BLOCKSIZE;
+    m_windowSize = 1;
+
+    while (options < end) {
+        const char *name = options;
+        const char *value = name + strnlen(name, end - name) + 1;
+        if (value >= end)
+            break;
+        options = value + strnlen(value, end - value) + 1;
+
+        unsigned long number = std::strtoul(value, NULL, 10);
+        BW_DEBUG_DBG("TFTP: Server acknowledged %s=%s", name, value);
+
+        if (strcasecmp(name, "blksize") == 0) {
+            if (number < 8 || number > m_requestedBlockSize) {
+                sendError(TFTP_EOPTNEG, "Invalid blksize");
+                m_state = S_DONE;
+                throw DownloadError("TFTP server sent invalid blksize");
+            }
+            m_blockSize = number;
+        } else if (strcasecmp(name, "windowsize") == 0) {
+            if (number < 1 || number > m_requestedWindowSize) {
+                sendError(TFTP_EOPTNEG, "Invalid windowsize");
+                m_state = S_DONE;
+                throw DownloadError("TFTP server sent invalid windowsize");
+            }
+            m_windowSize = number;
+        } else if (strcasecmp(name, "tsize") == 0)
+            m_transferSize = std::strtoll(value, NULL, 10);
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::handleData(unsigned short block, const char *data, size_t len)
+    throw (DownloadError)
+{
+    // RFC 7440: a block out of order means that the rest of the window is
+    // lost, acknowledge the last good block once so that the server
+    // continues from there
+    if (block != (unsigned short)(m_lastBlock + 1)) {
+        if (!m_outOfOrderAcked) {
+            BW_DEBUG_DBG("TFTP: Got block %hu, expected %hu", block,
+                         (unsigned short)(m_lastBlock + 1));
+            sendAck(m_lastBlock);
+            m_outOfOrderAcked = true;
+            m_retransmits++;
+        }
+        return;
+    }
+
+    if (len > m_blockSize) {
+        sendError(TFTP_EBADOP, "Block too large");
+        m_state = S_DONE;
+        throw DownloadError("TFTP server sent a block that is too large");
+    }
+
+    if (len > 0 && m_writeFunction &&
+            m_writeFunction((void *)data, 1, len, m_writeData) != len) {
+        sendError(TFTP_EDISKFULL, "Write error");
+        m_state = S_DONE;
+        throw DownloadError("Failed writing received data");
+    }
+
+    m_lastBlock = block;
+    m_received += len;
+    m_outOfOrderAcked = false;
+    m_retries = 0;
+    m_windowBlocks++;
+    resetTimer();
+
+    if (m_progressFunction)
+        m_progressFunction(m_progressData, m_transferSize > 0 ? m_transferSize : 0.0,
+                           m_received, 0.0, 0.0);
+
+    if (len < m_blockSize) {
+        BW_DEBUG_DBG("TFTP: Transfer of %s finished, %lld bytes", m_file.c_str(), m_received);
+        sendAck(block);
+        m_state = S_DONE;
+    } else if (m_windowBlocks >= m_windowSize)
+        sendAck(block);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::handleTimeout()
+    throw (DownloadError)
+{
+    if (++m_retries > TFTP_MAX_RETRIES) {
+        bool connected = m_state == S_TRANSFER;
+        cancel();
+
+        DownloadError error("TFTP timeout while downloading " + m_file);
+        if (!connected)
+            error.setErrorcode(DownloadError::DEC_CONNECTION_FAILED);
+        throw error;
+    }
+
+    BW_DEBUG_DBG("TFTP: Timeout, retry %d", m_retries);
+    m_retransmits++;
+    if (m_state == S_REQUESTED)
+        sendRequest();
+    else {
+        sendAck(m_lastBlock);
+        m_outOfOrderAcked = false;
+        resetTimer();
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TftpClient::perform()
+    throw (DownloadError)
+{
+    start();
+
+    bool readable = false;
+    while (!process(readable)) {
+        struct pollfd pfd;
+        pfd.fd = m_socket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        int ret = poll(&pfd, 1, getTimeout());
+        if (ret < 0 && errno != EINTR)
+            throw DownloadError(std::string("poll() failed: ") + std::strerror(errno));
+        readable = ret > 0;
+    }
+}
+
+/* }}} */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
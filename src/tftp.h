@@ -0,0 +1,336 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TFTP_H
+#define TFTP_H
+
+/**
+ * @file tftp.h
+ * @brief TFTP client
+ *
+ * This file contains a TFTP client that supports the block size, transfer
+ * size and window size options (RFC 2347, RFC 2348, RFC 2349 and RFC 7440).
+ * The libcurl TFTP implementation waits for the acknowledgement of each
+ * block, which is slow on links with a high latency.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "downloader.h"
+
+/* TftpClient {{{ */
+
+/**
+ * @brief TFTP client
+ *
+ * Downloads a file from a TFTP server. The client requests the options
+ * @c blksize, @c windowsize and @c tsize. If the server doesn't support
+ * options, the transfer is done with the RFC 1350 defaults (blocks of 512
+ * bytes, each block acknowledged).
+ *
+ * The client doesn't block: start() sends the request, and process() has to
+ * be called each time the socket (see getSocket()) is readable or the timeout
+ * returned by getTimeout() has elapsed. That way, the client can be driven by
+ * the same event loop as the CURL transfers of a MultiDownloader. Use
+ * perform() for a simple blocking download.
+ *
+ * The callbacks have the same signature as the CURL write and progress
+ * callbacks, so that the Downloader can use the same functions for both.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class TftpClient {
+    public:
+        /**
+         * @brief Callback for received data, see @c CURLOPT_WRITEFUNCTION
+         */
+        typedef size_t (*WriteFunction)(void *buffer, size_t size, size_t nmemb, void *userp);
+
+        /**
+         * @brief Callback for the progress, see @c CURLOPT_PROGRESSFUNCTION
+         */
+        typedef int (*ProgressFunction)(void *clientp, double dltotal, double dlnow,
+                                        double ultotal, double ulnow);
+
+        /**
+         * @brief Checks if the client can handle an URL
+         *
+         * @param[in] url the URL
+         * @return @c true if @p url is a <tt>tftp://</tt> URL, @c false
+         *         otherwise
+         */
+        static bool isTftpUrl(const std::string &url);
+
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Creates a new TftpClient.
+         *
+         * @param[in] url the URL in the form <tt>tftp://host[:port]/path</tt>
+         * @throw DownloadError if @p url is invalid
+         */
+        TftpClient(const std::string &url)
+            throw (DownloadError);
+
+        /**
+         * @brief Destructor
+         *
+         * Closes the socket. If the transfer is still running, the server is
+         * notified.
+         */
+        virtual ~TftpClient();
+
+    public:
+        /**
+         * @brief Sets the requested block size
+         *
+         * The server may choose a smaller block size.
+         *
+         * @param[in] blocksize the block size in bytes (8 to 65464), 512
+         *            disables the option
+         */
+        void setBlockSize(unsigned int blocksize);
+
+        /**
+         * @brief Sets the requested window size
+         *
+         * The window size is the number of blocks the server sends before it
+         * waits for an acknowledgement. The server may choose a smaller
+         * window.
+         *
+         * @param[in] windowsize the number of blocks (1 to 65535), 1 disables
+         *            the option
+         */
+        void setWindowSize(unsigned int windowsize);
+
+        /**
+         * @brief Only determines the size of the file
+         *
+         * If enabled, the transfer is terminated as soon as the server has
+         * acknowledged the options. getTransferSize() returns the size
+         * afterwards if the server supports the @c tsize option. No data is
+         * written.
+         *
+         * @param[in] sizeOnly @c true if only the size should be determined
+         */
+        void setSizeOnly(bool sizeOnly);
+
+        /**
+         * @brief Sets the callback for received data
+         *
+         * @param[in] function the callback function
+         * @param[in] data the last argument of @p function
+         */
+        void setWriteFunction(WriteFunction function, void *data);
+
+        /**
+         * @brief Sets the progress callback
+         *
+         * @param[in] function the callback function or @c NULL
+         * @param[in] data the first argument of @p function
+         */
+        void setProgressFunction(ProgressFunction function, void *data);
+
+        /**
+         * @brief Starts the transfer
+         *
+         * Resolves the server name and sends the read request.
+         *
+         * @throw DownloadError if the name cannot be resolved or the request
+         *        cannot be sent
+         */
+        void start()
+            throw (DownloadError);
+
+        /**
+         * @brief Continues the transfer
+         *
+         * Handles the received packets and retransmissions.
+         *
+         * @param[in] readable @c true if the socket is readable, @c false if
+         *            only the timeout has elapsed
+         * @return @c true if the transfer has finished, @c false if process()
+         *         has to be called again
+         * @throw DownloadError if the transfer has failed
+         */
+        bool process(bool readable)
+            throw (DownloadError);
+
+        /**
+         * @brief Cancels the transfer
+         *
+         * Sends an error to the server so that it stops sending data.
+         */
+        void cancel();
+
+        /**
+         * @brief Performs the whole transfer
+         *
+         * Calls start() and process() until the transfer has finished.
+         *
+         * @throw DownloadError if the transfer has failed
+         */
+        void perform()
+            throw (DownloadError);
+
+        /**
+         * @brief Returns the socket
+         *
+         * @return the socket that has to be watched for input, -1 before
+         *         start() has been called
+         */
+        int getSocket() const;
+
+        /**
+         * @brief Returns the timeout
+         *
+         * @return the number of milliseconds after which process() has to be
+         *         called even if the socket is not readable
+         */
+        long getTimeout() const;
+
+        /**
+         * @brief Returns the block size
+         *
+         * @return the negotiated block size
+         */
+        unsigned int getBlockSize() const;
+
+        /**
+         * @brief Returns the window size
+         *
+         * @return the negotiated window size
+         */
+        unsigned int getWindowSize() const;
+
+        /**
+         * @brief Returns the size of the file
+         *
+         * @return the size as announced by the server with the @c tsize
+         *         option or -1 if the server didn't announce the size
+         */
+        long long getTransferSize() const;
+
+        /**
+         * @brief Returns the number of received bytes
+         *
+         * @return the number of bytes
+         */
+        long long getBytesReceived() const;
+
+        /**
+         * @brief Returns the time needed to resolve the server name
+         *
+         * @return the time in seconds or a negative value if start() has not
+         *         been called yet
+         */
+        double getResolveTime() const;
+
+        /**
+         * @brief Returns the time until the server answered
+         *
+         * @return the time between start() and the first packet of the
+         *         server in seconds or a negative value if the server didn't
+         *         answer yet
+         */
+        double getAnswerTime() const;
+
+        /**
+         * @brief Returns the number of retransmissions
+         *
+         * Counts the packets that have been sent again after a timeout and
+         * the acknowledgements that let the server send a window again
+         * after a block was lost.
+         *
+         * @return the number of retransmissions
+         */
+        unsigned int getRetransmits() const;
+
+    protected:
+        /**
+         * @brief State of the transfer
+         */
+        enum State {
+            S_INIT,             /**< start() has not been called */
+            S_REQUESTED,        /**< the read request has been sent */
+            S_TRANSFER,         /**< data is being received */
+            S_DONE              /**< the transfer has finished or failed */
+        };
+
+        void sendRequest() throw (DownloadError);
+        void sendAck(unsigned short block);
+        void sendError(unsigned short code, const char *message);
+        void handlePacket(const char *packet, size_t len,
+                          const struct sockaddr *from, socklen_t fromlen)
+            throw (DownloadError);
+        void handleOptions(const char *options, size_t len)
+            throw (DownloadError);
+        void handleData(unsigned short block, const char *data, size_t len)
+            throw (DownloadError);
+        void handleTimeout()
+            throw (DownloadError);
+        void resetTimer();
+
+    private:
+        TftpClient(const TftpClient &);
+        TftpClient &operator=(const TftpClient &);
+
+    private:
+        std::string             m_host;
+        std::string             m_port;
+        std::string             m_file;
+        int                     m_socket;
+        State                   m_state;
+        struct sockaddr_storage m_server;
+        socklen_t               m_serverLen;
+        struct sockaddr_storage m_peer;
+        socklen_t               m_peerLen;
+        bool                    m_useOptions;
+        bool                    m_sizeOnly;
+        unsigned int            m_requestedBlockSize;
+        unsigned int            m_requestedWindowSize;
+        unsigned int            m_blockSize;
+        unsigned int            m_windowSize;
+        unsigned short          m_lastBlock;
+        unsigned int            m_windowBlocks;
+        bool                    m_outOfOrderAcked;
+        int                     m_retries;
+        long long               m_deadline;
+        long long               m_transferSize;
+        long long               m_received;
+        long long               m_startTime;
+        long long               m_resolveTime;
+        long long               m_answerTime;
+        unsigned int            m_retransmits;
+        std::vector<char>       m_buffer;
+        WriteFunction           m_writeFunction;
+        void                    *m_writeData;
+        ProgressFunction        m_progressFunction;
+        void                    *m_progressData;
+};
+
+/* }}} */
+
+#endif /* TFTP_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
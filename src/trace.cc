@@ -0,0 +1,167 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <cstdio>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <libbw/clock.h>
+
+#include "trace.h"
+
+/* ---------------------------------------------------------------------------------------------- */
+static std::string json_escape(const std::string &str)
+{
+    std::string ret;
+
+    for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+        if (*it == '"' || *it == '\\')
+            ret += '\\';
+        if ((unsigned char)*it < 0x20)
+            continue;
+        ret += *it;
+    }
+
+    return ret;
+}
+
+/* Tracer {{{ */
+
+Tracer *Tracer::m_instance = NULL;
+
+/* ---------------------------------------------------------------------------------------------- */
+Tracer *Tracer::tracer()
+{
+    if (!m_instance)
+        m_instance = new Tracer();
+
+    return m_instance;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+Tracer::Tracer()
+    : m_file(NULL)
+    , m_first(true)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool Tracer::open(const std::string &filename)
+{
+    FILE *file = std::fopen(filename.c_str(), "we");
+    if (!file)
+        return false;
+
+    pthread_mutex_lock(&m_mutex);
+    if (m_file)
+        std::fclose(m_file);
+    m_file = file;
+    m_first = true;
+    std::fputs("[", m_file);
+    pthread_mutex_unlock(&m_mutex);
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool Tracer::isEnabled() const
+{
+    return m_file != NULL;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Tracer::write(const char *phase, const char *name, const std::string &detail)
+{
+    long long now = bw::monotonicUs();
+    long tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&m_mutex);
+    std::fprintf(m_file, "%s\n{\"name\":\"%s\",\"cat\":\"pxe-kexec\",\"ph\":\"%s\","
+                 "\"ts\":%lld,\"pid\":%d,\"tid\":%ld",
+                 m_first ? "" : ",", name, phase, now, int(getpid()), tid);
+    if (phase[0] == 'i')
+        std::fputs(",\"s\":\"p\"", m_file);
+    if (!detail.empty())
+        std::fprintf(m_file, ",\"args\":{\"detail\":\"%s\"}", json_escape(detail).c_str());
+    std::fputs("}", m_file);
+    std::fflush(m_file);
+    m_first = false;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Tracer::begin(const char *name, const std::string &detail)
+{
+    if (m_file)
+        write("B", name, detail);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Tracer::end(const char *name)
+{
+    if (m_file)
+        write("E", name, std::string());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Tracer::instant(const char *name)
+{
+    if (m_file)
+        write("i", name, std::string());
+}
+
+/* }}} */
+/* TraceSpan {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+TraceSpan::TraceSpan(const char *name)
+    : m_name(NULL)
+{
+    Tracer *tracer = Tracer::tracer();
+
+    if (tracer->isEnabled()) {
+        m_name = name;
+        tracer->begin(name);
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+TraceSpan::TraceSpan(const char *name, const std::string &detail)
+    : m_name(NULL)
+{
+    Tracer *tracer = Tracer::tracer();
+
+    if (tracer->isEnabled()) {
+        m_name = name;
+        tracer->begin(name, detail);
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+TraceSpan::~TraceSpan()
+{
+    if (m_name)
+        Tracer::tracer()->end(m_name);
+}
+
+/* }}} */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
@@ -0,0 +1,169 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * @file trace.h
+ * @brief Timing of the phases of a run
+ *
+ * This file contains the profiler that writes how long each phase of a run
+ * took in the trace event format of Chrome, which can be opened in
+ * <tt>chrome://tracing</tt> or Perfetto.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <string>
+#include <cstdio>
+
+#include <pthread.h>
+
+/* Tracer {{{ */
+
+/**
+ * @brief Writer of the trace file
+ *
+ * Each event is written (and flushed) immediately, because the run usually
+ * ends with a reboot or with <tt>kexec -e</tt>. For the same reason, the
+ * closing bracket of the JSON array is missing, which the trace viewers
+ * accept.
+ *
+ * As long as no file has been opened, all functions return immediately.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class Tracer {
+    public:
+        /**
+         * @brief Returns the only instance
+         *
+         * @return the Tracer
+         */
+        static Tracer *tracer();
+
+    public:
+        /**
+         * @brief Starts tracing
+         *
+         * @param[in] filename the name of the trace file, which is replaced
+         * @return @c true on success, @c false if the file cannot be created
+         */
+        bool open(const std::string &filename);
+
+        /**
+         * @brief Checks if tracing is enabled
+         *
+         * @return @c true if a file has been opened
+         */
+        bool isEnabled() const;
+
+        /**
+         * @brief Writes the beginning of a span
+         *
+         * @param[in] name the name of the span
+         * @param[in] detail additional information like a URL, may be empty
+         */
+        void begin(const char *name, const std::string &detail = std::string());
+
+        /**
+         * @brief Writes the end of a span
+         *
+         * Spans of one thread must be nested properly.
+         *
+         * @param[in] name the name of the span
+         */
+        void end(const char *name);
+
+        /**
+         * @brief Writes an event without duration
+         *
+         * @param[in] name the name of the event
+         */
+        void instant(const char *name);
+
+    protected:
+        Tracer();
+        void write(const char *phase, const char *name, const std::string &detail);
+
+    private:
+        static Tracer   *m_instance;
+        FILE            *m_file;
+        bool            m_first;
+        pthread_mutex_t m_mutex;
+};
+
+/* }}} */
+/* TraceSpan {{{ */
+
+/**
+ * @brief Traces a scope
+ *
+ * Example:
+ *
+ * @code
+ * {
+ *     TraceSpan span("parse configuration");
+ *     // ...
+ * }
+ * @endcode
+ *
+ * If tracing is not enabled, that costs one function call.
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+class TraceSpan {
+    public:
+        /**
+         * @brief Constructor
+         *
+         * Begins the span.
+         *
+         * @param[in] name the name of the span, must be a string literal
+         */
+        TraceSpan(const char *name);
+
+        /**
+         * @brief Constructor
+         *
+         * Begins the span with additional information.
+         *
+         * @param[in] name the name of the span, must be a string literal
+         * @param[in] detail additional information like a URL
+         */
+        TraceSpan(const char *name, const std::string &detail);
+
+        /**
+         * @brief Destructor
+         *
+         * Ends the span.
+         */
+        ~TraceSpan();
+
+    private:
+        TraceSpan(const TraceSpan &);
+        TraceSpan &operator=(const TraceSpan &);
+
+    private:
+        const char      *m_name;
+};
+
+/* }}} */
+
+#endif /* TRACE_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
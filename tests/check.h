@@ -0,0 +1,118 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CHECK_H
+#define CHECK_H
+
+/**
+ * @file check.h
+ * @brief Helpers for the tests
+ *
+ * Each test is one program that checks conditions with CHECK(), keeps
+ * running after a failed check and returns check_result() from main().
+ *
+ * @author Bernhard Walle <bernhard@bwalle.de>
+ */
+
+#include <string>
+#include <iostream>
+#include <cstdlib>
+
+#include <libbw/clock.h>
+
+/**
+ * @brief Checks a condition
+ *
+ * Prints the condition with file and line if it's false.
+ *
+ * @param[in] cond the condition
+ * @return the value of @p cond
+ */
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+/**
+ * @brief Returns the number of failed checks
+ *
+ * @return a reference to the counter
+ */
+inline int &check_failures()
+{
+    static int failures;
+
+    return failures;
+}
+
+/**
+ * @brief Implementation of CHECK()
+ *
+ * @param[in] ok the result of the check
+ * @param[in] what the text of the condition
+ * @param[in] file the source file
+ * @param[in] line the line in @p file
+ * @return @p ok
+ */
+inline bool check(bool ok, const char *what, const char *file, int line)
+{
+    if (!ok) {
+        std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+        check_failures()++;
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Returns the exit code of a test
+ *
+ * Prints the number of failed checks if there are any.
+ *
+ * @return @c EXIT_SUCCESS if all checks passed, @c EXIT_FAILURE otherwise
+ */
+inline int check_result()
+{
+    if (check_failures() > 0) {
+        std::cerr << check_failures() << " check(s) failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Returns data that is transferred in a test
+ *
+ * The data is pseudo-random, so a misplaced block is detected, and the
+ * same for each call.
+ *
+ * @param[in] size the number of bytes
+ * @return the data
+ */
+inline std::string test_data(size_t size)
+{
+    std::string data(size, '\0');
+    unsigned int state = 12345;
+
+    for (size_t i = 0; i < size; i++) {
+        state = state * 1103515245 + 12345;
+        data[i] = char(state >> 16);
+    }
+
+    return data;
+}
+
+#endif /* CHECK_H */
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
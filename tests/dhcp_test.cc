@@ -0,0 +1,298 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dhcp.h"
+#include "check.h"
+
+//
+// Tests DhcpInform::parseReply() with replies that are built here like a
+// DHCP server would send them.
+//
+
+#define XID                 0x12345678
+
+// offsets of the BOOTP fields (RFC 951)
+#define OFFSET_OP           0
+#define OFFSET_XID          4
+#define OFFSET_SIADDR       20
+#define OFFSET_SNAME        44
+#define OFFSET_FILE         108
+#define OFFSET_COOKIE       236
+#define OFFSET_OPTIONS      240
+
+/* Packet {{{ */
+
+/**
+ * @brief DHCP reply that is built field by field
+ */
+class Packet {
+    public:
+        Packet(int messageType);
+
+    public:
+        void setXid(uint32_t xid);
+        void setCookie(uint32_t cookie);
+        void setNextServer(const char *ip);
+        void setField(size_t offset, const std::string &value);
+        void addOption(int code, const std::string &value);
+        void addOption(int code, uint8_t value);
+        void addOption(size_t offset, int code, const std::string &value);
+        void truncate(size_t len);
+        const std::vector<uint8_t> &getData() const;
+
+        bool parse(DhcpInform::Reply &reply) const;
+
+    private:
+        std::vector<uint8_t>    m_data;
+};
+
+/* ---------------------------------------------------------------------------------------------- */
+Packet::Packet(int messageType)
+    : m_data(OFFSET_OPTIONS)
+{
+    m_data[OFFSET_OP] = 2;      // BOOTREPLY
+    m_data[1] = 1;              // Ethernet
+    m_data[2] = 6;
+    setXid(XID);
+    setCookie(0x63825363);
+
+    if (messageType > 0)
+        addOption(53, uint8_t(messageType));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Packet::setXid(uint32_t xid)
+{
+    // the client compares the field as it sent it
+    std::memcpy(&m_data[OFFSET_XID], &xid, sizeof(xid));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Packet::setCookie(uint32_t cookie)
+{
+    cookie = htonl(cookie);
+    std::memcpy(&m_data[OFFSET_COOKIE], &cookie, sizeof(cookie));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Packet::setNextServer(const char *ip)
+{
+    struct in_addr addr;
+
+    inet_aton(ip, &addr);
+    std::memcpy(&m_data[OFFSET_SIADDR], &addr.s_addr, sizeof(addr.s_addr));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Packet::setField(size_t offset, const std::string &value)
+{
+    std::memcpy(&m_data[offset], value.data(), value.size());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Packet::addOption(int code, const std::string &value)
+{
+    m_data.push_back(code);
+    m_data.push_back(value.size());
+    m_data.insert(m_data.end(), value.begin(), value.end());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Packet::addOption(int code, uint8_t value)
+{
+    addOption(code, std::string(1, char(value)));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+// Puts an option into the file or sname field, which end with the end option.
+void Packet::addOption(size_t offset, int code, const std::string &value)
+{
+    m_data[offset] = code;
+    m_data[offset + 1] = value.size();
+    std::memcpy(&m_data[offset + 2], value.data(), value.size());
+    m_data[offset + 2 + value.size()] = 255;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void Packet::truncate(size_t len)
+{
+    m_data.resize(len);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+const std::vector<uint8_t> &Packet::getData() const
+{
+    return m_data;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool Packet::parse(DhcpInform::Reply &reply) const
+{
+    // the end option and some padding like a real server
+    std::vector<uint8_t> data(m_data);
+    if (data.size() > OFFSET_OPTIONS) {
+        data.push_back(255);
+        data.resize(std::max<size_t>(data.size(), 300));
+    }
+
+    return DhcpInform::parseReply(&data[0], data.size(), XID, reply);
+}
+
+/* }}} */
+/* Tests {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_options()
+{
+    Packet packet(5);
+    packet.addOption(54, std::string("\x0a\x00\x00\x01", 4));
+    packet.addOption(66, "tftp.example.com");
+    // some servers include the null byte
+    packet.addOption(67, std::string("pxelinux.0\0", 11));
+    packet.addOption(209, "pxelinux.cfg/rack1");
+    packet.addOption(210, "tftp://10.0.0.2/boot/");
+    packet.setNextServer("10.0.0.2");
+    packet.setField(OFFSET_FILE, "legacy.0");
+    packet.setField(OFFSET_SNAME, "legacy");
+
+    DhcpInform::Reply reply;
+    if (!CHECK(packet.parse(reply)))
+        return;
+
+    CHECK(reply.serverIdentifier == "10.0.0.1");
+    CHECK(reply.nextServer == "10.0.0.2");
+    CHECK(reply.tftpServer == "tftp.example.com");
+    CHECK(reply.bootFile == "pxelinux.0");
+    CHECK(reply.configFile == "pxelinux.cfg/rack1");
+    CHECK(reply.pathPrefix == "tftp://10.0.0.2/boot/");
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_bootp_fields()
+{
+    Packet packet(5);
+    packet.setNextServer("192.168.1.5");
+    packet.setField(OFFSET_FILE, "boot/pxelinux.0");
+    packet.setField(OFFSET_SNAME, "bootserver");
+
+    DhcpInform::Reply reply;
+    if (!CHECK(packet.parse(reply)))
+        return;
+
+    CHECK(reply.serverIdentifier.empty());
+    CHECK(reply.nextServer == "192.168.1.5");
+    CHECK(reply.tftpServer == "bootserver");
+    CHECK(reply.bootFile == "boot/pxelinux.0");
+    CHECK(reply.configFile.empty());
+    CHECK(reply.pathPrefix.empty());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_overload()
+{
+    // option 52: file (1) and sname (2) carry options
+    Packet packet(0);
+    packet.addOption(52, uint8_t(3));
+    packet.addOption(OFFSET_FILE, 67, "overloaded.0");
+    packet.addOption(OFFSET_SNAME, 53, std::string(1, '\5'));
+
+    DhcpInform::Reply reply;
+    if (!CHECK(packet.parse(reply)))
+        return;
+
+    CHECK(reply.bootFile == "overloaded.0");
+    CHECK(reply.tftpServer.empty());
+    CHECK(reply.nextServer.empty());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_ignored()
+{
+    DhcpInform::Reply reply;
+    reply.bootFile = "unchanged";
+
+    // DHCPOFFER
+    Packet offer(2);
+    offer.addOption(67, "offer.0");
+    CHECK(!offer.parse(reply));
+
+    // no message type
+    Packet bootp(0);
+    bootp.addOption(67, "bootp.0");
+    CHECK(!bootp.parse(reply));
+
+    // the answer to another request
+    Packet other(5);
+    other.setXid(XID + 1);
+    CHECK(!other.parse(reply));
+
+    Packet cookie(5);
+    cookie.setCookie(0x12345678);
+    CHECK(!cookie.parse(reply));
+
+    Packet request(5);
+    request.setField(OFFSET_OP, std::string(1, '\1'));
+    CHECK(!request.parse(reply));
+
+    Packet shortPacket(5);
+    shortPacket.truncate(OFFSET_COOKIE);
+    CHECK(!shortPacket.parse(reply));
+
+    CHECK(reply.bootFile == "unchanged");
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_truncated_option()
+{
+    // the last option ends behind the end of the packet, without end option
+    Packet packet(5);
+    packet.addOption(67, "pxelinux.0");
+    packet.addOption(66, "tftp.example.com");
+    packet.truncate(packet.getData().size() - 8);
+
+    DhcpInform::Reply reply;
+    const std::vector<uint8_t> &data = packet.getData();
+    CHECK(DhcpInform::parseReply(&data[0], data.size(), XID, reply));
+    CHECK(reply.bootFile == "pxelinux.0");
+    CHECK(reply.tftpServer.empty());
+}
+
+/* }}} */
+
+/* ---------------------------------------------------------------------------------------------- */
+int main()
+{
+    test_options();
+    test_bootp_fields();
+    test_overload();
+    test_ignored();
+    test_truncated_option();
+
+    return check_result();
+}
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
@@ -0,0 +1,451 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <strings.h>
+
+#include "downloader.h"
+#include "check.h"
+
+//
+// Tests segmented HTTP downloads against an HTTP server on the loopback
+// interface. The segments are bound to "lo" twice, which exercises the
+// distribution over interfaces and the per-interface statistics without
+// privileges. Servers that don't support ranges must still work.
+//
+
+#define FILE_SIZE           (32 * 1024 * 1024)
+#define ACCEPT_TIMEOUT_MS   100
+
+/* TestServer {{{ */
+
+/**
+ * @brief Range support of the TestServer
+ */
+enum RangeSupport {
+    RS_NONE,        /**< no Accept-Ranges header, ranges are ignored */
+    RS_IGNORED,     /**< sends Accept-Ranges, but answers ranges with 200 */
+    RS_FULL         /**< answers ranges with 206 */
+};
+
+/**
+ * @brief HTTP server for one file
+ *
+ * Serves @c data for any path, each connection in its own thread, until
+ * stop() is called.
+ */
+class TestServer {
+    public:
+        TestServer(const std::string &data, RangeSupport ranges);
+        ~TestServer();
+
+    public:
+        unsigned short getPort() const;
+        void start();
+        void stop();
+        unsigned int getRequests();
+        unsigned int getRangeRequests();
+
+    private:
+        static void *run(void *arg);
+        static void *runConnection(void *arg);
+        void serve(int fd);
+        bool sendAll(int fd, const char *buffer, size_t len);
+
+    private:
+        std::string     m_data;
+        RangeSupport    m_ranges;
+        int             m_fd;
+        pthread_t       m_thread;
+        pthread_mutex_t m_mutex;
+        bool            m_stop;
+        unsigned int    m_requests;
+        unsigned int    m_rangeRequests;
+        unsigned int    m_connections;
+};
+
+/**
+ * @brief Argument of TestServer::runConnection()
+ */
+struct Connection {
+    TestServer  *server;
+    int         fd;
+};
+
+/* ---------------------------------------------------------------------------------------------- */
+TestServer::TestServer(const std::string &data, RangeSupport ranges)
+    : m_data(data)
+    , m_ranges(ranges)
+    , m_stop(false)
+    , m_requests(0)
+    , m_rangeRequests(0)
+    , m_connections(0)
+{
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    m_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_fd < 0 || bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(m_fd, 16) != 0) {
+        std::perror("Cannot create the server socket");
+        std::exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+TestServer::~TestServer()
+{
+    close(m_fd);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned short TestServer::getPort() const
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    getsockname(m_fd, (struct sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TestServer::start()
+{
+    pthread_create(&m_thread, NULL, run, this);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TestServer::stop()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_stop = true;
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_join(m_thread, NULL);
+
+    // the connection threads are detached, wait until they are gone
+    for (;;) {
+        pthread_mutex_lock(&m_mutex);
+        unsigned int connections = m_connections;
+        pthread_mutex_unlock(&m_mutex);
+        if (connections == 0)
+            break;
+        usleep(1000);
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned int TestServer::getRequests()
+{
+    pthread_mutex_lock(&m_mutex);
+    unsigned int requests = m_requests;
+    pthread_mutex_unlock(&m_mutex);
+
+    return requests;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned int TestServer::getRangeRequests()
+{
+    pthread_mutex_lock(&m_mutex);
+    unsigned int requests = m_rangeRequests;
+    pthread_mutex_unlock(&m_mutex);
+
+    return requests;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void *TestServer::run(void *arg)
+{
+    TestServer *server = static_cast<TestServer *>(arg);
+
+    for (;;) {
+        pthread_mutex_lock(&server->m_mutex);
+        bool stop = server->m_stop;
+        pthread_mutex_unlock(&server->m_mutex);
+        if (stop)
+            break;
+
+        struct pollfd pfd;
+        pfd.fd = server->m_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, ACCEPT_TIMEOUT_MS) <= 0)
+            continue;
+
+        int fd = accept(server->m_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        pthread_mutex_lock(&server->m_mutex);
+        server->m_connections++;
+        pthread_mutex_unlock(&server->m_mutex);
+
+        Connection *connection = new Connection;
+        connection->server = server;
+        connection->fd = fd;
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, runConnection, connection);
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void *TestServer::runConnection(void *arg)
+{
+    Connection *connection = static_cast<Connection *>(arg);
+    TestServer *server = connection->server;
+
+    server->serve(connection->fd);
+    close(connection->fd);
+    delete connection;
+
+    pthread_mutex_lock(&server->m_mutex);
+    server->m_connections--;
+    pthread_mutex_unlock(&server->m_mutex);
+
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool TestServer::sendAll(int fd, const char *buffer, size_t len)
+{
+    while (len > 0) {
+        // the client closes the first request at the end of its segment
+        ssize_t ret = send(fd, buffer, len, MSG_NOSIGNAL);
+        if (ret <= 0)
+            return false;
+
+        buffer += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TestServer::serve(int fd)
+{
+    std::string request;
+    char buffer[1024];
+
+    while (request.find("\r\n\r\n") == std::string::npos) {
+        ssize_t ret = recv(fd, buffer, sizeof(buffer), 0);
+        if (ret <= 0)
+            return;
+        request.append(buffer, ret);
+    }
+
+    bool head = request.compare(0, 5, "HEAD ") == 0;
+    size_t start = 0;
+    size_t end = m_data.size();
+    bool range = false;
+
+    std::string::size_type pos = 0;
+    while ((pos = request.find("\r\n", pos)) != std::string::npos) {
+        pos += 2;
+        if (strncasecmp(request.c_str() + pos, "Range: bytes=", 13) == 0) {
+            unsigned long long first, last;
+            if (std::sscanf(request.c_str() + pos + 13, "%llu-%llu", &first, &last) == 2 &&
+                    first <= last && last < m_data.size()) {
+                range = true;
+                start = first;
+                end = last + 1;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_requests++;
+    if (range)
+        m_rangeRequests++;
+    pthread_mutex_unlock(&m_mutex);
+
+    if (m_ranges != RS_FULL) {
+        range = false;
+        start = 0;
+        end = m_data.size();
+    }
+
+    std::stringstream ss;
+    if (range)
+        ss << "HTTP/1.1 206 Partial Content\r\n"
+           << "Content-Range: bytes " << start << "-" << end - 1 << "/" << m_data.size()
+           << "\r\n";
+    else
+        ss << "HTTP/1.1 200 OK\r\n";
+    if (m_ranges != RS_NONE)
+        ss << "Accept-Ranges: bytes\r\n";
+    ss << "Content-Length: " << end - start << "\r\n"
+       << "Connection: close\r\n"
+       << "\r\n";
+    std::string header = ss.str();
+
+    if (sendAll(fd, header.data(), header.size()) && !head)
+        sendAll(fd, m_data.data() + start, end - start);
+}
+
+/* }}} */
+/* Tests {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+// Downloads the file from server into a temporary file and compares it.
+static bool download(TestServer &server, TransferContext &context, const std::string &data)
+{
+    char name[] = "/tmp/multipath_test.XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        std::perror("mkstemp");
+        std::exit(EXIT_FAILURE);
+    }
+    unlink(name);
+
+    std::stringstream url;
+    url << "http://127.0.0.1:" << server.getPort() << "/initrd";
+
+    bool ok = true;
+    try {
+        MultiDownloader mdl;
+        Downloader *dl = new Downloader(fd);
+        dl->setUrl(url.str());
+        dl->setTransferContext(&context);
+        mdl.addDownloader(dl);
+        mdl.downloadAll();
+    } catch (const DownloadError &err) {
+        std::cerr << "Download failed: " << err.what() << std::endl;
+        ok = false;
+    }
+
+    std::string received;
+    if (ok) {
+        char buffer[65536];
+        ssize_t ret;
+
+        CHECK(lseek(fd, 0, SEEK_CUR) == off_t(data.size()));
+        lseek(fd, 0, SEEK_SET);
+        while ((ret = read(fd, buffer, sizeof(buffer))) > 0)
+            received.append(buffer, ret);
+    }
+    close(fd);
+
+    return CHECK(ok) && CHECK(received == data);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_segments(const std::string &data)
+{
+    TestServer server(data, RS_FULL);
+    TransferContext context;
+    StringVector interfaces;
+
+    interfaces.push_back("lo");
+    interfaces.push_back("lo");
+    context.setHttpSegments(4);
+    context.setInterfaces(interfaces);
+
+    server.start();
+    bool ok = download(server, context, data);
+    server.stop();
+    if (!ok)
+        return;
+
+    // the first request becomes the first segment
+    CHECK(server.getRequests() == 4);
+    CHECK(server.getRangeRequests() == 3);
+
+    std::vector<TransferContext::InterfaceStatistics> stats = context.getInterfaceStatistics();
+    if (!CHECK(stats.size() == 2))
+        return;
+
+    unsigned long long total = 0;
+    for (size_t i = 0; i < stats.size(); i++) {
+        CHECK(stats[i].interface == "lo");
+        CHECK(stats[i].bytes > 0);
+        total += stats[i].bytes;
+
+        std::printf("interface %lu (%s): %llu bytes, %.1f MB/s\n", (unsigned long)i,
+                    stats[i].interface.c_str(), stats[i].bytes,
+                    stats[i].seconds > 0 ? stats[i].bytes / stats[i].seconds / (1024 * 1024)
+                                         : 0.0);
+    }
+    CHECK(total == data.size());
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_no_ranges(const std::string &data)
+{
+    TestServer server(data, RS_NONE);
+    TransferContext context;
+
+    context.setHttpSegments(4);
+    server.start();
+    bool ok = download(server, context, data);
+    server.stop();
+
+    if (ok) {
+        CHECK(server.getRequests() == 1);
+        CHECK(server.getRangeRequests() == 0);
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_ignored_ranges(const std::string &data)
+{
+    TestServer server(data, RS_IGNORED);
+    TransferContext context;
+
+    context.setHttpSegments(4);
+    server.start();
+    download(server, context, data);
+    server.stop();
+}
+
+/* }}} */
+
+/* ---------------------------------------------------------------------------------------------- */
+int main()
+{
+    std::string data = test_data(FILE_SIZE);
+
+    test_segments(data);
+    test_no_ranges(data);
+    test_ignored_ranges(data);
+
+    return check_result();
+}
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
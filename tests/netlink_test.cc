@@ -0,0 +1,353 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <net/if.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/veth.h>
+
+#include "netlink.h"
+#include "networkhelper.h"
+#include "check.h"
+
+//
+// Tests the rtnetlink dump and NetworkHelper::getInterfaces(). If the test
+// may create a network namespace (i.e. it runs as root), it creates a few
+// thousand interfaces there and prints how long the discovery takes.
+// Otherwise that part is skipped.
+//
+
+#define BENCHMARK_INTERFACES    2000
+#define EXIT_SKIPPED            77
+
+/* Requests {{{ */
+
+/**
+ * @brief Buffer for a netlink request with attributes
+ */
+struct Request {
+    union {
+        struct nlmsghdr nh;
+        char            buffer[1024];
+    };
+};
+
+/* ---------------------------------------------------------------------------------------------- */
+static struct rtattr *add_attribute(struct nlmsghdr *nh, int type, const void *data, size_t len)
+{
+    struct rtattr *rta = reinterpret_cast<struct rtattr *>(
+        reinterpret_cast<char *>(nh) + NLMSG_ALIGN(nh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    if (len > 0)
+        std::memcpy(RTA_DATA(rta), data, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+    return rta;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+// Closes an attribute that has been opened with add_attribute(nh, type, NULL, 0).
+static void end_nested(struct nlmsghdr *nh, struct rtattr *nested)
+{
+    nested->rta_len = reinterpret_cast<char *>(nh) + nh->nlmsg_len
+        - reinterpret_cast<char *>(nested);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static struct nlmsghdr *new_link_request(Request &req, const std::string &name)
+{
+    std::memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_type = RTM_NEWLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK;
+
+    struct ifinfomsg *ifi = static_cast<struct ifinfomsg *>(NLMSG_DATA(&req.nh));
+    ifi->ifi_family = AF_UNSPEC;
+
+    add_attribute(&req.nh, IFLA_IFNAME, name.c_str(), name.size() + 1);
+
+    return &req.nh;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void create_dummy(Netlink &netlink, const std::string &name)
+    throw (ApplicationError)
+{
+    Request req;
+    std::vector<char> reply;
+
+    struct nlmsghdr *nh = new_link_request(req, name);
+    struct rtattr *linkinfo = add_attribute(nh, IFLA_LINKINFO, NULL, 0);
+    add_attribute(nh, IFLA_INFO_KIND, "dummy", 6);
+    end_nested(nh, linkinfo);
+
+    netlink.request(nh, reply);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void create_veth(Netlink &netlink, const std::string &name, const std::string &peer)
+    throw (ApplicationError)
+{
+    Request req;
+    std::vector<char> reply;
+
+    struct nlmsghdr *nh = new_link_request(req, name);
+    struct rtattr *linkinfo = add_attribute(nh, IFLA_LINKINFO, NULL, 0);
+    add_attribute(nh, IFLA_INFO_KIND, "veth", 5);
+    struct rtattr *data = add_attribute(nh, IFLA_INFO_DATA, NULL, 0);
+    struct rtattr *info = add_attribute(nh, VETH_INFO_PEER, NULL, 0);
+
+    // the peer is described by an ifinfomsg and its own attributes
+    struct ifinfomsg ifi;
+    std::memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    std::memcpy(RTA_DATA(info), &ifi, sizeof(ifi));
+    nh->nlmsg_len += NLMSG_ALIGN(sizeof(ifi));
+    add_attribute(nh, IFLA_IFNAME, peer.c_str(), peer.size() + 1);
+
+    end_nested(nh, info);
+    end_nested(nh, data);
+    end_nested(nh, linkinfo);
+
+    netlink.request(nh, reply);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void add_address(Netlink &netlink, const std::string &name, unsigned int address)
+    throw (ApplicationError)
+{
+    Request req;
+    std::vector<char> reply;
+
+    std::memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+    req.nh.nlmsg_type = RTM_NEWADDR;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK;
+
+    struct ifaddrmsg *ifa = static_cast<struct ifaddrmsg *>(NLMSG_DATA(&req.nh));
+    ifa->ifa_family = AF_INET;
+    ifa->ifa_prefixlen = 16;
+    ifa->ifa_index = if_nametoindex(name.c_str());
+
+    unsigned int ip = htonl(address);
+    add_attribute(&req.nh, IFA_LOCAL, &ip, sizeof(ip));
+    add_attribute(&req.nh, IFA_ADDRESS, &ip, sizeof(ip));
+
+    netlink.request(&req.nh, reply);
+}
+
+/* }}} */
+/* Tests {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_empty_reply()
+{
+    std::vector<char> messages;
+    int len = messages.size();
+
+    struct nlmsghdr *nh = Netlink::first(messages);
+    CHECK(nh == NULL);
+    CHECK(!NLMSG_OK(nh, len));
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_dump()
+{
+    Netlink netlink;
+    std::vector<char> messages;
+    bool foundLoopback = false;
+    int links = 0;
+
+    try {
+        netlink.open();
+        netlink.dump(RTM_GETLINK, AF_UNSPEC, messages);
+    } catch (const ApplicationError &err) {
+        std::cerr << "Dumping the links failed: " << err.what() << std::endl;
+        CHECK(false);
+        return;
+    }
+
+    int len = messages.size();
+    for (struct nlmsghdr *nh = Netlink::first(messages); NLMSG_OK(nh, len);
+            nh = NLMSG_NEXT(nh, len)) {
+        CHECK(nh->nlmsg_type == RTM_NEWLINK);
+
+        struct ifinfomsg *ifi = static_cast<struct ifinfomsg *>(NLMSG_DATA(nh));
+        if (ifi->ifi_flags & IFF_LOOPBACK)
+            foundLoopback = true;
+        links++;
+    }
+
+    CHECK(foundLoopback);
+
+    // the loopback interface is left out
+    NetworkHelper helper;
+    try {
+        std::vector<NetworkInterface> interfaces = helper.getInterfaces();
+        CHECK(int(interfaces.size()) == links - 1);
+        for (size_t i = 0; i < interfaces.size(); i++) {
+            CHECK(interfaces[i].getIndex() > 0);
+            CHECK(interfaces[i].getName() != "lo");
+        }
+    } catch (const ApplicationError &err) {
+        std::cerr << "Detecting the interfaces failed: " << err.what() << std::endl;
+        CHECK(false);
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+// Runs in a child process in its own network namespace.
+static int benchmark_namespace()
+{
+    if (unshare(CLONE_NEWNET) != 0) {
+        std::printf("Benchmark skipped, cannot create a network namespace: %s\n",
+                    std::strerror(errno));
+        return EXIT_SKIPPED;
+    }
+
+    Netlink netlink;
+    int created = 0;
+    try {
+        netlink.open();
+
+        // dummy interfaces need the dummy module, veth is more common
+        bool dummy = true;
+        try {
+            create_dummy(netlink, "bench0");
+            created = 1;
+        } catch (const ApplicationError &err) {
+            dummy = false;
+        }
+
+        double start = bw::monotonicSeconds();
+        while (created < BENCHMARK_INTERFACES) {
+            std::stringstream name, peer;
+            name << "bench" << created;
+            peer << "bench" << created + 1;
+
+            if (dummy) {
+                create_dummy(netlink, name.str());
+                created++;
+            } else {
+                create_veth(netlink, name.str(), peer.str());
+                created += 2;
+            }
+
+            // every fourth interface gets an address
+            if (created % 4 < (dummy ? 1 : 2))
+                add_address(netlink, name.str(), 0x0a000000 + created);
+        }
+        std::printf("Created %d %s interfaces in %.2f s\n", created,
+                    dummy ? "dummy" : "veth", bw::monotonicSeconds() - start);
+    } catch (const ApplicationError &err) {
+        std::cerr << "Creating the interfaces failed: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        NetworkHelper helper;
+
+        double start = bw::monotonicSeconds();
+        std::vector<NetworkInterface> interfaces;
+        try {
+            interfaces = helper.getInterfaces();
+        } catch (const ApplicationError &err) {
+            std::cerr << "Detecting the interfaces failed: " << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        double seconds = bw::monotonicSeconds() - start;
+
+        int withIp = 0;
+        for (size_t i = 0; i < interfaces.size(); i++)
+            if (interfaces[i].hasIp())
+                withIp++;
+
+        if (!CHECK(int(interfaces.size()) == created) || !CHECK(withIp > 0))
+            return EXIT_FAILURE;
+
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+
+    std::printf("Detected %d interfaces in %.2f ms (%.2f us/interface)\n", created,
+                best * 1e3, best * 1e6 / created);
+
+    return EXIT_SUCCESS;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void benchmark()
+{
+    std::cout.flush();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::perror("fork");
+        CHECK(false);
+        return;
+    }
+
+    if (pid == 0) {
+        int ret = benchmark_namespace();
+        std::fflush(NULL);
+        _exit(ret);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        std::perror("waitpid");
+        CHECK(false);
+        return;
+    }
+
+    CHECK(WIFEXITED(status) &&
+          (WEXITSTATUS(status) == EXIT_SUCCESS || WEXITSTATUS(status) == EXIT_SKIPPED));
+}
+
+/* }}} */
+
+/* ---------------------------------------------------------------------------------------------- */
+int main()
+{
+    test_empty_reply();
+    test_dump();
+
+    if (check_failures() == 0)
+        benchmark();
+
+    return check_result();
+}
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
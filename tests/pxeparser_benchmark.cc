@@ -0,0 +1,147 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+
+#include <libbw/clock.h>
+
+#include "pxeparser.h"
+
+//
+// Parses a generated configuration with 100k labels and prints the time
+// and the number of heap allocations per line. The test fails if the
+// configuration is not parsed completely.
+//
+
+#define LABELS      100000
+#define RUNS        5
+
+/* ---------------------------------------------------------------------------------------------- */
+static unsigned long allocations;
+
+/* ---------------------------------------------------------------------------------------------- */
+void *operator new(size_t size) throw (std::bad_alloc)
+{
+    allocations++;
+
+    void *p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void *operator new[](size_t size) throw (std::bad_alloc)
+{
+    return operator new(size);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void operator delete(void *p) throw ()
+{
+    std::free(p);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void operator delete[](void *p) throw ()
+{
+    std::free(p);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void operator delete(void *p, size_t) throw ()
+{
+    std::free(p);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void operator delete[](void *p, size_t) throw ()
+{
+    std::free(p);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+// Four lines per label like the generated menus, with tabs and CR line
+// endings on some of them.
+static std::string generate_config(int labels, size_t *lines)
+{
+    std::stringstream ss;
+
+    ss << "DEFAULT label0\n"
+       << "PROMPT 1\n"
+       << "TIMEOUT 100\n";
+    *lines = 3;
+
+    for (int i = 0; i < labels; i++) {
+        ss << "LABEL label" << i << "\n"
+           << "  KERNEL images/host" << i << "/vmlinuz\n"
+           << "\tAPPEND root=/dev/nfs nfsroot=10.0.0.1:/srv/root" << i
+           << " console=ttyS0,115200 quiet\r\n"
+           << "  INITRD images/host" << i << "/initrd\n";
+        *lines += 4;
+    }
+
+    return ss.str();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+int main()
+{
+    size_t lines;
+    std::string config = generate_config(LABELS, &lines);
+    double best = 0;
+    unsigned long parseAllocations = 0;
+
+    for (int run = 0; run < RUNS; run++) {
+        PxeParser parser;
+
+        unsigned long before = allocations;
+        double start = bw::monotonicSeconds();
+        try {
+            parser.parseBuffer(config.data(), config.size());
+        } catch (const ParseError &err) {
+            std::cerr << "Parsing failed: " << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        double seconds = bw::monotonicSeconds() - start;
+        parseAllocations = allocations - before;
+
+        const PxeConfig &pxeConfig = parser.getConfig();
+        const std::vector<PxeEntry> &entries = pxeConfig.getEntries();
+        if (entries.size() != LABELS || pxeConfig.getTimeout() != 100 ||
+                entries.back().getKernel() != "images/host99999/vmlinuz" ||
+                entries.back().getAppend().find("root99999 console") == std::string::npos) {
+            std::cerr << "The configuration has not been parsed completely" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+
+    std::printf("%d labels, %lu lines: %.1f ns/line, %.2f allocations/line\n",
+                LABELS, (unsigned long)lines, best * 1e9 / lines,
+                double(parseAllocations) / lines);
+
+    return EXIT_SUCCESS;
+}
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100:
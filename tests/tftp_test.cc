@@ -0,0 +1,517 @@
+/*
+ * (c) 2008-2010, Bernhard Walle <bernhard@bwalle.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "tftp.h"
+#include "check.h"
+
+//
+// Tests TftpClient against a TFTP server on the loopback interface: option
+// negotiation, servers that limit, ignore or refuse the options, a lost
+// block within a window and a file that ends on a block boundary. Afterwards
+// the throughput of each window size is printed.
+//
+
+#define TFTP_RRQ                1
+#define TFTP_DATA               3
+#define TFTP_ACK                4
+#define TFTP_ERROR              5
+#define TFTP_OACK               6
+
+#define SERVER_TIMEOUT_MS       1500
+#define SERVER_MAX_TIMEOUTS     5
+
+#define BENCHMARK_SIZE          (16 * 1024 * 1024)
+
+/* ---------------------------------------------------------------------------------------------- */
+static size_t write_string(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    static_cast<std::string *>(userp)->append(static_cast<char *>(buffer), size * nmemb);
+    return size * nmemb;
+}
+
+/* TestServer {{{ */
+
+/**
+ * @brief Behaviour of the TestServer
+ */
+struct ServerOptions {
+    bool            options;        /**< answers the options with an OACK */
+    bool            refuseOptions;  /**< answers a request with options with error 8 */
+    unsigned int    maxBlockSize;   /**< largest block size that is acknowledged */
+    unsigned int    maxWindowSize;  /**< largest window size that is acknowledged */
+    unsigned int    dropBlock;      /**< block that gets lost once, 0 for none */
+
+    ServerOptions()
+        : options(true), refuseOptions(false), maxBlockSize(65464), maxWindowSize(65535)
+        , dropBlock(0) {}
+};
+
+/**
+ * @brief TFTP server for one file
+ *
+ * Serves @c data for any file name in a thread, until one transfer has
+ * finished. Each transfer uses a new port like a real server.
+ */
+class TestServer {
+    public:
+        TestServer(const std::string &data, const ServerOptions &options);
+        ~TestServer();
+
+    public:
+        unsigned short getPort() const;
+        void start();
+        bool join();
+
+        unsigned int    requests;           /**< number of read requests */
+        unsigned int    acks;               /**< number of ACKs of data blocks */
+        unsigned int    requestedBlockSize; /**< blksize of the last request, 0 if none */
+        unsigned int    requestedWindowSize;/**< windowsize of the last request, 0 if none */
+
+    private:
+        static void *run(void *arg);
+        bool serve();
+        bool transfer(int fd, bool oack, unsigned int blockSize, unsigned int windowSize,
+                      bool tsize);
+        int receive(int fd, char *buffer, size_t len, struct sockaddr_in *from);
+
+    private:
+        std::string     m_data;
+        ServerOptions   m_options;
+        int             m_fd;
+        pthread_t       m_thread;
+        bool            m_success;
+};
+
+/* ---------------------------------------------------------------------------------------------- */
+TestServer::TestServer(const std::string &data, const ServerOptions &options)
+    : requests(0)
+    , acks(0)
+    , requestedBlockSize(0)
+    , requestedWindowSize(0)
+    , m_data(data)
+    , m_options(options)
+    , m_success(false)
+{
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    m_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (m_fd < 0 || bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        std::perror("Cannot create the server socket");
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+TestServer::~TestServer()
+{
+    close(m_fd);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+unsigned short TestServer::getPort() const
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    getsockname(m_fd, (struct sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void TestServer::start()
+{
+    pthread_create(&m_thread, NULL, run, this);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool TestServer::join()
+{
+    pthread_join(m_thread, NULL);
+    return m_success;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+void *TestServer::run(void *arg)
+{
+    TestServer *server = static_cast<TestServer *>(arg);
+
+    server->m_success = server->serve();
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+// Returns the length of the packet, 0 on timeout and -1 on errors.
+int TestServer::receive(int fd, char *buffer, size_t len, struct sockaddr_in *from)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, SERVER_TIMEOUT_MS) <= 0)
+        return 0;
+
+    socklen_t fromlen = sizeof(*from);
+    return recvfrom(fd, buffer, len, 0, (struct sockaddr *)from, &fromlen);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool TestServer::serve()
+{
+    char packet[1024];
+
+    // the client asks again without options if they are refused
+    for (int timeouts = 0; timeouts < SERVER_MAX_TIMEOUTS; ) {
+        struct sockaddr_in client;
+        int len = receive(m_fd, packet, sizeof(packet) - 1, &client);
+        if (len <= 0) {
+            timeouts++;
+            continue;
+        }
+        packet[len] = '\0';
+        if (len < 4 || packet[1] != TFTP_RRQ)
+            continue;
+
+        requests++;
+        requestedBlockSize = requestedWindowSize = 0;
+        bool tsize = false;
+
+        // file name and mode, then pairs of option name and value
+        const char *p = packet + 2;
+        const char *end = packet + len;
+        p += std::strlen(p) + 1;
+        p += std::strlen(p) + 1;
+        while (p < end) {
+            const char *name = p;
+            const char *value = name + std::strlen(name) + 1;
+            if (value >= end)
+                break;
+            p = value + std::strlen(value) + 1;
+
+            if (strcasecmp(name, "blksize") == 0)
+                requestedBlockSize = std::atoi(value);
+            else if (strcasecmp(name, "windowsize") == 0)
+                requestedWindowSize = std::atoi(value);
+            else if (strcasecmp(name, "tsize") == 0)
+                tsize = true;
+        }
+        bool hasOptions = requestedBlockSize || requestedWindowSize || tsize;
+
+        // a new port for the transfer
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        connect(fd, (struct sockaddr *)&client, sizeof(client));
+
+        if (hasOptions && m_options.refuseOptions) {
+            static const char refused[] = "\0\5\0\10Options not supported";
+            send(fd, refused, sizeof(refused), 0);
+            close(fd);
+            continue;
+        }
+
+        bool success;
+        if (hasOptions && m_options.options) {
+            unsigned int blockSize = requestedBlockSize ? requestedBlockSize : 512;
+            unsigned int windowSize = requestedWindowSize ? requestedWindowSize : 1;
+            success = transfer(fd, true, std::min(blockSize, m_options.maxBlockSize),
+                               std::min(windowSize, m_options.maxWindowSize), tsize);
+        } else
+            success = transfer(fd, false, 512, 1, false);
+
+        close(fd);
+        return success;
+    }
+
+    return false;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+bool TestServer::transfer(int fd, bool oack, unsigned int blockSize, unsigned int windowSize,
+                          bool tsize)
+{
+    std::vector<char> packet(blockSize + 4);
+    struct sockaddr_in from;
+
+    if (oack) {
+        std::stringstream ss;
+        ss << char(0) << char(TFTP_OACK);
+        if (requestedBlockSize)
+            ss << "blksize" << char(0) << blockSize << char(0);
+        if (requestedWindowSize)
+            ss << "windowsize" << char(0) << windowSize << char(0);
+        if (tsize)
+            ss << "tsize" << char(0) << m_data.size() << char(0);
+        std::string options = ss.str();
+
+        // wait for the ACK of block 0
+        for (int timeouts = 0; ; timeouts++) {
+            if (timeouts >= SERVER_MAX_TIMEOUTS)
+                return false;
+            send(fd, options.data(), options.size(), 0);
+            int len = receive(fd, &packet[0], packet.size(), &from);
+            if (len >= 4 && packet[1] == TFTP_ACK && packet[2] == 0 && packet[3] == 0)
+                break;
+            if (len >= 2 && packet[1] == TFTP_ERROR)
+                return false;
+        }
+    }
+
+    // the last block is shorter than the block size, maybe empty
+    unsigned int blocks = m_data.size() / blockSize + 1;
+    unsigned int acked = 0;
+    bool dropped = false;
+    int timeouts = 0;
+
+    while (acked < blocks) {
+        for (unsigned int block = acked + 1; block <= std::min(acked + windowSize, blocks);
+                block++) {
+            if (block == m_options.dropBlock && !dropped) {
+                dropped = true;
+                continue;
+            }
+
+            size_t offset = size_t(block - 1) * blockSize;
+            size_t len = std::min<size_t>(blockSize, m_data.size() - offset);
+            packet[0] = 0;
+            packet[1] = TFTP_DATA;
+            packet[2] = (block >> 8) & 0xff;
+            packet[3] = block & 0xff;
+            std::memcpy(&packet[4], m_data.data() + offset, len);
+            send(fd, &packet[0], len + 4, 0);
+        }
+
+        // an ACK moves the window, an ACK of an older block repeats it
+        for (;;) {
+            int len = receive(fd, &packet[0], packet.size(), &from);
+            if (len == 0) {
+                if (++timeouts > SERVER_MAX_TIMEOUTS)
+                    return false;
+                break;
+            }
+            if (len < 4 || packet[1] == TFTP_ERROR)
+                return false;
+            if (packet[1] != TFTP_ACK)
+                continue;
+
+            acks++;
+            unsigned short block = (unsigned char)packet[2] << 8 | (unsigned char)packet[3];
+            unsigned short advance = block - (unsigned short)acked;
+            if (advance <= windowSize) {
+                acked += advance;
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* }}} */
+/* Tests {{{ */
+
+/* ---------------------------------------------------------------------------------------------- */
+// Downloads data from a TestServer and checks the data and the server.
+static bool download(const std::string &data, const ServerOptions &options,
+                     unsigned int blockSize, unsigned int windowSize,
+                     TftpClient **result, TestServer **server)
+{
+    *server = new TestServer(data, options);
+    (*server)->start();
+
+    std::stringstream url;
+    url << "tftp://127.0.0.1:" << (*server)->getPort() << "/pxelinux.0";
+    std::string received;
+
+    *result = new TftpClient(url.str());
+    (*result)->setBlockSize(blockSize);
+    (*result)->setWindowSize(windowSize);
+    (*result)->setWriteFunction(write_string, &received);
+
+    bool ok = true;
+    try {
+        (*result)->perform();
+    } catch (const DownloadError &err) {
+        std::cerr << "Download failed: " << err.what() << std::endl;
+        ok = false;
+    }
+
+    ok = (*server)->join() && ok;
+    return CHECK(ok) && CHECK(received == data);
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_negotiation()
+{
+    std::string data = test_data(200000);
+    TftpClient *client;
+    TestServer *server;
+
+    if (download(data, ServerOptions(), 1468, 16, &client, &server)) {
+        CHECK(server->requests == 1);
+        CHECK(server->requestedBlockSize == 1468);
+        CHECK(server->requestedWindowSize == 16);
+        CHECK(client->getBlockSize() == 1468);
+        CHECK(client->getWindowSize() == 16);
+        CHECK(client->getTransferSize() == (long long)data.size());
+
+        // one ACK per window instead of one per block
+        unsigned int blocks = data.size() / 1468 + 1;
+        CHECK(server->acks <= blocks / 16 + 2);
+    }
+
+    delete client;
+    delete server;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_limited_options()
+{
+    std::string data = test_data(100000);
+    ServerOptions options;
+    TftpClient *client;
+    TestServer *server;
+
+    options.maxBlockSize = 1024;
+    options.maxWindowSize = 4;
+    if (download(data, options, 1468, 16, &client, &server)) {
+        CHECK(client->getBlockSize() == 1024);
+        CHECK(client->getWindowSize() == 4);
+    }
+
+    delete client;
+    delete server;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_ignored_options()
+{
+    // ends on a block boundary, so the last block is empty
+    std::string data = test_data(512 * 40);
+    ServerOptions options;
+    TftpClient *client;
+    TestServer *server;
+
+    options.options = false;
+    if (download(data, options, 1468, 16, &client, &server)) {
+        CHECK(server->requests == 1);
+        CHECK(client->getBlockSize() == 512);
+        CHECK(client->getWindowSize() == 1);
+        CHECK(server->acks == 41);
+    }
+
+    delete client;
+    delete server;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_refused_options()
+{
+    std::string data = test_data(30000);
+    ServerOptions options;
+    TftpClient *client;
+    TestServer *server;
+
+    options.refuseOptions = true;
+    if (download(data, options, 1468, 16, &client, &server)) {
+        // the second request has no options
+        CHECK(server->requests == 2);
+        CHECK(server->requestedBlockSize == 0);
+        CHECK(client->getBlockSize() == 512);
+    }
+
+    delete client;
+    delete server;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void test_lost_block()
+{
+    std::string data = test_data(100000);
+    ServerOptions options;
+    TftpClient *client;
+    TestServer *server;
+
+    options.dropBlock = 5;
+    if (download(data, options, 1468, 8, &client, &server))
+        CHECK(client->getRetransmits() >= 1);
+
+    delete client;
+    delete server;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+static void benchmark()
+{
+    static const unsigned int windowSizes[] = { 1, 4, 16, 64 };
+    std::string data = test_data(BENCHMARK_SIZE);
+
+    for (size_t i = 0; i < sizeof(windowSizes) / sizeof(windowSizes[0]); i++) {
+        TftpClient *client;
+        TestServer *server;
+
+        double start = bw::monotonicSeconds();
+        bool ok = download(data, ServerOptions(), 1468, windowSizes[i], &client, &server);
+        double seconds = bw::monotonicSeconds() - start;
+
+        if (ok)
+            std::printf("windowsize %2u: %7.1f MB/s, %u ACKs\n", windowSizes[i],
+                        data.size() / seconds / (1024 * 1024), server->acks);
+
+        delete client;
+        delete server;
+    }
+}
+
+/* }}} */
+
+/* ---------------------------------------------------------------------------------------------- */
+int main()
+{
+    test_negotiation();
+    test_limited_options();
+    test_ignored_options();
+    test_refused_options();
+    test_lost_block();
+
+    if (check_failures() == 0)
+        benchmark();
+
+    return check_result();
+}
+
+// :tabSize=4:indentSize=4:noTabs=true:mode=c++:folding=explicit:collapseFolds=1:maxLineLen=100: